@@ -0,0 +1,27 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stdbool.h>
+#include <stdio.h>
+#include "libvslc.h"
+
+/* Compile independent source files on a pool of worker threads, each with
+ * a context of its own. The output for a.vsl is written to a.S in the
+ * output directory, and diagnostics go to stderr after the source path.
+ * Workers take files from their own share of the list first, and steal
+ * from the shares of the others when theirs runs out. Files that would
+ * have the same output are refused before any is compiled. With
+ * report_time set, the throughput goes to stderr. Returns 0 if every file
+ * compiled.
+ */
+int compile_batch (
+    char **paths, size_t n_paths, const char *output_directory,
+    int n_workers, const vslc_options_t *options,
+    const char *interfaces, size_t interfaces_length, bool report_time
+);
+
+/* Read the rest of a stream into memory, in vslc.c, for the command line
+ * and the batch compiler alike
+ */
+char *read_file ( FILE *in, size_t *length );
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef DRIVER_H
+#define DRIVER_H
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Builds an executable without intermediate files. The program is piped
+ * into the system assembler as it is generated, the assembler writes the
+ * object to an anonymous file in memory, and the linker reads it there.
+ * The assembler and linker are as and cc, unless AS and CC name others.
+ */
+typedef struct {
+    FILE *assembly;             // Where the compiler writes the program
+    pid_t assembler;
+    int object;                 // Memory file holding the object
+    bool freestanding;          // Link statically, without the C library
+    struct timespec started, generated, assembled, linked;
+} driver_t;
+
+/* Start the assembler, reading what is written to driver->assembly.
+ * Returns 0 on success.
+ */
+int start_driver ( driver_t *driver );
+
+/* Finish assembling, and link the executable at path. With report set, the
+ * time of each stage goes to stderr. Returns 0 on success.
+ */
+int finish_driver ( driver_t *driver, const char *path, bool report );
+
+/* Stop building, after the compilation failed */
+void cancel_driver ( driver_t *driver );
+
+#endif
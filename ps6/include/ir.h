@@ -8,6 +8,10 @@ typedef struct n {
     struct s *entry;
     uint64_t n_children;
     struct n **children;
+    size_t line;        // Source line where the parser made the node
+    size_t registers;   // One more than needed to evaluate an expression,
+                        // 0 until the lowering labels it, or until the
+                        // whole tree is labelled before parallel lowering
 } node_t;
 
 // Export the initializer function, it is needed by the parser
@@ -25,6 +29,8 @@ typedef struct s {
     node_t *node;
     size_t seq;
     size_t nparms;
+    size_t nlocals;
     tlhash_t *locals;
+    size_t line;        // Source line of the declaration
 } symbol_t;
 #endif
@@ -0,0 +1,87 @@
+#ifndef LIBVSLC_H
+#define LIBVSLC_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Library interface of the VSL compiler.
+ *
+ * All state of a compilation lives in a context, so any number of contexts
+ * can compile independently of each other, one thread per context at a time.
+ * A context can be reused for any number of compilations, and keeps its
+ * allocations warm between them.
+ */
+
+typedef struct vslc_context vslc_context_t;
+
+typedef struct {
+    bool print_full_tree;       // Output the syntax tree as parsed
+    bool print_simplified_tree; // Output the simplified syntax tree
+    bool print_symbol_table;    // List the symbol table in the diagnostics
+    bool generate_program;      // Output the generated assembly
+    bool new_print_style;       // Print trees like the tree command
+    bool library_unit;          // Do not generate a program entry point
+    bool share_expressions;     // Hash-cons identical pure subexpressions
+    bool export_interface;      // Produce the interface summary of the unit
+    bool object_code;           // Output an ELF object instead of assembly
+    bool freestanding;          // Use a runtime of its own instead of libc
+    bool print_ir;              // Output three-address code, not assembly
+    bool optimize;              // Propagate constants over SSA form
+    bool report_passes;         // Report what the optimizations changed
+    int threads;                // Threads generating functions, if over 1
+    const char *cache_directory; // Reuse code of unchanged functions, or NULL
+    size_t cache_limit;         // Bytes the cache directory may hold
+} vslc_options_t;
+
+/* Buffers are allocated with malloc and owned by the caller */
+typedef struct {
+    char *output;             // Printed trees and generated assembly
+    size_t output_length;
+    char *diagnostics;        // Error messages and symbol table listing
+    size_t diagnostics_length;
+    char *interface;          // Interface summary, if it was requested
+    size_t interface_length;
+} vslc_result_t;
+
+extern const vslc_options_t vslc_default_options;
+
+vslc_context_t *vslc_context_create ( const vslc_options_t *options );
+void vslc_context_destroy ( vslc_context_t *ctx );
+void vslc_set_options ( vslc_context_t *ctx, const vslc_options_t *options );
+
+/* Make the symbols of an interface summary visible to later compilations */
+int vslc_import_interface (
+    vslc_context_t *ctx, const char *summary, size_t length
+);
+void vslc_forget_interfaces ( vslc_context_t *ctx );
+
+/* Compile a source buffer. Returns 0 on success, and fills in the result
+ * whether or not the compilation succeeded.
+ */
+int vslc_compile (
+    vslc_context_t *ctx, const char *source, size_t length,
+    vslc_result_t *result
+);
+
+/* Compile as above, but write the generated code to a stream as it is
+ * generated, instead of into the output of the result, unless an object is
+ * made. The code can then be consumed while the compilation goes on.
+ */
+int vslc_compile_to (
+    vslc_context_t *ctx, const char *source, size_t length, FILE *code,
+    vslc_result_t *result
+);
+void vslc_result_free ( vslc_result_t *result );
+
+/* Compile a source stream straight to the output streams, one function at
+ * a time, so memory use is bounded by the largest function rather than by
+ * the program. Globals are found by a pass over the tokens first, so the
+ * source must be seekable. The interface summary is written if the stream
+ * for it is not NULL. Returns 0 on success.
+ */
+int vslc_compile_stream (
+    vslc_context_t *ctx, FILE *source, FILE *output, FILE *diagnostics,
+    FILE *interface
+);
+
+#endif
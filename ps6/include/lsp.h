@@ -0,0 +1,13 @@
+#ifndef LSP_H
+#define LSP_H
+#include <stdio.h>
+
+/* Language server for editors, speaking the language server protocol over
+ * a pair of streams. The syntax trees and symbol tables of open documents
+ * stay resident, and an edit only reanalyses the top-level functions and
+ * declarations it touched, and the functions using globals it changed.
+ * Returns when the client exits.
+ */
+int serve_language ( FILE *in, FILE *out );
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SERVER_H
+#define SERVER_H
+#include <stdint.h>
+#include "libvslc.h"
+
+/* Compile server: one request and one response per connection over a Unix
+ * domain socket. Each message is a header followed by the buffers it
+ * gives the lengths of, in the order of the header fields.
+ */
+
+typedef struct {
+    uint32_t options;           // vslc_options_t, one bit per flag
+    uint32_t threads;           // Of vslc_options_t
+    uint64_t interface_length;  // Concatenated interface summaries
+    uint64_t source_length;
+} request_header_t;
+
+typedef struct {
+    int32_t status;
+    uint32_t reserved;
+    uint64_t output_length;
+    uint64_t diagnostics_length;
+    uint64_t interface_length;
+} response_header_t;
+
+/* Serve compile requests on a pool of worker threads, does not return.
+ * Requests are compiled with the cache settings of the defaults.
+ */
+int serve (
+    const char *socket_path, int n_workers, const vslc_options_t *defaults
+);
+
+/* Compile through a server, with the same outcome as vslc_compile */
+int compile_remote (
+    const char *socket_path, const vslc_options_t *options,
+    const char *interfaces, size_t interfaces_length,
+    const char *source, size_t length, vslc_result_t *result
+);
+
+#endif
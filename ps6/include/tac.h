@@ -0,0 +1,130 @@
+#ifndef TAC_H
+#define TAC_H
+
+/* Three-address code of one function, lowered from its bound syntax tree in
+ * tac.c, and made into assembly by the generator. Instructions work on
+ * values, numbered per function: the parameters and locals first, then the
+ * temporaries that hold intermediate results. Globals live in memory, and
+ * are only read and written by moves. In SSA form, made in ssa.c, every
+ * assignment to a variable makes a new value of it, and phi instructions at
+ * the start of a block merge the values that reach it.
+ */
+
+typedef enum {
+    TAC_MOVE,           // result = left
+    TAC_NEGATE,         // result = -left
+    TAC_NOT,            // result = ~left
+    TAC_ADD,            // result = left + right, and so on
+    TAC_SUBTRACT,
+    TAC_MULTIPLY,
+    TAC_DIVIDE,
+    TAC_OR,
+    TAC_XOR,
+    TAC_AND,
+    TAC_CALL,           // result = function ( arguments )
+    TAC_PRINT_INT,      // Print left, and a space
+    TAC_PRINT_TEXT,     // Print the string left
+    TAC_PRINT_NEWLINE,
+    TAC_JUMP,           // To the only successor
+    TAC_BRANCH,         // To the first successor if the relation holds
+    TAC_RETURN,         // Return left
+    TAC_PHI             // result = the argument from the predecessor taken
+} tac_opcode_t;
+
+typedef enum {
+    TAC_LESS, TAC_GREATER, TAC_EQUAL
+} tac_relation_t;
+
+typedef enum {
+    TAC_NONE, TAC_VALUE, TAC_CONSTANT, TAC_GLOBAL, TAC_STRING
+} tac_kind_t;
+
+typedef struct {
+    tac_kind_t kind;
+    int64_t number;     // Constant, or index of the value or string
+    symbol_t *global;   // Global variable
+} tac_operand_t;
+
+typedef struct {
+    tac_opcode_t opcode;
+    tac_relation_t relation;    // Of a branch
+    tac_operand_t result, left, right;
+    symbol_t *function;         // Called function
+    size_t first_argument, n_arguments; // In the argument list, which has
+                                        // one per predecessor for a phi
+} tac_instruction_t;
+
+/* Every block ends in a jump, branch or return */
+typedef struct {
+    tac_instruction_t *instructions;
+    size_t n_instructions, capacity;
+    size_t successors[2], n_successors;
+    size_t first_predecessor, n_predecessors; // In the predecessor list
+} tac_block_t;
+
+/* Where a value is kept, chosen in regalloc.c. Values that are never used
+ * have no register and offset 0.
+ */
+typedef struct {
+    const char *reg;    // Register, or NULL if in the frame
+    int64_t offset;     // From the frame pointer, if in the frame
+    size_t last_live;   // Last instruction it is live in, counting over the
+                        // blocks in order
+} tac_location_t;
+
+/* The allocations are kept when a function is lowered into the same
+ * structure again
+ */
+typedef struct {
+    symbol_t *symbol;
+    tac_block_t *blocks;        // The entry block first
+    size_t n_blocks, block_capacity;
+    symbol_t **variables;       // Parameter or local held by each value
+    size_t n_values, value_capacity;
+    tac_operand_t *arguments;   // Arguments of all calls
+    size_t n_arguments, argument_capacity;
+    size_t *predecessors;       // Predecessors of all blocks
+    size_t *block_numbers;      // Work space of passes over the blocks
+    size_t *slot_values;        // Value of each local stack slot
+    size_t n_slots;
+    tac_location_t *locations;  // Of each value
+    size_t location_capacity;
+    const char *saved_registers[5]; // Callee-saved registers used, pushed
+    size_t n_saved_registers;       // after the frame pointer
+    size_t n_spill_slots;           // Frame slots below them
+} tac_function_t;
+
+/* What the optimizations changed, summed over the functions */
+#define PEEPHOLE_RULES 10
+typedef struct {
+    size_t instructions_removed, branches_removed;
+    size_t peephole_hits[PEEPHOLE_RULES];       // Of each rule, in peephole.c
+    size_t peephole_removed, peephole_copied;   // Assembly instructions
+} tac_statistics_t;
+
+extern const char *peephole_rules[PEEPHOLE_RULES]; // Names of the rules
+
+void lower_function (
+    vslc_context_t *ctx, symbol_t *function, tac_function_t *code
+);
+void label_registers ( node_t *node );
+void print_tac ( vslc_context_t *ctx, tac_function_t *code );
+void tac_free ( tac_function_t *code );
+
+/* Building blocks of the passes */
+size_t tac_new_block ( tac_function_t *code );
+size_t tac_new_value ( tac_function_t *code, symbol_t *variable );
+size_t tac_add_arguments ( tac_function_t *code, size_t n_arguments );
+tac_instruction_t *tac_insert ( tac_block_t *block, size_t index );
+void tac_move_blocks ( tac_function_t *code, size_t *number );
+void tac_remove_unreachable_blocks ( tac_function_t *code );
+void tac_find_predecessors ( tac_function_t *code );
+
+/* Passes over SSA form, in ssa.c */
+void construct_ssa ( tac_function_t *code );
+void propagate_constants ( tac_function_t *code, tac_statistics_t *stats );
+void destruct_ssa ( tac_function_t *code );
+
+/* Linear scan register allocation, in regalloc.c */
+void allocate_registers ( tac_function_t *code );
+#endif
@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <setjmp.h>
 
 // Prototypes for the hash table functions
 #include "tlhash.h"
@@ -16,35 +17,143 @@
 // Definition of the tree node type
 #include "ir.h"
 
+// Public interface of the compiler library
+#include "libvslc.h"
+
+// Three-address code of functions, between the tree and the generator
+#include "tac.h"
+
+// Opaque state of the reentrant scanner generated by flex
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
+
+/* Growing buffer that generated code is appended to, in emit.c */
+typedef struct {
+    char *data;
+    size_t length, capacity;
+} buffer_t;
+
+/* All state of one compilation */
+struct vslc_context {
+    vslc_options_t options;
+
+    node_t *root;               // Syntax tree
+    tlhash_t *global_names;     // Symbol table
+    tlhash_t *extern_names;     // Symbols imported from other units
+    char **string_list;         // List of strings in the source
+    size_t n_string_list;       // String list capacity (grow on demand)
+    size_t stringc;             // String count
+    size_t string_base;         // Index of the first string in the list
+    tlhash_t *string_indices;   // Index of each string, to share them
+
+    // Name resolution, in ir.c
+    tlhash_t **scopes;
+    size_t n_scopes, scope_depth, next_slot;
+
+    // Hash-consed expressions, by structure and by address, in tree.c
+    tlhash_t *cons_table, *shared_nodes;
+    node_t *free_nodes;         // Finalized nodes, kept for reuse
+
+    // Code generation, in generator.c
+    tac_function_t lowered;     // Function being generated, in tac.c
+    buffer_t *code;             // Where the generated program is emitted
+    buffer_t fragment;          // Code of one function, on its way to cache
+    FILE *code_stream;          // Takes the code as it is made, if not NULL
+
+    // Streaming compilation, in libvslc.c
+    bool streaming;             // Globals are compiled as they are parsed
+    size_t n_streamed;          // Functions parsed so far
+
+    // Generated code of unchanged functions, in cache.c
+    uint64_t compiler_identity;
+    size_t cache_hits, cache_misses;
+
+    tac_statistics_t statistics; // Of the optimizations, in ssa.c and
+                                 // peephole.c
+
+    yyscan_t scanner;
+    FILE *out;                  // Printed trees and generated program
+    FILE *diag;                 // Error messages and symbol table listing
+    jmp_buf error_exit;         // Where compile_error returns to
+    size_t error_line;          // Source line of the last error, if known
+};
+
 // Token definitions and other things from bison, needs def. of node type
 #include "y.tab.h"
 
 /* This is generated from the bison grammar, calls on the flex specification */
-int yyerror ( const char *error );
+int yyerror ( yyscan_t scanner, vslc_context_t *ctx, const char *error );
+
+/* These are defined in the scanner generated by flex */
+extern int yylex ( YYSTYPE *lvalp, yyscan_t scanner );
+extern int yylex_init ( yyscan_t *scanner );
+extern int yylex_destroy ( yyscan_t scanner );
+extern void yyset_in ( FILE *in, yyscan_t scanner );
+extern char *yyget_text ( yyscan_t scanner );
+extern int yyget_lineno ( yyscan_t scanner );
+
+/* Report an error in the source, and abandon the compilation */
+void compile_error ( vslc_context_t *ctx, const char *format, ... );
+
+/* Compiler passes, called in order from vslc_compile in libvslc.c */
+void simplify_syntax_tree ( vslc_context_t *ctx );
+void hash_cons_syntax_tree ( vslc_context_t *ctx );
+void print_syntax_tree ( vslc_context_t *ctx );
+void destroy_syntax_tree ( vslc_context_t *ctx );
+void destroy_subtree ( vslc_context_t *ctx, node_t *discard );
+node_t *node_alloc ( vslc_context_t *ctx );
+void destroy_node_pool ( vslc_context_t *ctx );
+
+int stream_global ( vslc_context_t *ctx, node_t *global );
 
-/* These are defined in the parser generated by bison */
-extern int yylineno;
-extern int yylex ( void );
-extern char yytext[];
+void create_symbol_table ( vslc_context_t *ctx );
+void predeclare_globals ( vslc_context_t *ctx );
+void declare_globals ( tlhash_t *table, node_t *global_list );
+void bind_function ( vslc_context_t *ctx, symbol_t *function );
+void destroy_globals ( tlhash_t *table );
+void release_strings ( vslc_context_t *ctx );
+void print_symbol_table ( vslc_context_t *ctx );
+void destroy_symbol_table ( vslc_context_t *ctx );
 
-/* Global state */
-extern node_t *root;
+int import_interface ( vslc_context_t *ctx, FILE *summary );
+void export_interface ( vslc_context_t *ctx, FILE *summary );
+void destroy_interfaces ( vslc_context_t *ctx );
 
-// Moving global defs to global header
+void generate_program ( vslc_context_t *ctx );
+void generate_program_start ( vslc_context_t *ctx );
+void generate_streamed_function ( vslc_context_t *ctx, symbol_t *function );
+void generate_program_end ( vslc_context_t *ctx );
+void generate_runtime ( vslc_context_t *ctx );
 
-extern tlhash_t *global_names;  // Defined in ir.c, used by generator.c
-extern char **string_list;      // Defined in ir.c, used by generator.c
-extern size_t stringc;          // Defined in ir.c, used by generator.c
+/* Rewrite the assembly of a function, from start to the end of the code */
+void optimize_peephole ( vslc_context_t *ctx, size_t start );
 
-/* Global routines, called from main in vslc.c */
-void simplify_syntax_tree ( void );
-void print_syntax_tree ( void );
-void destroy_syntax_tree ( void );
+/* Replace the generated assembly with the ELF object it assembles to */
+void assemble_object ( vslc_context_t *ctx );
 
-void create_symbol_table ( void );
-void print_symbol_table ( void );
-void destroy_symbol_table ( void );
+/* Assembly is emitted by appending to a buffer, with a format where %s is
+ * a string, %d an int64_t, %u a size_t and %% a percent sign
+ */
+void emit ( buffer_t *buffer, const char *format, ... );
+void emit_string ( buffer_t *buffer, const char *string );
+void emit_bytes ( buffer_t *buffer, const void *data, size_t length );
+void emit_flush ( buffer_t *buffer, FILE *out );
+void buffer_free ( buffer_t *buffer );
 
-void generate_program ( void );
+/* Cache of generated functions, keyed by a fingerprint of everything their
+ * code depends on
+ */
+#define CACHE_KEY_LENGTH 32
+void cache_identify ( vslc_context_t *ctx );
+void function_fingerprint (
+    vslc_context_t *ctx, symbol_t *function, char key[CACHE_KEY_LENGTH+1]
+);
+bool cache_fetch ( vslc_context_t *ctx, const char *key, buffer_t *code );
+void cache_store (
+    vslc_context_t *ctx, const char *key, const char *code, size_t length
+);
+void cache_trim ( vslc_context_t *ctx );
 
 #endif
@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <batch.h>
+#include <tlhash.h>
+
+/* Files of a worker not taken yet, as a range of the path list. The owner
+ * takes from the front and thieves from the back, so they only contend
+ * for the last file.
+ */
+typedef struct {
+    size_t front, back;
+    pthread_mutex_t lock;
+} share_t;
+
+static struct {
+    char **paths;
+    char **output_paths; // Where the output of each file is written
+    const char *output_directory;
+    vslc_options_t options;
+    const char *interfaces;
+    size_t interfaces_length;
+    share_t *shares;
+    int n_workers;
+    size_t n_failed;
+    pthread_mutex_t report_lock; // Diagnostics and the failure count
+} batch = {.report_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void *worker(void *arg);
+static bool take_file(int w, size_t *index);
+static void compile_file(vslc_context_t *ctx, size_t index);
+static void report(const char *path, const char *diagnostics, size_t length);
+static char *output_path(const char *path);
+static bool find_clashes(size_t n_paths);
+static int run_workers(size_t n_paths, int n_workers, bool report_time);
+
+int compile_batch(char **paths, size_t n_paths, const char *output_directory,
+                  int n_workers, const vslc_options_t *options,
+                  const char *interfaces, size_t interfaces_length,
+                  bool report_time) {
+    batch.paths = paths;
+    batch.output_directory = output_directory;
+    // The files are compiled in parallel, the functions of each serially
+    batch.options = *options;
+    batch.options.threads = 1;
+    batch.output_paths = malloc(n_paths * sizeof(char *));
+    for (size_t i = 0; i < n_paths; i++)
+        batch.output_paths[i] = output_path(paths[i]);
+    batch.interfaces = interfaces;
+    batch.interfaces_length = interfaces_length;
+
+    int status = EXIT_FAILURE;
+    if (find_clashes(n_paths))
+        fprintf(stderr, "vslc: no files compiled\n");
+    else if (mkdir(output_directory, 0777) != 0 && errno != EEXIST)
+        perror(output_directory);
+    else
+        status = run_workers(n_paths, n_workers, report_time);
+
+    for (size_t i = 0; i < n_paths; i++)
+        free(batch.output_paths[i]);
+    free(batch.output_paths);
+    return status;
+}
+
+static int run_workers(size_t n_paths, int n_workers, bool report_time) {
+    if (n_workers < 1)
+        n_workers = 1;
+    if ((size_t)n_workers > n_paths)
+        n_workers = n_paths;
+    batch.n_workers = n_workers;
+    batch.n_failed = 0;
+
+    // Contiguous shares of nearly equal length
+    batch.shares = malloc(n_workers * sizeof(share_t));
+    for (int w = 0; w < n_workers; w++) {
+        batch.shares[w].front = n_paths * w / n_workers;
+        batch.shares[w].back = n_paths * (w + 1) / n_workers;
+        pthread_mutex_init(&batch.shares[w].lock, NULL);
+    }
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t threads[n_workers];
+    int n_started = 0;
+    for (; n_started < n_workers; n_started++)
+        if (pthread_create(&threads[n_started], NULL, worker,
+                           (void *)(intptr_t)n_started) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    // The shares of threads that did not start are stolen by the others
+    if (n_started == 0)
+        worker((void *)(intptr_t)0);
+    for (int w = 0; w < n_started; w++)
+        pthread_join(threads[w], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    double seconds =
+        (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+    if (report_time)
+        fprintf(stderr,
+                "vslc: %zu files in %.3f s, %.0f files/s on %d workers\n",
+                n_paths, seconds, n_paths / seconds, n_workers);
+
+    for (int w = 0; w < n_workers; w++)
+        pthread_mutex_destroy(&batch.shares[w].lock);
+    free(batch.shares);
+    return batch.n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Files of the same name in different directories would have the same
+ * output, and be written over each other. Reports each such pair, and
+ * returns true if there were any.
+ */
+static bool find_clashes(size_t n_paths) {
+    tlhash_t outputs;
+    tlhash_init(&outputs, n_paths);
+    bool clash = false;
+    for (size_t i = 0; i < n_paths; i++) {
+        char *out_path = batch.output_paths[i];
+        void *first;
+        if (tlhash_lookup(&outputs, out_path, strlen(out_path) + 1, &first) ==
+            TLHASH_SUCCESS) {
+            fprintf(stderr, "vslc: %s and %s would both be written to %s\n",
+                    (char *)first, batch.paths[i], out_path);
+            clash = true;
+        } else {
+            tlhash_insert(&outputs, out_path, strlen(out_path) + 1,
+                          batch.paths[i]);
+        }
+    }
+    tlhash_finalize(&outputs);
+    return clash;
+}
+
+static void *worker(void *arg) {
+    int w = (intptr_t)arg;
+    // One context per worker, its node pool and tables warm between files
+    vslc_context_t *ctx = vslc_context_create(&batch.options);
+    if (vslc_import_interface(ctx, batch.interfaces,
+                              batch.interfaces_length)) {
+        fprintf(stderr, "malformed interface summary\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t index;
+    while (take_file(w, &index))
+        compile_file(ctx, index);
+    vslc_context_destroy(ctx);
+    return NULL;
+}
+
+/* The next file of a worker's own share, or one stolen from another */
+static bool take_file(int w, size_t *index) {
+    share_t *own = &batch.shares[w];
+    pthread_mutex_lock(&own->lock);
+    bool found = own->front < own->back;
+    if (found)
+        *index = own->front++;
+    pthread_mutex_unlock(&own->lock);
+
+    for (int v = 1; v < batch.n_workers && !found; v++) {
+        share_t *victim = &batch.shares[(w + v) % batch.n_workers];
+        pthread_mutex_lock(&victim->lock);
+        found = victim->front < victim->back;
+        if (found)
+            *index = --victim->back;
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return found;
+}
+
+static void compile_file(vslc_context_t *ctx, size_t index) {
+    const char *path = batch.paths[index];
+    size_t length;
+    FILE *in = fopen(path, "r");
+    char *source = (in != NULL) ? read_file(in, &length) : NULL; // In vslc.c
+    if (in != NULL)
+        fclose(in);
+    if (source == NULL) {
+        pthread_mutex_lock(&batch.report_lock);
+        perror(path);
+        batch.n_failed += 1;
+        pthread_mutex_unlock(&batch.report_lock);
+        return;
+    }
+
+    vslc_result_t result;
+    int status = vslc_compile(ctx, source, length, &result);
+    const char *out_path = batch.output_paths[index];
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL || fwrite(result.output, 1, result.output_length, out) !=
+                           result.output_length) {
+        pthread_mutex_lock(&batch.report_lock);
+        perror(out_path);
+        pthread_mutex_unlock(&batch.report_lock);
+        status = EXIT_FAILURE;
+    }
+    if (out != NULL && fclose(out) != 0)
+        status = EXIT_FAILURE;
+
+    report(path, result.diagnostics, result.diagnostics_length);
+    if (status != EXIT_SUCCESS) {
+        pthread_mutex_lock(&batch.report_lock);
+        batch.n_failed += 1;
+        pthread_mutex_unlock(&batch.report_lock);
+    }
+    vslc_result_free(&result);
+    free(source);
+}
+
+/* Diagnostics of one file, each line after its path */
+static void report(const char *path, const char *diagnostics, size_t length) {
+    pthread_mutex_lock(&batch.report_lock);
+    const char *line = diagnostics, *end = diagnostics + length;
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t line_length = (newline != NULL ? newline : end) - line;
+        fprintf(stderr, "%s: %.*s\n", path, (int)line_length, line);
+        line += line_length + 1;
+    }
+    pthread_mutex_unlock(&batch.report_lock);
+}
+
+/* dir/a.vsl becomes output_directory/a.S, or a.o for objects */
+static char *output_path(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    size_t name_length = strlen(name);
+    if (name_length > 4 && !strcmp(name + name_length - 4, ".vsl"))
+        name_length -= 4;
+    size_t size = strlen(batch.output_directory) + name_length + 4;
+    char *out_path = malloc(size);
+    snprintf(out_path, size, "%s/%.*s.%c", batch.output_directory,
+             (int)name_length, name, batch.options.object_code ? 'o' : 'S');
+    return out_path;
+}
@@ -0,0 +1,309 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vslc.h>
+
+/* The code generated for a function depends on its syntax tree, the
+ * signatures of the globals it refers to, the string table indices of its
+ * strings, the options that change code generation, and the compiler
+ * itself. A fingerprint of all of these names its file in the cache
+ * directory, so a stale entry is never found, only evicted once it has
+ * gone unused for longest.
+ */
+
+typedef struct {
+    uint64_t h[2];
+} fingerprint_t;
+
+typedef struct {
+    char name[CACHE_KEY_LENGTH+3];
+    off_t size;
+    struct timespec used;
+} cache_entry_t;
+
+static void hash_bytes ( fingerprint_t *f, const void *data, size_t length );
+static void hash_string ( fingerprint_t *f, const char *string );
+static void hash_number ( fingerprint_t *f, uint64_t number );
+static void hash_subtree (
+    vslc_context_t *ctx, fingerprint_t *f, node_t *node
+);
+static uint64_t compiler_identity ( void );
+static void entry_path (
+    vslc_context_t *ctx, char *path, size_t size, const char *name
+);
+static int least_recently_used ( const void *a, const void *b );
+
+
+/* External interface */
+
+void
+function_fingerprint (
+    vslc_context_t *ctx, symbol_t *function, char key[CACHE_KEY_LENGTH+1]
+)
+{
+    /* Two FNV-1a hashes from different offset bases */
+    fingerprint_t f = { { 0xcbf29ce484222325, 0x84222325cbf29ce4 } };
+    cache_identify ( ctx );
+    hash_number ( &f, ctx->compiler_identity );
+
+    /* Options that change the generated functions */
+    hash_number ( &f, ctx->options.share_expressions );
+    hash_number ( &f, ctx->options.freestanding );
+    hash_number ( &f, ctx->options.print_ir );
+    hash_number ( &f, ctx->options.optimize );
+
+    hash_string ( &f, function->name );
+    hash_number ( &f, function->nparms );
+    hash_number ( &f, function->nlocals );
+    hash_subtree ( ctx, &f, function->node );
+    snprintf ( key, CACHE_KEY_LENGTH+1, "%016" PRIx64 "%016" PRIx64,
+        f.h[0], f.h[1]
+    );
+}
+
+
+/* Identify the compiler once per context, before threads fingerprint */
+void
+cache_identify ( vslc_context_t *ctx )
+{
+    if ( ctx->compiler_identity == 0 )
+        ctx->compiler_identity = compiler_identity ();
+}
+
+
+/* Append the cached code of a function to code, returns false on a miss */
+bool
+cache_fetch ( vslc_context_t *ctx, const char *key, buffer_t *code )
+{
+    char name[CACHE_KEY_LENGTH+3];
+    snprintf ( name, sizeof(name), "%s.s", key );
+    size_t size = strlen ( ctx->options.cache_directory ) + sizeof(name) + 1;
+    char path[size];
+    entry_path ( ctx, path, size, name );
+
+    FILE *in = fopen ( path, "r" );
+    if ( in == NULL )
+        return false;
+    size_t start = code->length;
+    char buffer[4096];
+    size_t n;
+    while ( (n = fread ( buffer, 1, sizeof(buffer), in )) > 0 )
+        emit_bytes ( code, buffer, n ); // In emit.c
+    bool complete = !ferror ( in );
+    fclose ( in );
+
+    /* Only whole entries are used, and using one makes it recent */
+    if ( complete )
+        utimensat ( AT_FDCWD, path, NULL, 0 );
+    else
+        code->length = start;
+    return complete;
+}
+
+
+/* Entries are written under a temporary name and renamed into place, so
+ * concurrent compilations never see a partial one
+ */
+void
+cache_store (
+    vslc_context_t *ctx, const char *key, const char *code, size_t length
+)
+{
+    char name[CACHE_KEY_LENGTH+3], temporary[CACHE_KEY_LENGTH+48];
+    snprintf ( name, sizeof(name), "%s.s", key );
+    snprintf ( temporary, sizeof(temporary), "%s.%ld.%p.tmp",
+        key, (long)getpid(), (void *)ctx
+    );
+    size_t size = strlen(ctx->options.cache_directory) + sizeof(temporary) + 1;
+    char path[size], temporary_path[size];
+    entry_path ( ctx, path, size, name );
+    entry_path ( ctx, temporary_path, size, temporary );
+
+    FILE *entry = fopen ( temporary_path, "w" );
+    if ( entry == NULL && errno == ENOENT &&
+         mkdir ( ctx->options.cache_directory, 0777 ) == 0 )
+        entry = fopen ( temporary_path, "w" );
+    if ( entry == NULL )
+        return;
+    fwrite ( code, 1, length, entry );
+    if ( fclose ( entry ) == 0 )
+        rename ( temporary_path, path );
+    else
+        unlink ( temporary_path );
+}
+
+
+/* Evict the least recently used entries until the cache fits its limit */
+void
+cache_trim ( vslc_context_t *ctx )
+{
+    DIR *directory = opendir ( ctx->options.cache_directory );
+    if ( directory == NULL )
+        return;
+    size_t n_entries = 0, capacity = 64;
+    cache_entry_t *entries = malloc ( capacity * sizeof(cache_entry_t) );
+    size_t total = 0;
+
+    struct dirent *file;
+    while ( (file = readdir ( directory )) != NULL )
+    {
+        size_t length = strlen ( file->d_name );
+        if ( length != CACHE_KEY_LENGTH+2 ||
+             strcmp ( file->d_name + CACHE_KEY_LENGTH, ".s" ) )
+            continue;
+        size_t size = strlen(ctx->options.cache_directory) + length + 2;
+        char path[size];
+        struct stat status;
+        entry_path ( ctx, path, size, file->d_name );
+        if ( stat ( path, &status ) != 0 )
+            continue;
+        if ( n_entries == capacity )
+        {
+            capacity *= 2;
+            entries = realloc ( entries, capacity * sizeof(cache_entry_t) );
+        }
+        strcpy ( entries[n_entries].name, file->d_name );
+        entries[n_entries].size = status.st_size;
+        entries[n_entries].used = status.st_mtim;
+        total += status.st_size;
+        n_entries += 1;
+    }
+    closedir ( directory );
+
+    if ( total > ctx->options.cache_limit )
+    {
+        qsort ( entries, n_entries, sizeof(cache_entry_t),
+            least_recently_used
+        );
+        for ( size_t e=0; e<n_entries && total>ctx->options.cache_limit; e++ )
+        {
+            size_t size = strlen ( ctx->options.cache_directory )
+                + sizeof(entries[e].name) + 1;
+            char path[size];
+            entry_path ( ctx, path, size, entries[e].name );
+            if ( unlink ( path ) == 0 )
+                total -= entries[e].size;
+        }
+    }
+    free ( entries );
+}
+
+/* Internal matters */
+
+
+static void
+hash_bytes ( fingerprint_t *f, const void *data, size_t length )
+{
+    const unsigned char *bytes = data;
+    for ( size_t i=0; i<length; i++ )
+        for ( int k=0; k<2; k++ )
+            f->h[k] = (f->h[k] ^ bytes[i]) * 0x100000001b3;
+}
+
+
+static void
+hash_string ( fingerprint_t *f, const char *string )
+{
+    /* With the terminator, so adjacent strings cannot run together */
+    hash_bytes ( f, string, strlen(string) + 1 );
+}
+
+
+static void
+hash_number ( fingerprint_t *f, uint64_t number )
+{
+    hash_bytes ( f, &number, sizeof(uint64_t) );
+}
+
+
+static void
+hash_subtree ( vslc_context_t *ctx, fingerprint_t *f, node_t *node )
+{
+    if ( node == NULL )
+    {
+        hash_number ( f, (uint64_t)-1 );
+        return;
+    }
+    hash_number ( f, node->type );
+    hash_number ( f, node->n_children );
+    switch ( node->type )
+    {
+        symbol_t *entry;
+        size_t index;
+
+        case NUMBER_DATA:
+            hash_number ( f, *((int64_t *)node->data) );
+            break;
+        case STRING_DATA:
+            index = *((size_t *)node->data);
+            hash_number ( f, index );
+            hash_string ( f, ctx->string_list[index - ctx->string_base] );
+            break;
+        case IDENTIFIER_DATA:
+            /* Locals and parameters by position, globals by signature,
+             * and names being declared by name
+             */
+            entry = node->entry;
+            if ( entry == NULL )
+            {
+                hash_string ( f, node->data );
+                break;
+            }
+            hash_number ( f, entry->type );
+            if ( entry->type == SYM_PARAMETER || entry->type == SYM_LOCAL_VAR )
+                hash_number ( f, entry->seq );
+            else
+                hash_string ( f, entry->name );
+            if ( entry->type == SYM_FUNCTION )
+                hash_number ( f, entry->nparms );
+            break;
+        case EXPRESSION:
+        case RELATION:
+            hash_number ( f, node->data != NULL ? *((char *)node->data) : 0 );
+            break;
+        default:
+            break;
+    }
+    for ( uint64_t i=0; i<node->n_children; i++ )
+        hash_subtree ( ctx, f, node->children[i] );
+}
+
+
+/* Entries made by another build of the compiler are never reused */
+static uint64_t
+compiler_identity ( void )
+{
+    fingerprint_t f = { { 0xcbf29ce484222325, 0 } };
+    FILE *executable = fopen ( "/proc/self/exe", "r" );
+    if ( executable == NULL )
+        return 1;
+    char buffer[4096];
+    size_t n;
+    while ( (n = fread ( buffer, 1, sizeof(buffer), executable )) > 0 )
+        hash_bytes ( &f, buffer, n );
+    fclose ( executable );
+    return f.h[0] | 1;
+}
+
+
+static void
+entry_path ( vslc_context_t *ctx, char *path, size_t size, const char *name )
+{
+    snprintf ( path, size, "%s/%s", ctx->options.cache_directory, name );
+}
+
+
+static int
+least_recently_used ( const void *a, const void *b )
+{
+    const struct timespec *x = &((const cache_entry_t *)a)->used,
+                          *y = &((const cache_entry_t *)b)->used;
+    if ( x->tv_sec != y->tv_sec )
+        return ( x->tv_sec < y->tv_sec ) ? -1 : 1;
+    if ( x->tv_nsec != y->tv_nsec )
+        return ( x->tv_nsec < y->tv_nsec ) ? -1 : 1;
+    return 0;
+}
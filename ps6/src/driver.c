@@ -0,0 +1,135 @@
+#define _GNU_SOURCE // For memfd_create and pipe2
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <driver.h>
+
+extern char **environ;
+
+static const char *tool(const char *variable, const char *fallback);
+static pid_t run(char *const argv[], int input);
+static int wait_for(pid_t pid, const char *name);
+static double seconds(struct timespec from, struct timespec to);
+
+int start_driver(driver_t *driver) {
+    *driver = (driver_t){.object = -1};
+    clock_gettime(CLOCK_MONOTONIC, &driver->started);
+    // Tools inherit the memory file, and reach it by its descriptor
+    driver->object = memfd_create("vslc-object", 0);
+    if (driver->object < 0) {
+        perror("memfd_create");
+        return EXIT_FAILURE;
+    }
+
+    // An assembler that fails early is reported by its exit status
+    signal(SIGPIPE, SIG_IGN);
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        perror("pipe");
+        close(driver->object);
+        return EXIT_FAILURE;
+    }
+    char object_path[32];
+    snprintf(object_path, sizeof(object_path), "/dev/fd/%d", driver->object);
+    // The stack is not executable, like in objects written by vslc -c
+    char *argv[] = {(char *)tool("AS", "as"), "--noexecstack", "-o",
+                    object_path, NULL};
+    driver->assembler = run(argv, fds[0]);
+    close(fds[0]);
+    if (driver->assembler < 0) {
+        close(fds[1]);
+        close(driver->object);
+        return EXIT_FAILURE;
+    }
+    driver->assembly = fdopen(fds[1], "w");
+    return EXIT_SUCCESS;
+}
+
+int finish_driver(driver_t *driver, const char *path, bool report) {
+    clock_gettime(CLOCK_MONOTONIC, &driver->generated);
+    int status = EXIT_SUCCESS;
+    if (fclose(driver->assembly) != 0)
+        status = EXIT_FAILURE;
+    if (wait_for(driver->assembler, "as") != EXIT_SUCCESS)
+        status = EXIT_FAILURE;
+    clock_gettime(CLOCK_MONOTONIC, &driver->assembled);
+
+    if (status == EXIT_SUCCESS) {
+        char object_path[32];
+        snprintf(object_path, sizeof(object_path), "/dev/fd/%d",
+                 driver->object);
+        char *argv[] = {(char *)tool("CC", "cc"), "-no-pie", "-o",
+                        (char *)path, object_path, NULL, NULL};
+        if (driver->freestanding) {
+            argv[1] = "-static";
+            argv[5] = "-nostdlib";
+        }
+        pid_t linker = run(argv, -1);
+        status = (linker < 0) ? EXIT_FAILURE : wait_for(linker, "cc");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &driver->linked);
+    close(driver->object);
+
+    if (report)
+        fprintf(stderr,
+                "vslc: generated in %.3f s, assembled %.3f s later, linked "
+                "in %.3f s, %.3f s in all\n",
+                seconds(driver->started, driver->generated),
+                seconds(driver->generated, driver->assembled),
+                seconds(driver->assembled, driver->linked),
+                seconds(driver->started, driver->linked));
+    return status;
+}
+
+void cancel_driver(driver_t *driver) {
+    kill(driver->assembler, SIGTERM);
+    fclose(driver->assembly);
+    waitpid(driver->assembler, NULL, 0);
+    close(driver->object);
+}
+
+/* Tools are found in the path, or named by a variable of the environment */
+static const char *tool(const char *variable, const char *fallback) {
+    const char *name = getenv(variable);
+    return (name != NULL && *name != '\0') ? name : fallback;
+}
+
+/* Start a tool with its standard input from a descriptor, if not -1 */
+static pid_t run(char *const argv[], int input) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input >= 0)
+        posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+static int wait_for(pid_t pid, const char *name) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) {
+            perror(name);
+            return EXIT_FAILURE;
+        }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return EXIT_SUCCESS;
+    fprintf(stderr, "%s failed\n", name);
+    return EXIT_FAILURE;
+}
+
+static double seconds(struct timespec from, struct timespec to) {
+    return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) * 1e-9;
+}
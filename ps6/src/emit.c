@@ -0,0 +1,87 @@
+#include <vslc.h>
+
+/* The generator only formats strings and decimal integers, so the format
+ * is scanned here instead of by printf, and text is appended to memory
+ * without the locking and locale handling of a stdio stream.
+ */
+
+static void reserve(buffer_t *buffer, size_t length) {
+    if (buffer->length + length <= buffer->capacity)
+        return;
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->length + length)
+        capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+}
+
+void emit_bytes(buffer_t *buffer, const void *data, size_t length) {
+    reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void emit_string(buffer_t *buffer, const char *string) {
+    emit_bytes(buffer, string, strlen(string));
+}
+
+/* Digits are written backwards from the end of a buffer large enough for
+ * any 64-bit number and its sign
+ */
+static void emit_decimal(buffer_t *buffer, uint64_t magnitude, bool negative) {
+    char digits[21];
+    char *start = digits + sizeof(digits);
+    do {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (negative)
+        *--start = '-';
+    emit_bytes(buffer, start, digits + sizeof(digits) - start);
+}
+
+void emit(buffer_t *buffer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    const char *text = format, *c = format;
+    for (; *c != '\0'; c++) {
+        if (*c != '%')
+            continue;
+        emit_bytes(buffer, text, c - text);
+        int64_t number;
+        switch (*++c) {
+        case 's':
+            emit_string(buffer, va_arg(args, const char *));
+            break;
+        case 'd':
+            number = va_arg(args, int64_t);
+            emit_decimal(buffer, number < 0 ? -(uint64_t)number : (uint64_t)number,
+                         number < 0);
+            break;
+        case 'u':
+            emit_decimal(buffer, va_arg(args, size_t), false);
+            break;
+        case '%':
+            emit_bytes(buffer, "%", 1);
+            break;
+        default: // Anything else is copied as it is
+            text = --c;
+            continue;
+        }
+        text = c + 1;
+    }
+    emit_bytes(buffer, text, c - text);
+    va_end(args);
+}
+
+/* Write out what has been emitted so far, keeping the memory for more */
+void emit_flush(buffer_t *buffer, FILE *out) {
+    if (buffer->length > 0)
+        fwrite(buffer->data, 1, buffer->length, out);
+    buffer->length = 0;
+}
+
+void buffer_free(buffer_t *buffer) {
+    free(buffer->data);
+    *buffer = (buffer_t){0};
+}
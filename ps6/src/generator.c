@@ -1,37 +1,185 @@
-#include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <vslc.h>
 
-void generate_stringtable(void);
-void generate_global_variables(void);
-void generate_function(symbol_t *function);
-
-static void generate_node(node_t *node);
-void generate_main(symbol_t *first);
-static void generate_function_call(node_t *call);
+void generate_stringtable(vslc_context_t *ctx);
+void generate_global_variables(vslc_context_t *ctx);
+void generate_function(vslc_context_t *ctx, symbol_t *function);
+
+void generate_main(vslc_context_t *ctx, symbol_t *first);
+static void generate_cached_function(vslc_context_t *ctx,
+                                     symbol_t *function);
+static void generate_global_function(vslc_context_t *ctx,
+                                     symbol_t *function);
+static void generate_in_parallel(vslc_context_t *ctx, symbol_t **functions,
+                                 size_t n_functions);
+static void *generator_thread(void *arg);
+static void flush_code(vslc_context_t *ctx);
+static void add_statistics(tac_statistics_t *sum, tac_statistics_t *add);
+
+/* Functions waiting for a generator thread, and the code of those done */
+typedef struct {
+    vslc_context_t *ctx;
+    symbol_t **functions;
+    buffer_t *code;
+    size_t n_functions, next;
+    size_t cache_hits, cache_misses;
+    tac_statistics_t statistics;
+    bool failed;
+    pthread_mutex_t lock;
+} function_queue_t;
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
-#define ICE(MSG)                                                               \
-    fprintf(stderr, "internal compiler error: " MSG "\n");                     \
-    exit(EXIT_FAILURE)
+#define ICE(MSG) compile_error(ctx, "internal compiler error: " MSG)
 
 static const char *record[6] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
 
-static symbol_t *current_function = NULL;
-static size_t if_count = 0;
-static size_t while_count = 0;
-static size_t parent_while = 0;
 
-void generate_program(void) {
+void generate_program(vslc_context_t *ctx) {
+    size_t n_globals = tlhash_size(ctx->global_names);
+    symbol_t *global_list[n_globals];
+    tlhash_values(ctx->global_names, (void **)&global_list);
+
+    size_t n_functions = 0;
+    symbol_t *functions[n_globals + 1];
+    for (size_t i = 0; i < n_globals; i++)
+        if (global_list[i]->type == SYM_FUNCTION)
+            functions[n_functions++] = global_list[i];
+
+    generate_program_start(ctx);
+    flush_code(ctx);
+    if (ctx->options.threads > 1 && n_functions > 1)
+        generate_in_parallel(ctx, functions, n_functions);
+    else
+        for (size_t i = 0; i < n_functions; i++) {
+            generate_global_function(ctx, functions[i]);
+            flush_code(ctx);
+        }
+    generate_program_end(ctx);
+}
+
+/* Hand over the code made so far, for the assembler to start on it */
+static void flush_code(vslc_context_t *ctx) {
+    if (ctx->code_stream != NULL) {
+        emit_flush(ctx->code, ctx->code_stream);
+        fflush(ctx->code_stream);
+    }
+}
+
+static void generate_global_function(vslc_context_t *ctx,
+                                     symbol_t *function) {
+    if (ctx->options.cache_directory != NULL)
+        generate_cached_function(ctx, function);
+    else
+        generate_function(ctx, function);
+}
+
+/* Functions only share the tree, symbols and strings, which generation
+ * reads without changing once the expressions are labelled. Each thread
+ * generates into a buffer per function, and the buffers are written out in
+ * the order of the list, so the program is the same as when generated on
+ * one thread.
+ */
+static void generate_in_parallel(vslc_context_t *ctx, symbol_t **functions,
+                                 size_t n_functions) {
+    function_queue_t queue = {
+        .ctx = ctx,
+        .functions = functions,
+        .code = calloc(n_functions, sizeof(buffer_t)),
+        .n_functions = n_functions,
+    };
+    pthread_mutex_init(&queue.lock, NULL);
+    if (ctx->options.cache_directory != NULL)
+        cache_identify(ctx); // In cache.c
+    // Subtrees may be shared between functions, so their labels are set
+    // before any thread reads them
+    for (size_t f = 0; f < n_functions; f++)
+        label_registers(functions[f]->node); // In tac.c
+
+    size_t n_threads = MIN((size_t)ctx->options.threads, n_functions);
+    pthread_t threads[n_threads];
+    size_t n_started = 0;
+    for (; n_started < n_threads; n_started++)
+        if (pthread_create(&threads[n_started], NULL, generator_thread,
+                           &queue) != 0)
+            break;
+    // Without threads, the functions are generated here
+    if (n_started == 0)
+        generator_thread(&queue);
+    for (size_t t = 0; t < n_started; t++)
+        pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&queue.lock);
+    ctx->cache_hits += queue.cache_hits;
+    ctx->cache_misses += queue.cache_misses;
+    add_statistics(&ctx->statistics, &queue.statistics);
+
+    for (size_t f = 0; f < n_functions; f++) {
+        if (!queue.failed)
+            emit_bytes(ctx->code, queue.code[f].data, queue.code[f].length);
+        buffer_free(&queue.code[f]);
+    }
+    free(queue.code);
+    // The error was reported by the thread that found it
+    if (queue.failed)
+        longjmp(ctx->error_exit, 1);
+}
+
+static void *generator_thread(void *arg) {
+    function_queue_t *queue = arg;
+    // The state of the function being generated is the thread's own
+    vslc_context_t ctx = *queue->ctx;
+    ctx.cache_hits = ctx.cache_misses = 0;
+    ctx.statistics = (tac_statistics_t){0};
+    ctx.fragment = (buffer_t){0};
+    ctx.lowered = (tac_function_t){0};
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t f = queue->next++;
+        bool done = queue->failed || f >= queue->n_functions;
+        pthread_mutex_unlock(&queue->lock);
+        if (done)
+            break;
+
+        ctx.code = &queue->code[f];
+        if (setjmp(ctx.error_exit) == 0) {
+            generate_global_function(&ctx, queue->functions[f]);
+        } else {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    buffer_free(&ctx.fragment);
+    tac_free(&ctx.lowered); // In tac.c
+    pthread_mutex_lock(&queue->lock);
+    queue->cache_hits += ctx.cache_hits;
+    queue->cache_misses += ctx.cache_misses;
+    add_statistics(&queue->statistics, &ctx.statistics);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
 
-    size_t n_globals = tlhash_size(global_names);
+static void add_statistics(tac_statistics_t *sum, tac_statistics_t *add) {
+    sum->instructions_removed += add->instructions_removed;
+    sum->branches_removed += add->branches_removed;
+    for (int r = 0; r < PEEPHOLE_RULES; r++)
+        sum->peephole_hits[r] += add->peephole_hits[r];
+    sum->peephole_removed += add->peephole_removed;
+    sum->peephole_copied += add->peephole_copied;
+}
+
+/* Everything before the functions: the strings found so far, the global
+ * variables, and the entry point
+ */
+void generate_program_start(vslc_context_t *ctx) {
+    size_t n_globals = tlhash_size(ctx->global_names);
     symbol_t *global_list[n_globals];
-    tlhash_values(global_names, (void **)&global_list);
+    tlhash_values(ctx->global_names, (void **)&global_list);
 
-    symbol_t *first_function;
-    for (size_t i = 0; i < tlhash_size(global_names); i++)
+    symbol_t *first_function = NULL;
+    for (size_t i = 0; i < tlhash_size(ctx->global_names); i++)
         if (global_list[i]->type == SYM_FUNCTION) {
             // Allows the use of main as name to override entry point
             if (!strcmp(global_list[i]->name, "main")) {
@@ -42,461 +190,756 @@ void generate_program(void) {
             }
         }
 
-    generate_stringtable();
-    generate_global_variables();
-    generate_main(first_function);
-    for (size_t i = 0; i < tlhash_size(global_names); i++)
-        if (global_list[i]->type == SYM_FUNCTION)
-            generate_function(global_list[i]);
+    ctx->cache_hits = ctx->cache_misses = 0;
+    // Other compilations may have left the cache over its limit, which this
+    // one would not trim if it only hits
+    if (ctx->options.cache_directory != NULL)
+        cache_trim(ctx); // In cache.c
+    ctx->statistics = (tac_statistics_t){0};
+    // Printed code names strings and globals where they are used
+    if (ctx->options.print_ir)
+        return;
+    generate_stringtable(ctx);
+    generate_global_variables(ctx);
+    if (!ctx->options.library_unit && first_function != NULL) {
+        generate_main(ctx, first_function);
+        generate_runtime(ctx); // In runtime.c
+    } else {
+        emit_string(ctx->code, ".section .text\n");
+    }
 }
 
-void generate_stringtable(void) {
-    puts(".section .rodata");
-    puts(".intout: .string \"%ld \"");
-    puts(".strout: .string \"%s \"");
-    puts(".errout: .string \"Wrong number of arguments\"");
-    for (size_t s = 0; s < stringc; s++)
-        printf(".STR%zu: .string %s\n", s, string_list[s]);
+/* A function compiled on its own, preceded by the strings it uses */
+void generate_streamed_function(vslc_context_t *ctx, symbol_t *function) {
+    if (ctx->stringc > 0 && !ctx->options.print_ir) {
+        emit_string(ctx->code, ".section .rodata\n");
+        for (size_t s = 0; s < ctx->stringc; s++)
+            emit(ctx->code, ".STR%u: .string %s\n", ctx->string_base + s,
+                 ctx->string_list[s]);
+        emit_string(ctx->code, ".section .text\n");
+    }
+    generate_global_function(ctx, function);
 }
 
-void generate_global_variables(void) {
-    puts(".section .data");
-    size_t nsyms = tlhash_size(global_names);
-    symbol_t *syms[nsyms];
-    tlhash_values(global_names, (void **)&syms);
-    for (size_t n = 0; n < nsyms; n++) {
-        if (syms[n]->type == SYM_GLOBAL_VAR)
-            printf("._%s: .zero 8\n", syms[n]->name);
+void generate_program_end(vslc_context_t *ctx) {
+    if (ctx->options.cache_directory != NULL) {
+        fprintf(ctx->diag, "cache: %zu hits, %zu misses\n", ctx->cache_hits,
+                ctx->cache_misses);
+        if (ctx->cache_misses > 0)
+            cache_trim(ctx); // In cache.c
+    }
+    if (ctx->options.optimize && ctx->options.report_passes)
+        fprintf(ctx->diag, "sccp: %zu instructions and %zu branches removed\n",
+                ctx->statistics.instructions_removed,
+                ctx->statistics.branches_removed);
+    if (ctx->options.report_passes && !ctx->options.print_ir) {
+        fprintf(ctx->diag,
+                "peephole: %zu instructions removed and %zu copied\n",
+                ctx->statistics.peephole_removed,
+                ctx->statistics.peephole_copied);
+        for (int r = 0; r < PEEPHOLE_RULES; r++)
+            if (ctx->statistics.peephole_hits[r] > 0)
+                fprintf(ctx->diag, "peephole: %zu %s\n",
+                        ctx->statistics.peephole_hits[r], peephole_rules[r]);
     }
 }
 
-void generate_main(symbol_t *first) {
-    puts(".globl main");
-    puts(".section .text");
-    puts("main:");
-    puts("\tpushq   %rbp");
-    puts("\tmovq    %rsp, %rbp");
+/* Reuse the code of an unchanged function from the cache, or generate it
+ * into a fragment of its own to store there
+ */
+static void generate_cached_function(vslc_context_t *ctx,
+                                     symbol_t *function) {
+    char key[CACHE_KEY_LENGTH + 1];
+    function_fingerprint(ctx, function, key);
+    if (cache_fetch(ctx, key, ctx->code)) {
+        ctx->cache_hits += 1;
+        return;
+    }
+    ctx->cache_misses += 1;
+
+    buffer_t *code = ctx->code;
+    ctx->code = &ctx->fragment;
+    ctx->fragment.length = 0;
+    generate_function(ctx, function);
+    ctx->code = code;
+    emit_bytes(ctx->code, ctx->fragment.data, ctx->fragment.length);
+    cache_store(ctx, key, ctx->fragment.data, ctx->fragment.length);
+}
 
-    printf("\tsubq\t$1,%%rdi\n");
-    printf("\tcmpq\t$%zu,%%rdi\n", first->nparms);
-    printf("\tjne\tABORT\n");
-    printf("\tcmpq\t$0,%%rdi\n");
-    printf("\tjz\tSKIP_ARGS\n");
+void generate_stringtable(vslc_context_t *ctx) {
+    emit_string(ctx->code, ".section .rodata\n");
+    emit_string(ctx->code, ".errout: .string \"Wrong number of arguments\"\n");
+    for (size_t s = 0; s < ctx->stringc; s++)
+        emit(ctx->code, ".STR%u: .string %s\n", s, ctx->string_list[s]);
+}
 
-    printf("\tmovq\t%%rdi,%%rcx\n");
-    printf("\taddq $%zu, %%rsi\n", 8 * first->nparms);
-    printf("PARSE_ARGV:\n");
-    printf("\tpushq %%rcx\n");
-    printf("\tpushq %%rsi\n");
+void generate_global_variables(vslc_context_t *ctx) {
+    emit_string(ctx->code, ".section .data\n");
+    size_t nsyms = tlhash_size(ctx->global_names);
+    symbol_t *syms[nsyms];
+    tlhash_values(ctx->global_names, (void **)&syms);
+    for (size_t n = 0; n < nsyms; n++) {
+        if (syms[n]->type == SYM_GLOBAL_VAR) {
+            /* Visible to units importing this one */
+            emit(ctx->code, ".globl ._%s\n", syms[n]->name);
+            emit(ctx->code, "._%s: .zero 8\n", syms[n]->name);
+        }
+    }
+}
 
-    printf("\tmovq\t(%%rsi),%%rdi\n");
-    printf("\tmovq\t$0,%%rsi\n");
-    printf("\tmovq\t$10,%%rdx\n");
-    printf("\tcall\tstrtol\n");
+/* A C main function, or without the C library, the entry point of the
+ * process, which finds the argument count and vector on the stack
+ */
+void generate_main(vslc_context_t *ctx, symbol_t *first) {
+    bool freestanding = ctx->options.freestanding;
+    const char *entry = freestanding ? "_start" : "main";
+    emit(ctx->code, ".globl %s\n", entry);
+    emit_string(ctx->code, ".section .text\n");
+    emit(ctx->code, "%s:\n", entry);
+    if (freestanding) {
+        emit_string(ctx->code, "\tmovq\t(%rsp), %rdi\n");
+        emit_string(ctx->code, "\tleaq\t8(%rsp), %rsi\n");
+    }
+    emit_string(ctx->code, "\tpushq   %rbp\n");
+    emit_string(ctx->code, "\tmovq    %rsp, %rbp\n");
+
+    emit_string(ctx->code, "\tsubq\t$1,%rdi\n");
+    emit(ctx->code, "\tcmpq\t$%u,%%rdi\n", first->nparms);
+    emit_string(ctx->code, "\tjne\tABORT\n");
+    emit_string(ctx->code, "\tcmpq\t$0,%rdi\n");
+    emit_string(ctx->code, "\tjz\tSKIP_ARGS\n");
+
+    emit_string(ctx->code, "\tmovq\t%rdi,%rcx\n");
+    emit(ctx->code, "\taddq $%u, %%rsi\n", 8 * first->nparms);
+    emit_string(ctx->code, "PARSE_ARGV:\n");
+    emit_string(ctx->code, "\tpushq %rcx\n");
+    emit_string(ctx->code, "\tpushq %rsi\n");
+
+    emit_string(ctx->code, "\tmovq\t(%rsi),%rdi\n");
+    emit_string(ctx->code, "\tmovq\t$0,%rsi\n");
+    emit_string(ctx->code, "\tmovq\t$10,%rdx\n");
+    emit(ctx->code, "\tcall\t%s\n", freestanding ? "__vsl_parse_int" : "strtol");
 
     /*  Now a new argument is an integer in rax */
 
-    printf("\tpopq %%rsi\n");
-    printf("\tpopq %%rcx\n");
-    printf("\tpushq %%rax\n");
-    printf("\tsubq $8, %%rsi\n");
-    printf("\tloop PARSE_ARGV\n");
+    emit_string(ctx->code, "\tpopq %rsi\n");
+    emit_string(ctx->code, "\tpopq %rcx\n");
+    emit_string(ctx->code, "\tpushq %rax\n");
+    emit_string(ctx->code, "\tsubq $8, %rsi\n");
+    emit_string(ctx->code, "\tloop PARSE_ARGV\n");
 
     /* Now the arguments are in order on stack */
     for (size_t arg = 0; arg < MIN(6, first->nparms); arg++)
-        printf("\tpopq\t%s\n", record[arg]);
-
-    printf("SKIP_ARGS:\n");
-    printf("\tcall\t_%s\n", first->name);
-    printf("\tjmp\tEND\n");
-    printf("ABORT:\n");
-    printf("\tmovq\t$.errout, %%rdi\n");
-    printf("\tcall puts\n");
-
-    printf("END:\n");
-    puts("\tmovq    %rax, %rdi");
-    puts("\tcall    exit");
-}
-
-static void generate_identifier(node_t *ident) {
-    symbol_t *symbol = ident->entry;
-    int64_t argument_offset;
-    switch (symbol->type) {
-    case SYM_GLOBAL_VAR:
-        /* Global variables called by name */
-        printf("._%s", symbol->name);
-        break;
-    case SYM_PARAMETER:
-        if (symbol->seq > 5)
-            /* Extra parameters pushed in decreasing order */
-            printf("%ld(%%rbp)", 8 + 8 * (symbol->seq - 5));
+        emit(ctx->code, "\tpopq\t%s\n", record[arg]);
+
+    emit_string(ctx->code, "SKIP_ARGS:\n");
+    emit(ctx->code, "\tcall\t_%s\n", first->name);
+    emit_string(ctx->code, "\tjmp\tEND\n");
+    emit_string(ctx->code, "ABORT:\n");
+    emit_string(ctx->code, "\tmovq\t$.errout, %rdi\n");
+    emit(ctx->code, "\tcall %s\n", freestanding ? "__vsl_puts" : "puts");
+
+    emit_string(ctx->code, "END:\n");
+    emit_string(ctx->code, "\tmovq    %rax, %rdi\n");
+    emit_string(ctx->code, "\tcall    __vsl_exit\n"); // In runtime.c
+}
+
+static tac_location_t *location(vslc_context_t *ctx, tac_operand_t *op) {
+    return &ctx->lowered.locations[op->number];
+}
+
+/* Whether the operand is a value kept in the register, or in any register
+ * if it is NULL
+ */
+static bool in_register(vslc_context_t *ctx, tac_operand_t *op,
+                        const char *reg) {
+    if (op->kind != TAC_VALUE || location(ctx, op)->reg == NULL)
+        return false;
+    return reg == NULL || !strcmp(location(ctx, op)->reg, reg);
+}
+
+static void generate_operand(vslc_context_t *ctx, tac_operand_t *op) {
+    switch (op->kind) {
+    case TAC_VALUE:
+        if (location(ctx, op)->reg != NULL)
+            emit_string(ctx->code, location(ctx, op)->reg);
         else
-            /* First six parameters directly after base poiter */
-            printf("%ld(%%rbp)", -8 * (symbol->seq + 1));
+            emit(ctx->code, "%d(%%rbp)", location(ctx, op)->offset);
+        break;
+    case TAC_CONSTANT:
+        emit(ctx->code, "$%d", op->number);
         break;
-    case SYM_LOCAL_VAR:
-        /* Local variables places after parameters in stack */
-        argument_offset = -8 * MIN(6, current_function->nparms);
-        printf("%" PRId64 "(%%rbp)", -8 * (symbol->seq + 1) + argument_offset);
+    case TAC_GLOBAL:
+        emit(ctx->code, "._%s", op->global->name);
+        break;
+    case TAC_STRING:
+        emit(ctx->code, "$.STR%u", (size_t)op->number);
         break;
     default:
-        ICE("invalid identifier");
+        ICE("invalid operand");
         break;
     }
 }
 
-static void generate_expression(node_t *expr) {
-    if (expr->type == IDENTIFIER_DATA) {
-        printf("\tmovq\t");
-        generate_identifier(expr);
-        printf(", %%rax\n");
-    } else if (expr->type == NUMBER_DATA) {
-        printf("\tmovq\t$%" PRId64 ", %%rax\n", *(int64_t *)expr->data);
-    } else if (expr->n_children == 1) {
-        switch (*((char *)(expr->data))) {
-        case '-':
-            generate_expression(expr->children[0]);
-            printf("\tnegq\t%%rax\n");
-            break;
-        case '~':
-            generate_expression(expr->children[0]);
-            printf("\tnotq\t%%rax\n");
-            break;
-        }
-    } else if (expr->n_children == 2) {
-        if (expr->data != NULL) {
-            switch (*((char *)expr->data)) {
-            case '+':
-                generate_expression(expr->children[0]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[1]);
-                printf("\taddq\t%%rax, (%%rsp)\n");
-                printf("\tpopq\t%%rax\n");
-                break;
-            case '-':
-                generate_expression(expr->children[0]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[1]);
-                printf("\tsubq\t%%rax, (%%rsp)\n");
-                printf("\tpopq\t%%rax\n");
-                break;
-            case '*':
-                printf("\tpushq\t%%rdx\n");
-                generate_expression(expr->children[1]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[0]);
-                printf("\tmulq\t(%%rsp)\n");
-                printf("\tpopq\t%%rdx\n");
-                printf("\tpopq\t%%rdx\n");
-                break;
-            case '/':
-                printf("\tpushq\t%%rdx\n");
-                generate_expression(expr->children[1]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[0]);
-                printf("\tcqo\n");
-                printf("\tidivq\t(%%rsp)\n");
-                printf("\tpopq\t%%rdx\n");
-                printf("\tpopq\t%%rdx\n");
-                break;
-            case '|':
-                generate_expression(expr->children[0]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[1]);
-                printf("\torq\t%%rax, (%%rsp)\n");
-                printf("\tpopq\t%%rax\n");
-                break;
-            case '^':
-                generate_expression(expr->children[0]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[1]);
-                printf("\txorq\t%%rax, (%%rsp)\n");
-                printf("\tpopq\t%%rax\n");
-                break;
-            case '&':
-                generate_expression(expr->children[0]);
-                printf("\tpushq\t%%rax\n");
-                generate_expression(expr->children[1]);
-                printf("\tandq\t%%rax, (%%rsp)\n");
-                printf("\tpopq\t%%rax\n");
-                break;
-            }
-        } else {
-            generate_function_call(expr);
-        }
-    }
+/* Instructions other than moves into registers take 32-bit immediates */
+static bool is_direct(tac_operand_t *op) {
+    return op->kind != TAC_CONSTANT ||
+           (op->number >= INT32_MIN && op->number <= INT32_MAX);
+}
+
+static void generate_load(vslc_context_t *ctx, tac_operand_t *op,
+                          const char *reg) {
+    if (in_register(ctx, op, reg))
+        return;
+    emit_string(ctx->code, "\tmovq\t");
+    generate_operand(ctx, op);
+    emit(ctx->code, ", %s\n", reg);
 }
 
-static void generate_function_call(node_t *call) {
-    /* Check function call */
-    size_t n_arguments = 0;
-    if (call->children[1] != NULL)
-        n_arguments = call->children[1]->n_children;
-    symbol_t *function = call->children[0]->entry;
-    if (n_arguments != function->nparms) {
-        fprintf(stderr,
-                "Function %s has %zu parameters, called with %zu arguments\n",
-                (char *)call->children[0]->data,
-                (size_t)call->children[0]->entry->nparms, n_arguments);
-        exit(EXIT_FAILURE);
+static void generate_store(vslc_context_t *ctx, const char *reg,
+                           tac_operand_t *op) {
+    if (in_register(ctx, op, reg))
+        return;
+    emit(ctx->code, "\tmovq\t%s, ", reg);
+    generate_operand(ctx, op);
+    emit_string(ctx->code, "\n");
+}
+
+/* Apply an instruction with the operand as source, through rcx if it is
+ * too wide to be an immediate
+ */
+static void generate_with_operand(vslc_context_t *ctx, const char *mnemonic,
+                                  tac_operand_t *op, const char *reg) {
+    if (!is_direct(op)) {
+        generate_load(ctx, op, "%rcx");
+        emit(ctx->code, "\t%s\t%%rcx, %s\n", mnemonic, reg);
+        return;
     }
+    emit(ctx->code, "\t%s\t", mnemonic);
+    generate_operand(ctx, op);
+    emit(ctx->code, ", %s\n", reg);
+}
+
+static bool in_memory(vslc_context_t *ctx, tac_operand_t *op) {
+    return op->kind == TAC_GLOBAL ||
+           (op->kind == TAC_VALUE && location(ctx, op)->reg == NULL);
+}
+
+static bool same_location(vslc_context_t *ctx, tac_operand_t *a,
+                          tac_operand_t *b) {
+    if (a->kind == TAC_GLOBAL && b->kind == TAC_GLOBAL)
+        return a->global == b->global;
+    if (a->kind != TAC_VALUE || b->kind != TAC_VALUE)
+        return false;
+    if (location(ctx, a)->reg != NULL)
+        return in_register(ctx, b, location(ctx, a)->reg);
+    return location(ctx, b)->reg == NULL &&
+           location(ctx, a)->offset == location(ctx, b)->offset;
+}
+
+/* Results are computed in their own register, or in rax on their way to
+ * memory
+ */
+static const char *result_register(vslc_context_t *ctx,
+                                   tac_operand_t *result) {
+    return in_register(ctx, result, NULL) ? location(ctx, result)->reg
+                                          : "%rax";
+}
 
-    /* Generate function call: */
-
-    /* Push all the arguments */
-    node_t *arglist = call->children[1];
-    if (arglist != NULL) {
-        for (size_t p = arglist->n_children; p > 0; p--) {
-            generate_expression(arglist->children[(p - 1)]);
-            if ((p - 1) > 5)
-                printf("\tpushq\t%%rax\n");
-            else
-                printf("\tmovq\t%%rax, %s\n", record[(p - 1)]);
+/* The left operand is loaded where the result is computed, unless that
+ * would overwrite the right operand first
+ */
+static void generate_binary(vslc_context_t *ctx,
+                            tac_instruction_t *instruction,
+                            const char *mnemonic) {
+    tac_operand_t *left = &instruction->left, *right = &instruction->right;
+    const char *reg = result_register(ctx, &instruction->result);
+    if (in_register(ctx, right, reg) && !in_register(ctx, left, reg)) {
+        if (instruction->opcode != TAC_SUBTRACT) {
+            tac_operand_t *swap = left;
+            left = right;
+            right = swap;
+        } else {
+            reg = "%rax";
         }
     }
-    /* Call the function */
-    printf("\tcall _%s\n", (char *)call->children[0]->data);
+    generate_load(ctx, left, reg);
+    generate_with_operand(ctx, mnemonic, right, reg);
+    generate_store(ctx, reg, &instruction->result);
 }
 
-static void generate_assignment_statement(node_t *statement) {
-    switch (statement->type) {
-    case ASSIGNMENT_STATEMENT:
-        generate_expression(statement->children[1]);
-        printf("\tmovq\t%%rax, ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        break;
-    case ADD_STATEMENT:
-        generate_expression(statement->children[1]);
-        printf("\taddq\t%%rax, ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        break;
-    case SUBTRACT_STATEMENT:
-        generate_expression(statement->children[1]);
-        printf("\tsubq\t%%rax, ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        break;
-    case MULTIPLY_STATEMENT:
-        generate_expression(statement->children[1]);
-        printf("\tmulq\t ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        printf("\tmovq\t%%rax, ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        break;
-    case DIVIDE_STATEMENT:
-        generate_expression(statement->children[1]);
-        printf("\txchgq\t%%rax, ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        printf("\tcqo\n");
-        printf("\tidivq\t");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        printf("\txchgq\t%%rax, ");
-        generate_identifier(statement->children[0]);
-        printf("\n");
-        break;
+/* Instructions are selected from a table of rules, each matching the
+ * opcode and the classes of the operands, at a cost. The cheapest rule
+ * that matches is expanded from its template, where %r, %a and %b are the
+ * result, left and right operands, %n the right constant as a number, %m
+ * its negation and %s one less. When no rule matches, the instruction is
+ * generated the general way, loading the left operand into a register.
+ */
+enum {
+    REG = 1,        // Value in a register
+    MEM = 2,        // Value in the frame, or global
+    IMM = 4,        // Constant that fits an immediate
+    NEG = 8,        // Constant whose negation fits an immediate
+    ZERO = 16,
+    ONE = 32,
+    MINUS_ONE = 64,
+    SCALE = 128,    // 4 or 8, an index scale
+    SCALE_ADD = 256 // 2, 3, 5 or 9, an index scale and the index again
+};
+
+enum {
+    SAME = 1,       // The result is where the left operand is
+    COMMUTES = 2    // Also matches with the operands swapped
+};
+
+typedef struct {
+    tac_opcode_t opcode;
+    unsigned result, left, right; // Classes matched, or 0 for any
+    unsigned constraints;
+    unsigned cost;
+    const char *template;
+} rule_t;
+
+static const rule_t rules[] = {
+    // Counting in place
+    {TAC_ADD, REG | MEM, 0, ONE, SAME | COMMUTES, 1, "incq\t%r"},
+    {TAC_ADD, REG | MEM, 0, MINUS_ONE, SAME | COMMUTES, 1, "decq\t%r"},
+    {TAC_SUBTRACT, REG | MEM, 0, ONE, SAME, 1, "decq\t%r"},
+    {TAC_SUBTRACT, REG | MEM, 0, MINUS_ONE, SAME, 1, "incq\t%r"},
+
+    // Updates of memory in place
+    {TAC_ADD, MEM, 0, REG | IMM, SAME | COMMUTES, 2, "addq\t%b, %r"},
+    {TAC_SUBTRACT, MEM, 0, REG | IMM, SAME, 2, "subq\t%b, %r"},
+    {TAC_AND, MEM, 0, REG | IMM, SAME | COMMUTES, 2, "andq\t%b, %r"},
+    {TAC_OR, MEM, 0, REG | IMM, SAME | COMMUTES, 2, "orq\t%b, %r"},
+    {TAC_XOR, MEM, 0, REG | IMM, SAME | COMMUTES, 2, "xorq\t%b, %r"},
+    {TAC_NEGATE, MEM, 0, 0, SAME, 2, "negq\t%r"},
+    {TAC_NOT, MEM, 0, 0, SAME, 2, "notq\t%r"},
+
+    // Sums and products into another register
+    {TAC_ADD, REG, REG, REG | IMM | MEM, SAME | COMMUTES, 1, "addq\t%b, %r"},
+    {TAC_ADD, REG, REG, REG, COMMUTES, 1, "leaq\t(%a,%b), %r"},
+    {TAC_ADD, REG, REG, IMM, COMMUTES, 1, "leaq\t%n(%a), %r"},
+    {TAC_SUBTRACT, REG, REG, NEG, 0, 1, "leaq\t%m(%a), %r"},
+    {TAC_MULTIPLY, REG, REG, SCALE, COMMUTES, 1, "leaq\t0(,%a,%n), %r"},
+    {TAC_MULTIPLY, REG, REG, SCALE_ADD, COMMUTES, 1,
+     "leaq\t(%a,%a,%s), %r"},
+    {TAC_MULTIPLY, REG, REG | MEM, IMM, COMMUTES, 3, "imulq\t%b, %a, %r"},
+    {TAC_MULTIPLY, MEM, REG | MEM, IMM, COMMUTES, 4,
+     "imulq\t%b, %a, %%rax\n\tmovq\t%%rax, %r"},
+
+    // Comparisons of branches
+    {TAC_BRANCH, 0, REG, ZERO, 0, 1, "testq\t%a, %a"},
+    {TAC_BRANCH, 0, REG, REG | MEM | IMM, 0, 1, "cmpq\t%b, %a"},
+    {TAC_BRANCH, 0, MEM, REG | IMM, 0, 1, "cmpq\t%b, %a"},
+};
+
+#define N_RULES (sizeof(rules) / sizeof(rules[0]))
+
+static unsigned operand_class(vslc_context_t *ctx, tac_operand_t *op) {
+    int64_t n = op->number;
+    switch (op->kind) {
+    case TAC_VALUE:
+        return in_register(ctx, op, NULL) ? REG : MEM;
+    case TAC_GLOBAL:
+        return MEM;
+    case TAC_CONSTANT:
+        return (is_direct(op) ? IMM : 0) |
+               (n > INT32_MIN && n <= INT32_MAX ? NEG : 0) |
+               (n == 0 ? ZERO : 0) | (n == 1 ? ONE : 0) |
+               (n == -1 ? MINUS_ONE : 0) | (n == 4 || n == 8 ? SCALE : 0) |
+               (n == 2 || n == 3 || n == 5 || n == 9 ? SCALE_ADD : 0);
     default:
-        ICE("invalid assignment");
-        break;
+        return 0;
+    }
+}
+
+static bool matches(vslc_context_t *ctx, const rule_t *rule,
+                    tac_instruction_t *instruction, tac_operand_t *left,
+                    tac_operand_t *right) {
+    if (rule->opcode != instruction->opcode)
+        return false;
+    if ((rule->result != 0 &&
+         !(operand_class(ctx, &instruction->result) & rule->result)) ||
+        (rule->left != 0 && !(operand_class(ctx, left) & rule->left)) ||
+        (rule->right != 0 && !(operand_class(ctx, right) & rule->right)))
+        return false;
+    return !(rule->constraints & SAME) ||
+           same_location(ctx, &instruction->result, left);
+}
+
+/* The cheapest rule for the instruction, or NULL, and whether it takes the
+ * operands swapped
+ */
+static const rule_t *select_rule(vslc_context_t *ctx,
+                                 tac_instruction_t *instruction,
+                                 bool *swapped) {
+    const rule_t *best = NULL;
+    for (const rule_t *rule = rules; rule < rules + N_RULES; rule++) {
+        if (best != NULL && rule->cost >= best->cost)
+            continue;
+        if (matches(ctx, rule, instruction, &instruction->left,
+                    &instruction->right)) {
+            best = rule;
+            *swapped = false;
+        } else if ((rule->constraints & COMMUTES) &&
+                   matches(ctx, rule, instruction, &instruction->right,
+                           &instruction->left)) {
+            best = rule;
+            *swapped = true;
+        }
     }
+    return best;
 }
 
-static void generate_print_statement(node_t *statement) {
-    for (size_t i = 0; i < statement->n_children; i++) {
-        node_t *item = statement->children[i];
-        switch (item->type) {
-        case STRING_DATA:
-            printf("\tmovq\t$.STR%zu, %%rsi\n", *((size_t *)item->data));
-            printf("\tmovq\t$.strout, %%rdi\n");
+static void expand_rule(vslc_context_t *ctx, const rule_t *rule,
+                        tac_instruction_t *instruction, bool swapped) {
+    tac_operand_t *left = &instruction->left, *right = &instruction->right;
+    if (swapped) {
+        left = &instruction->right;
+        right = &instruction->left;
+    }
+    emit_string(ctx->code, "\t");
+    for (const char *t = rule->template; *t != '\0'; t++) {
+        size_t length = strcspn(t, "%");
+        emit_bytes(ctx->code, t, length);
+        t += length;
+        if (*t == '\0')
+            break;
+        switch (*++t) {
+        case 'r':
+            generate_operand(ctx, &instruction->result);
+            break;
+        case 'a':
+            generate_operand(ctx, left);
+            break;
+        case 'b':
+            generate_operand(ctx, right);
             break;
-        case NUMBER_DATA:
-            printf("\tmovq\t$%" PRId64 ", %%rsi\n", *((int64_t *)item->data));
-            printf("\tmovq\t$.intout, %%rdi\n");
+        case 'n':
+            emit(ctx->code, "%d", right->number);
             break;
-        case IDENTIFIER_DATA:
-            printf("\tmovq\t");
-            generate_identifier(item);
-            printf(", %%rsi\n");
-            printf("\tmovq\t$.intout, %%rdi\n");
+        case 'm':
+            emit(ctx->code, "%d", -right->number);
             break;
-        case EXPRESSION:
-            generate_expression(item);
-            printf("\tmovq\t%%rax, %%rsi\n");
-            printf("\tmovq\t$.intout, %%rdi\n");
+        case 's':
+            emit(ctx->code, "%d", right->number - 1);
             break;
         default:
-            ICE("invalid print statement");
+            emit_string(ctx->code, "%");
             break;
         }
-        puts("\tmovq\t$0, %rax\n" // Clear rax to indicate not to use SSE
-                                  // instructions
-             "\tcall\tprintf");
-    }
-    printf("\tmovq\t$0x0A, %%rdi\n"); // Finish statement by inserting a newline
-    puts("\tcall\tputchar");
-}
-
-static void generate_if_statement(node_t *statement) {
-    node_t *relation = statement->children[0];
-    size_t curr_count = if_count++;
-
-    // Compute the if-condition
-    generate_expression(relation->children[0]);
-    puts("\tpushq %rax");
-    generate_expression(relation->children[1]);
-    puts("\tcmpq %rax, (%rsp)");
-    puts("\tpopq %rax");
-
-    // Jump to else-label if the condition is false
-    char *instr = NULL;
-    switch (*(char *)relation->data) {
-    case '<':
-        instr = "jge";
-        break;
-    case '>':
-        instr = "jle";
-        break;
-    case '=':
-        instr = "jne";
-        break;
-    default:
-        ICE("invalid if statement relation");
-        break;
     }
+    emit_string(ctx->code, "\n");
+}
 
-    char *dest = statement->n_children == 2 ? "ENDIF" : "ELSE";
-    printf("\t%s .%s_%zu\n", instr, dest, curr_count);
+/* Generates the instruction by a rule, if one matches */
+static bool generate_selected(vslc_context_t *ctx,
+                              tac_instruction_t *instruction) {
+    bool swapped;
+    const rule_t *rule = select_rule(ctx, instruction, &swapped);
+    if (rule == NULL)
+        return false;
+    expand_rule(ctx, rule, instruction, swapped);
+    return true;
+}
 
-    // Generate the if-block
-    generate_node(statement->children[1]);
+/* A global read into a value, updated and written back, is one tree:
+ *
+ *   t1 = move @g; t2 = op t1, right; @g = move t2
+ *
+ * which the rules match as an update of @g in place, when the values die
+ * with it. The number of instructions generated is returned, or 0.
+ */
+static size_t generate_update(vslc_context_t *ctx, size_t k,
+                              tac_block_t *block, size_t i) {
+    if (i + 2 >= block->n_instructions)
+        return 0;
+    tac_instruction_t *load = &block->instructions[i],
+                      *update = &block->instructions[i + 1],
+                      *store = &block->instructions[i + 2];
+    if (load->opcode != TAC_MOVE || load->left.kind != TAC_GLOBAL ||
+        load->result.kind != TAC_VALUE || store->opcode != TAC_MOVE ||
+        !same_location(ctx, &store->result, &load->left) ||
+        store->left.kind != TAC_VALUE || update->result.kind != TAC_VALUE ||
+        store->left.number != update->result.number)
+        return 0;
+    size_t loaded = load->result.number, updated = update->result.number;
+    if (location(ctx, &load->result)->last_live > k + 1 ||
+        location(ctx, &update->result)->last_live > k + 2)
+        return 0;
+
+    tac_instruction_t tree = *update;
+    if (tree.left.kind != TAC_VALUE || (size_t)tree.left.number != loaded ||
+        (tree.right.kind == TAC_VALUE &&
+         ((size_t)tree.right.number == loaded ||
+          (size_t)tree.right.number == updated)))
+        return 0;
+    tree.left = load->left;
+    tree.result = store->result;
+    return generate_selected(ctx, &tree) ? 3 : 0;
+}
 
-    if (statement->n_children == 3) {
-        // Jump to the end, past the else-body
-        printf("\tjmp .ENDIF_%zu\n", curr_count);
+static void generate_label(vslc_context_t *ctx, size_t block) {
+    emit(ctx->code, ".L%s_%u", ctx->lowered.symbol->name, block);
+}
 
-        // Label for else-block
-        printf(".ELSE_%zu:\n", curr_count);
+static void generate_jump(vslc_context_t *ctx, const char *mnemonic,
+                          size_t block) {
+    emit(ctx->code, "\t%s\t", mnemonic);
+    generate_label(ctx, block);
+    emit_string(ctx->code, "\n");
+}
 
-        // Generate the else-block
-        generate_node(statement->children[2]);
+static void generate_call(vslc_context_t *ctx,
+                          tac_instruction_t *instruction) {
+    tac_operand_t *arguments =
+        &ctx->lowered.arguments[instruction->first_argument];
+    size_t n_arguments = instruction->n_arguments;
+    size_t n_pushed = n_arguments > 6 ? n_arguments - 6 : 0;
+
+    /* Extra arguments are pushed in decreasing order, keeping the stack
+     * aligned to 16 bytes */
+    if (n_pushed & 1)
+        emit_string(ctx->code, "\tsubq\t$8, %rsp\n");
+    for (size_t p = n_arguments; p > 6; p--) {
+        if (is_direct(&arguments[p - 1])) {
+            emit_string(ctx->code, "\tpushq\t");
+            generate_operand(ctx, &arguments[p - 1]);
+            emit_string(ctx->code, "\n");
+        } else {
+            generate_load(ctx, &arguments[p - 1], "%rax");
+            emit_string(ctx->code, "\tpushq\t%rax\n");
+        }
     }
-
-    // Label for end of if-statement
-    printf(".ENDIF_%zu:\n", curr_count);
+    for (size_t p = 0; p < MIN(6, n_arguments); p++)
+        generate_load(ctx, &arguments[p], record[p]);
+    emit(ctx->code, "\tcall\t_%s\n", instruction->function->name);
+    if (n_pushed > 0)
+        emit(ctx->code, "\taddq\t$%u, %%rsp\n", 8 * (n_pushed + (n_pushed & 1)));
+    generate_store(ctx, "%rax", &instruction->result);
 }
 
-static void generate_while_statement(node_t *statement) {
-    node_t *relation = statement->children[0];
-    size_t curr_count = while_count++;
-    size_t prev_parent_while = parent_while;
-    parent_while = curr_count;
-
-    // Label for the beginning of the while-statement
-    printf(".WHILE_%zu:\n", curr_count);
+/* Both successors of a branch are reached by jumps, but for the block laid
+ * out next, which is fallen through to
+ */
+static void generate_branch(vslc_context_t *ctx, size_t b,
+                            tac_instruction_t *instruction) {
+    static const char *jumps[][2] = {[TAC_LESS] = {"jl", "jge"},
+                                     [TAC_GREATER] = {"jg", "jle"},
+                                     [TAC_EQUAL] = {"je", "jne"}};
+    static const tac_relation_t reversed[] = {[TAC_LESS] = TAC_GREATER,
+                                              [TAC_GREATER] = TAC_LESS,
+                                              [TAC_EQUAL] = TAC_EQUAL};
+    size_t *successors = ctx->lowered.blocks[b].successors;
+
+    // Between constants, the relation is known now
+    if (instruction->left.kind == TAC_CONSTANT &&
+        instruction->right.kind == TAC_CONSTANT) {
+        int64_t left = instruction->left.number;
+        int64_t right = instruction->right.number;
+        bool holds = instruction->relation == TAC_LESS      ? left < right
+                     : instruction->relation == TAC_GREATER ? left > right
+                                                            : left == right;
+        size_t taken = successors[holds ? 0 : 1];
+        if (taken != b + 1)
+            generate_jump(ctx, "jmp", taken);
+        return;
+    }
 
-    // Compute the while-condition
-    generate_expression(relation->children[0]);
-    puts("\tpushq %rax");
-    generate_expression(relation->children[1]);
-    puts("\tcmpq %rax, (%rsp)");
-    puts("\tpopq %rax");
+    // A constant is compared as the right operand
+    tac_instruction_t compare = *instruction;
+    if (compare.left.kind == TAC_CONSTANT &&
+        compare.right.kind != TAC_CONSTANT) {
+        compare.left = instruction->right;
+        compare.right = instruction->left;
+        compare.relation = reversed[instruction->relation];
+    }
+    const char **jump = jumps[compare.relation];
+    if (!generate_selected(ctx, &compare)) {
+        const char *reg = "%rax";
+        if (in_register(ctx, &compare.left, NULL))
+            reg = location(ctx, &compare.left)->reg;
+        generate_load(ctx, &compare.left, reg);
+        generate_with_operand(ctx, "cmpq", &compare.right, reg);
+    }
+    if (successors[0] == b + 1) {
+        generate_jump(ctx, jump[1], successors[1]);
+        return;
+    }
+    generate_jump(ctx, jump[0], successors[0]);
+    if (successors[1] != b + 1)
+        generate_jump(ctx, "jmp", successors[1]);
+}
 
-    // Jump to end-label if the condition false
-    char *instr = NULL;
-    switch (*(char *)relation->data) {
-    case '<':
-        instr = "jge";
+static void generate_instruction(vslc_context_t *ctx, size_t b,
+                                 tac_instruction_t *instruction) {
+    static const char *mnemonics[] = {
+        [TAC_NEGATE] = "negq", [TAC_NOT] = "notq",
+        [TAC_ADD] = "addq",    [TAC_SUBTRACT] = "subq",
+        [TAC_MULTIPLY] = "imulq", [TAC_OR] = "orq",
+        [TAC_XOR] = "xorq",    [TAC_AND] = "andq"};
+    tac_operand_t *result = &instruction->result;
+    const char *reg;
+    if (instruction->opcode != TAC_BRANCH &&
+        generate_selected(ctx, instruction))
+        return;
+    switch (instruction->opcode) {
+    case TAC_MOVE:
+        if (same_location(ctx, &instruction->left, result))
+            break;
+        if ((is_direct(&instruction->left) || in_register(ctx, result, NULL)) &&
+            !(in_memory(ctx, &instruction->left) && in_memory(ctx, result))) {
+            emit_string(ctx->code, "\tmovq\t");
+            generate_operand(ctx, &instruction->left);
+            emit_string(ctx->code, ", ");
+            generate_operand(ctx, result);
+            emit_string(ctx->code, "\n");
+            break;
+        }
+        generate_load(ctx, &instruction->left, "%rax");
+        generate_store(ctx, "%rax", result);
         break;
-    case '>':
-        instr = "jle";
+    case TAC_NEGATE:
+    case TAC_NOT:
+        reg = result_register(ctx, result);
+        generate_load(ctx, &instruction->left, reg);
+        emit(ctx->code, "\t%s\t%s\n", mnemonics[instruction->opcode], reg);
+        generate_store(ctx, reg, result);
         break;
-    case '=':
-        instr = "jne";
+    case TAC_ADD:
+    case TAC_SUBTRACT:
+    case TAC_MULTIPLY:
+    case TAC_OR:
+    case TAC_XOR:
+    case TAC_AND:
+        generate_binary(ctx, instruction, mnemonics[instruction->opcode]);
         break;
-    default:
-        ICE("invalid if statement relation");
+    case TAC_DIVIDE:
+        generate_load(ctx, &instruction->left, "%rax");
+        emit_string(ctx->code, "\tcqo\n");
+        if (instruction->right.kind == TAC_CONSTANT) {
+            generate_load(ctx, &instruction->right, "%rcx");
+            emit_string(ctx->code, "\tidivq\t%rcx\n");
+        } else {
+            emit_string(ctx->code, "\tidivq\t");
+            generate_operand(ctx, &instruction->right);
+            emit_string(ctx->code, "\n");
+        }
+        generate_store(ctx, "%rax", result);
         break;
-    }
-
-    printf("\t%s .ENDWHILE_%zu\n", instr, curr_count);
-
-    // Generate the while-statement body
-    generate_node(statement->children[1]);
-
-    // Jump to the beginning to loop
-    printf("\tjmp .WHILE_%zu\n", curr_count);
-
-    // Label for the end of the while-statement
-    printf(".ENDWHILE_%zu:\n", curr_count);
-
-    parent_while = prev_parent_while;
-}
-
-static void generate_null_statement(void) {
-    printf("\tjmp .WHILE_%zu\n", parent_while);
-}
-
-static void generate_node(node_t *node) {
-    switch (node->type) {
-    case PRINT_STATEMENT:
-        generate_print_statement(node);
+    case TAC_CALL:
+        generate_call(ctx, instruction);
         break;
-    case ASSIGNMENT_STATEMENT:
-    case ADD_STATEMENT:
-    case SUBTRACT_STATEMENT:
-    case MULTIPLY_STATEMENT:
-    case DIVIDE_STATEMENT:
-        generate_assignment_statement(node);
+    /* Items are put in the output buffer of the runtime, which takes each in
+     * rdi */
+    case TAC_PRINT_INT:
+        generate_load(ctx, &instruction->left, "%rdi");
+        emit_string(ctx->code, "\tcall\t__vsl_print_int\n");
         break;
-    case RETURN_STATEMENT:
-        generate_expression(node->children[0]);
-        printf("\tleave\n");
-        printf("\tret\n");
+    case TAC_PRINT_TEXT:
+        generate_load(ctx, &instruction->left, "%rdi");
+        emit_string(ctx->code, "\tcall\t__vsl_print_text\n");
         break;
-    case IF_STATEMENT:
-        generate_if_statement(node);
+    case TAC_PRINT_NEWLINE:
+        emit_string(ctx->code, "\tcall\t__vsl_print_newline\n");
         break;
-    case WHILE_STATEMENT:
-        generate_while_statement(node);
+    case TAC_JUMP:
+        if (ctx->lowered.blocks[b].successors[0] != b + 1)
+            generate_jump(ctx, "jmp", ctx->lowered.blocks[b].successors[0]);
         break;
-    case NULL_STATEMENT:
-        generate_null_statement();
+    case TAC_BRANCH:
+        generate_branch(ctx, b, instruction);
         break;
-    default:
-        for (size_t i = 0; i < node->n_children; i++)
-            generate_node(node->children[i]);
+    case TAC_RETURN:
+        generate_load(ctx, &instruction->left, "%rax");
+        for (size_t r = 0; r < ctx->lowered.n_saved_registers; r++)
+            emit(ctx->code, "\tmovq\t%d(%%rbp), %s\n", -8 * ((int64_t)r + 1),
+                 ctx->lowered.saved_registers[r]);
+        emit_string(ctx->code, "\tleave\n");
+        emit_string(ctx->code, "\tret\n");
         break;
+    case TAC_PHI:
+        ICE("phi left in generated code");
     }
 }
 
-void generate_function(symbol_t *function) {
-    current_function = function;
-
-    printf("_%s:\n", function->name);
-    puts("\tpushq   %rbp");
-    puts("\tmovq    %rsp, %rbp");
-
-    /* Save arguments in local stack frame */
-    for (size_t arg = 1; arg <= MIN(6, function->nparms); arg++)
-        printf("\tpushq\t%s\n", record[arg - 1]);
-    /* Make space for locals in local stack frame */
-    size_t local_vars = tlhash_size(function->locals) - function->nparms;
-    if (local_vars > 0)
-        printf("\tsubq $%zu, %%rsp\n", 8 * local_vars);
-    if ((tlhash_size(function->locals) & 1) == 1)
-        puts("\tpushq\t$0 /* Stack padding for 16-byte alignment */");
-    generate_node(function->node);
-    printf(
-        "\tmovq\t%%rbp, %%rsp\n" // 		movq	%rbp, %rsp	//
-                                 // restore stack pointer
-        "\tmovq\t$0, %%rax\n"    //      movq    $0, %rax    // return 0 if
-                                 //      nothing else
-        "\tpopq\t%%rbp\n"        //      popq	%rbp  		// restore base pointer
-        "\tret\n");              //      ret
-    current_function = NULL;
+/* The function is lowered to three-address code in tac.c, optimized in
+ * SSA form when asked to, and its blocks are made into assembly in order,
+ * which the peephole optimizer rewrites. Printed code shows the SSA form.
+ */
+void generate_function(vslc_context_t *ctx, symbol_t *function) {
+    tac_function_t *code = &ctx->lowered;
+    lower_function(ctx, function, code);
+    if (ctx->options.optimize) {
+        construct_ssa(code); // In ssa.c
+        propagate_constants(code, &ctx->statistics);
+    }
+    if (ctx->options.print_ir) {
+        print_tac(ctx, code);
+        return;
+    }
+    if (ctx->options.optimize)
+        destruct_ssa(code);
+    allocate_registers(code); // In regalloc.c
+
+    size_t start = ctx->code->length;
+    emit_string(ctx->code, ".p2align 4\n");
+    emit(ctx->code, ".globl _%s\n", function->name);
+    emit(ctx->code, "_%s:\n", function->name);
+    emit_string(ctx->code, "\tpushq   %rbp\n");
+    emit_string(ctx->code, "\tmovq    %rsp, %rbp\n");
+    for (size_t r = 0; r < code->n_saved_registers; r++)
+        emit(ctx->code, "\tpushq\t%s\n", code->saved_registers[r]);
+    /* Make space for the values spilled from registers, keeping the stack
+     * aligned to 16 bytes */
+    size_t n_slots = code->n_spill_slots;
+    n_slots += (code->n_saved_registers + n_slots) & 1;
+    if (n_slots > 0)
+        emit(ctx->code, "\tsubq\t$%u, %%rsp\n", 8 * n_slots);
+
+    /* Parameters move from the registers they were passed in to where they
+     * are kept. Those passed on the stack stay there unless given a
+     * register. */
+    for (size_t p = 0; p < function->nparms; p++) {
+        tac_location_t *kept = &code->locations[p];
+        if (kept->reg == NULL && kept->offset == 0)
+            continue;
+        if (p < 6) {
+            generate_store(ctx, record[p],
+                           &(tac_operand_t){.kind = TAC_VALUE, .number = p});
+        } else if (kept->reg != NULL) {
+            emit(ctx->code, "\tmovq\t%d(%%rbp), %s\n",
+                 16 + 8 * ((int64_t)p - 6), kept->reg);
+        }
+    }
+
+    // Instructions are counted over the blocks, as the allocator did
+    for (size_t b = 0, k = 0; b < code->n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        // Blocks only fallen into from the one before need no label
+        size_t *predecessors = &code->predecessors[block->first_predecessor];
+        if (block->n_predecessors > 1 ||
+            (block->n_predecessors == 1 && predecessors[0] != b - 1)) {
+            // Loops start on 16 bytes, unless that takes more than 10 to
+            // pad
+            for (size_t p = 0; p < block->n_predecessors; p++)
+                if (predecessors[p] >= b) {
+                    emit_string(ctx->code, ".p2align 4,,10\n");
+                    break;
+                }
+            generate_label(ctx, b);
+            emit_string(ctx->code, ":\n");
+        }
+        for (size_t i = 0; i < block->n_instructions; i++, k++) {
+            size_t n_generated = generate_update(ctx, k, block, i);
+            if (n_generated > 0) {
+                i += n_generated - 1;
+                k += n_generated - 1;
+                continue;
+            }
+            generate_instruction(ctx, b, &block->instructions[i]);
+        }
+    }
+    optimize_peephole(ctx, start); // In peephole.c
 }
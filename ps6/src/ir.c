@@ -1,54 +1,215 @@
+#include <inttypes.h>
 #include <vslc.h>
 
-// Externally visible, for the generator
-extern tlhash_t *global_names;
-extern char **string_list;
-extern size_t n_string_list, stringc;
-
-
 // Implementation choices, only relevant internally
-static void find_globals ( void );
-static void bind_names ( symbol_t *function, node_t *root );
-static void print_symbols ( tlhash_t *table );
-static void destroy_symtab ( void );
-
-// Internal details of name resolution
-static size_t n_scopes = 1, scope_depth = 0;
-static tlhash_t **scopes = NULL;
+static void find_globals ( vslc_context_t *ctx );
+static void bind_names (
+    vslc_context_t *ctx, symbol_t *function, node_t *root
+);
+static void print_symbols ( vslc_context_t *ctx, tlhash_t *table );
+static void destroy_symtab ( vslc_context_t *ctx );
+static symbol_t *lookup_global ( vslc_context_t *ctx, char *name );
+static void fold_print_items (
+    vslc_context_t *ctx, symbol_t *function, node_t *print
+);
+static void pop_scope ( vslc_context_t *ctx );
 
 /* External interface */
 
 void
-create_symbol_table ( void )
+create_symbol_table ( vslc_context_t *ctx )
 {
-    find_globals();
-    size_t n_globals = tlhash_size ( global_names );
+    find_globals ( ctx );
+    size_t n_globals = tlhash_size ( ctx->global_names );
     symbol_t *global_list[n_globals];
-    tlhash_values ( global_names, (void **)&global_list );
+    tlhash_values ( ctx->global_names, (void **)&global_list );
     for ( size_t i=0; i<n_globals; i++ )
         if ( global_list[i]->type == SYM_FUNCTION )
-            bind_names ( global_list[i], global_list[i]->node );
+            bind_function ( ctx, global_list[i] );
+}
+
+
+/* Resolve the names used in one function against the global table */
+void
+bind_function ( vslc_context_t *ctx, symbol_t *function )
+{
+    /* Scopes are only left open by a compile error */
+    while ( ctx->scope_depth > 0 )
+        pop_scope ( ctx );
+    ctx->next_slot = 0;
+    if ( ctx->string_list == NULL )
+        ctx->string_list = malloc ( ctx->n_string_list * sizeof(char *) );
+    bind_names ( ctx, function, function->node );
+}
+
+
+void
+print_symbol_table ( vslc_context_t *ctx )
+{
+    print_symbols ( ctx, ctx->global_names );
+    if ( ctx->extern_names == NULL )
+        return;
+    size_t n_externs = tlhash_size ( ctx->extern_names );
+    symbol_t *extern_list[n_externs];
+    tlhash_values ( ctx->extern_names, (void **)&extern_list );
+    for ( size_t e=0; e<n_externs; e++ )
+        fprintf ( ctx->diag, "extern %s: %s\n",
+            extern_list[e]->type == SYM_FUNCTION ? "function" : "global var",
+            extern_list[e]->name
+        );
 }
 
 
 void
-print_symbol_table ( void )
+destroy_symbol_table ( vslc_context_t *ctx )
 {
-    print_symbols ( global_names );
+    destroy_symtab ( ctx );
 }
 
 
 void
-destroy_symbol_table ( void )
+destroy_interfaces ( vslc_context_t *ctx )
 {
-    destroy_symtab();
+    if ( ctx->extern_names == NULL )
+        return;
+    size_t n_externs = tlhash_size ( ctx->extern_names );
+    symbol_t *extern_list[n_externs];
+    tlhash_values ( ctx->extern_names, (void **)&extern_list );
+    for ( size_t e=0; e<n_externs; e++ )
+    {
+        free ( extern_list[e]->name );
+        free ( extern_list[e] );
+    }
+    tlhash_finalize ( ctx->extern_names );
+    free ( ctx->extern_names );
+    ctx->extern_names = NULL;
+}
+
+
+/* Free the symbols of a global table, with their locals */
+void
+destroy_globals ( tlhash_t *table )
+{
+    size_t n_globals = tlhash_size ( table );
+    symbol_t *global_list[n_globals];
+    tlhash_values ( table, (void **)&global_list );
+    for ( size_t g=0; g<n_globals; g++ )
+    {
+        symbol_t *glob = global_list[g];
+        if ( glob->locals != NULL )
+        {
+            size_t n_locals = tlhash_size ( glob->locals );
+            symbol_t *locals[n_locals];
+            tlhash_values ( glob->locals, (void **)&locals );
+            for ( size_t l=0; l<n_locals; l++ )
+                free ( locals[l] );
+            tlhash_finalize ( glob->locals );
+            free ( glob->locals );
+        }
+        free ( glob );
+    }
+    tlhash_finalize ( table );
+}
+
+
+/* Strings are moved out of the tree into the string list by name binding */
+void
+release_strings ( vslc_context_t *ctx )
+{
+    for ( size_t i=0; i<ctx->stringc; i++ )
+        free ( ctx->string_list[i] );
+    ctx->stringc = 0;
+    if ( ctx->string_indices != NULL )
+    {
+        tlhash_finalize ( ctx->string_indices );
+        free ( ctx->string_indices );
+        ctx->string_indices = NULL;
+    }
+}
+
+
+/* Interface summaries of separately compiled units, one symbol per line:
+ *  function <name> <number of parameters>
+ *  global <name>
+ * Lines starting with '#' are comments.
+ * Returns 0 if the summary is well formed.
+ */
+int
+import_interface ( vslc_context_t *ctx, FILE *summary )
+{
+    if ( ctx->extern_names == NULL )
+    {
+        ctx->extern_names = malloc ( sizeof(tlhash_t) );
+        tlhash_init ( ctx->extern_names, 32 );
+    }
+    char kind[16], name[256];
+    while ( fscanf ( summary, " %15s", kind ) == 1 )
+    {
+        if ( kind[0] == '#' )
+        {
+            int c;
+            while ( (c = getc ( summary )) != '\n' && c != EOF )
+                ;
+            continue;
+        }
+        symbol_t *symbol = malloc ( sizeof(symbol_t) );
+        *symbol = (symbol_t) {
+            .type = SYM_GLOBAL_VAR,
+            .name = NULL,
+            .node = NULL,
+            .seq = 0,
+            .nparms = 0,
+            .locals = NULL
+        };
+        if ( !strcmp ( kind, "function" ) &&
+             fscanf ( summary, " %255s %zu", name, &symbol->nparms ) == 2 )
+            symbol->type = SYM_FUNCTION;
+        else if ( strcmp ( kind, "global" ) ||
+                  fscanf ( summary, " %255s", name ) != 1 )
+        {
+            free ( symbol );
+            return EXIT_FAILURE;
+        }
+        symbol->name = strdup ( name );
+        if ( tlhash_insert ( ctx->extern_names, symbol->name,
+                strlen(symbol->name), symbol ) == TLHASH_EEXIST )
+        {
+            free ( symbol->name );
+            free ( symbol );
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+
+void
+export_interface ( vslc_context_t *ctx, FILE *summary )
+{
+    size_t n_globals = tlhash_size ( ctx->global_names );
+    symbol_t *global_list[n_globals];
+    tlhash_values ( ctx->global_names, (void **)&global_list );
+    fprintf ( summary, "# vslc interface summary\n" );
+    for ( size_t i=0; i<n_globals; i++ )
+        switch ( global_list[i]->type )
+        {
+            case SYM_FUNCTION:
+                fprintf ( summary, "function %s %zu\n",
+                    global_list[i]->name, global_list[i]->nparms
+                );
+                break;
+            case SYM_GLOBAL_VAR:
+                fprintf ( summary, "global %s\n", global_list[i]->name );
+                break;
+            default:
+                break;
+        }
 }
 
 /* Internal matters */
 
 
 static void
-print_symbols ( tlhash_t *table )
+print_symbols ( vslc_context_t *ctx, tlhash_t *table )
 {
     if ( table == NULL )
         return;
@@ -60,22 +221,22 @@ print_symbols ( tlhash_t *table )
         switch ( entry_list[e]->type )
         {
             case SYM_FUNCTION:
-                fprintf ( stderr, "function: %s\n", entry_list[e]->name );
+                fprintf ( ctx->diag, "function: %s\n", entry_list[e]->name );
                 if ( entry_list[e]->type == SYM_FUNCTION )
-                    print_symbols ( entry_list[e]->locals );
+                    print_symbols ( ctx, entry_list[e]->locals );
                 break;
             case SYM_GLOBAL_VAR:
-                fprintf ( stderr, "global var: %s\n", entry_list[e]->name );
+                fprintf ( ctx->diag, "global var: %s\n", entry_list[e]->name );
                 break;
             case SYM_PARAMETER:
-                fprintf ( stderr, "parameter: %s\n", entry_list[e]->name );
+                fprintf ( ctx->diag, "parameter: %s\n", entry_list[e]->name );
                 break;
             case SYM_LOCAL_VAR:
-                fprintf ( stderr, "local var: %s\n", entry_list[e]->name );
+                fprintf ( ctx->diag, "local var: %s\n", entry_list[e]->name );
                 break;
             default:
                 /* This should never happen if all symbols have correct type */
-                fprintf ( stderr,
+                fprintf ( ctx->diag,
                     "** Unknown symbol: %s\n", entry_list[e]->name
                 );
                 break;
@@ -85,23 +246,114 @@ print_symbols ( tlhash_t *table )
 
 
 static void
-add_global ( symbol_t *symbol )
+add_global ( tlhash_t *table, symbol_t *symbol )
 {
-    tlhash_insert (
-        global_names, symbol->name, strlen(symbol->name), symbol
-    );
+    tlhash_insert ( table, symbol->name, strlen(symbol->name), symbol );
 }
 
 
 static void
-find_globals ( void )
+find_globals ( vslc_context_t *ctx )
 {
-    global_names = malloc ( sizeof(tlhash_t) );
-    tlhash_init ( global_names, 32 );
-    string_list = malloc ( n_string_list * sizeof(char * ) );
-    size_t n_functions = 0;
+    ctx->global_names = malloc ( sizeof(tlhash_t) );
+    tlhash_init ( ctx->global_names, 32 );
+    if ( ctx->string_list == NULL )
+        ctx->string_list = malloc ( ctx->n_string_list * sizeof(char * ) );
+    declare_globals ( ctx->global_names, ctx->root->children[0] );
+}
+
+
+/* Enter the functions and variables of the source into the global table
+ * from its tokens alone, before it is parsed. Global declarations are the
+ * ones outside of blocks, as a function body can only declare in a block.
+ * The symbols own copies of their names, there is no tree to hold them.
+ */
+void
+predeclare_globals ( vslc_context_t *ctx )
+{
+    ctx->global_names = malloc ( sizeof(tlhash_t) );
+    tlhash_init ( ctx->global_names, 32 );
+    size_t n_functions = 0, depth = 0;
+    YYSTYPE value;
+    int token = yylex ( &value, ctx->scanner );
+    while ( token != 0 )
+    {
+        symbol_t *symbol;
+        switch ( token )
+        {
+            case OPENBLOCK:
+                depth += 1;
+                token = yylex ( &value, ctx->scanner );
+                break;
+            case CLOSEBLOCK:
+                if ( depth > 0 )
+                    depth -= 1;
+                token = yylex ( &value, ctx->scanner );
+                break;
+            case FUNC:
+                depth = 0;
+                n_functions++;
+                if ( (token = yylex ( &value, ctx->scanner )) != IDENTIFIER )
+                    break;
+                symbol = malloc ( sizeof(symbol_t) );
+                *symbol = (symbol_t) {
+                    .type = SYM_FUNCTION,
+                    .name = strdup ( yyget_text ( ctx->scanner ) ),
+                    .node = NULL,
+                    .seq = n_functions - 1,
+                    .nparms = 0,
+                    .line = yyget_lineno ( ctx->scanner ),
+                    .locals = NULL
+                };
+                if ( (token = yylex ( &value, ctx->scanner )) == '(' )
+                    while ( (token = yylex ( &value, ctx->scanner )) ==
+                            IDENTIFIER || token == ',' )
+                        if ( token == IDENTIFIER )
+                            symbol->nparms += 1;
+                if ( tlhash_insert ( ctx->global_names, symbol->name,
+                        strlen(symbol->name), symbol ) == TLHASH_EEXIST )
+                {
+                    free ( symbol->name );
+                    free ( symbol );
+                }
+                break;
+            case VAR:
+                token = yylex ( &value, ctx->scanner );
+                while ( depth == 0 && token == IDENTIFIER )
+                {
+                    symbol = malloc ( sizeof(symbol_t) );
+                    *symbol = (symbol_t) {
+                        .type = SYM_GLOBAL_VAR,
+                        .name = strdup ( yyget_text ( ctx->scanner ) ),
+                        .node = NULL,
+                        .seq = 0,
+                        .nparms = 0,
+                        .line = yyget_lineno ( ctx->scanner ),
+                        .locals = NULL
+                    };
+                    if ( tlhash_insert ( ctx->global_names, symbol->name,
+                            strlen(symbol->name), symbol ) == TLHASH_EEXIST )
+                    {
+                        free ( symbol->name );
+                        free ( symbol );
+                    }
+                    if ( (token = yylex ( &value, ctx->scanner )) == ',' )
+                        token = yylex ( &value, ctx->scanner );
+                }
+                break;
+            default:
+                token = yylex ( &value, ctx->scanner );
+                break;
+        }
+    }
+}
+
 
-    node_t *global_list = root->children[0];
+/* Enter symbols for the functions and variables of a global list */
+void
+declare_globals ( tlhash_t *table, node_t *global_list )
+{
+    size_t n_functions = 0;
     for ( uint64_t g=0; g<global_list->n_children; g++ )
     {
         node_t *global = global_list->children[g], *namelist;
@@ -116,6 +368,7 @@ find_globals ( void )
                     .node = global->children[2],
                     .seq = n_functions,
                     .nparms = 0,
+                    .line = global->children[0]->line,
                     .locals = malloc ( sizeof(tlhash_t) )
                 };
                 n_functions++;
@@ -134,6 +387,7 @@ find_globals ( void )
                             .node = NULL,
                             .seq = p,
                             .nparms = 0,
+                            .line = param->line,
                             .locals = NULL
                         };
                         tlhash_insert (
@@ -141,7 +395,7 @@ find_globals ( void )
                         );
                     }
                 }
-                add_global ( symbol );
+                add_global ( table, symbol );
                 break;
             case DECLARATION:
                 namelist = global->children[0];
@@ -154,9 +408,10 @@ find_globals ( void )
                         .node = NULL,
                         .seq = 0,
                         .nparms = 0,
+                        .line = namelist->children[d]->line,
                         .locals = NULL
                     };
-                    add_global(symbol);
+                    add_global ( table, symbol );
                 }
                 break;
         }
@@ -165,75 +420,112 @@ find_globals ( void )
 
 
 static void
-push_scope ( void )
+push_scope ( vslc_context_t *ctx )
 {
-    if ( scopes == NULL )
-        scopes = malloc ( n_scopes * sizeof(tlhash_t *) );
+    if ( ctx->scopes == NULL )
+        ctx->scopes = malloc ( ctx->n_scopes * sizeof(tlhash_t *) );
     tlhash_t *new_scope = malloc ( sizeof(tlhash_t) );
     tlhash_init ( new_scope, 32 );
-    scopes[scope_depth] = new_scope;
+    ctx->scopes[ctx->scope_depth] = new_scope;
 
-    scope_depth += 1;
-    if ( scope_depth >= n_scopes )
+    ctx->scope_depth += 1;
+    if ( ctx->scope_depth >= ctx->n_scopes )
     {
-        n_scopes *= 2;
-        scopes = realloc ( scopes, n_scopes*sizeof(tlhash_t **) );
+        ctx->n_scopes *= 2;
+        ctx->scopes = realloc (
+            ctx->scopes, ctx->n_scopes*sizeof(tlhash_t **)
+        );
     }
 
 }
 
 
 static void
-add_local ( symbol_t *local )
+add_local ( vslc_context_t *ctx, symbol_t *local )
 {
     tlhash_insert (
-        scopes[scope_depth-1],local->name,strlen(local->name),local
+        ctx->scopes[ctx->scope_depth-1],local->name,strlen(local->name),local
     );
 }
 
 
 static symbol_t *
-lookup_local ( char *name )
+lookup_local ( vslc_context_t *ctx, char *name )
 {
     symbol_t *result = NULL;
-    size_t depth = scope_depth;
+    size_t depth = ctx->scope_depth;
     while ( result == NULL && depth > 0 )
     {
         depth -= 1;
-        tlhash_lookup ( scopes[depth], name, strlen(name), (void **)&result );
+        tlhash_lookup (
+            ctx->scopes[depth], name, strlen(name), (void **)&result
+        );
     }
     return result;
 }
 
 
 static void
-pop_scope ( void )
+pop_scope ( vslc_context_t *ctx )
+{
+    ctx->scope_depth -= 1;
+    tlhash_finalize ( ctx->scopes[ctx->scope_depth] );
+    free ( ctx->scopes[ctx->scope_depth] );
+    ctx->scopes[ctx->scope_depth] = NULL;
+}
+
+
+static symbol_t *
+lookup_global ( vslc_context_t *ctx, char *name )
 {
-    scope_depth -= 1;
-    tlhash_finalize ( scopes[scope_depth] );
-    free ( scopes[scope_depth] );
-    scopes[scope_depth] = NULL;
+    symbol_t *result = NULL;
+    tlhash_lookup ( ctx->global_names, name, strlen(name), (void **)&result );
+    if ( result == NULL && ctx->extern_names != NULL )
+        tlhash_lookup (
+            ctx->extern_names, name, strlen(name), (void **)&result
+        );
+    return result;
 }
 
 
+/* Identical strings share one entry, and so one label in the program */
 static void
-add_string ( node_t *string )
+add_string ( vslc_context_t *ctx, node_t *string )
 {
-    string_list[stringc] = string->data;
+    char *text = string->data;
+    void *index;
+    if ( ctx->string_indices == NULL )
+    {
+        ctx->string_indices = malloc ( sizeof(tlhash_t) );
+        tlhash_init ( ctx->string_indices, 64 );
+    }
     string->data = malloc ( sizeof(size_t) );
-    *((size_t *)string->data) = stringc;
-    stringc++;
-    if ( stringc >= n_string_list )
+    if ( tlhash_lookup (
+        ctx->string_indices, text, strlen(text), &index ) == TLHASH_SUCCESS )
+    {
+        *((size_t *)string->data) = (uintptr_t)index;
+        free ( text );
+        return;
+    }
+    ctx->string_list[ctx->stringc] = text;
+    *((size_t *)string->data) = ctx->string_base + ctx->stringc;
+    tlhash_insert ( ctx->string_indices, text, strlen(text),
+        (void *)(uintptr_t)(ctx->string_base + ctx->stringc)
+    );
+    ctx->stringc++;
+    if ( ctx->stringc >= ctx->n_string_list )
     {
-        n_string_list *= 2;
-        string_list = realloc ( string_list, n_string_list * sizeof(char *) );
+        ctx->n_string_list *= 2;
+        ctx->string_list = realloc (
+            ctx->string_list, ctx->n_string_list * sizeof(char *)
+        );
     }
         
 }
 
 
 static void
-bind_names ( symbol_t *function, node_t *root )
+bind_names ( vslc_context_t *ctx, symbol_t *function, node_t *root )
 {
     if ( root == NULL )
         return;
@@ -241,12 +533,18 @@ bind_names ( symbol_t *function, node_t *root )
     {
         node_t *namelist;
         symbol_t *entry;
+        size_t slot_base;
 
         case BLOCK:
-            push_scope();
+            /* Locals of sibling blocks are never live at the same time,
+             * so their stack slots are reused when the block closes
+             */
+            slot_base = ctx->next_slot;
+            push_scope ( ctx );
             for ( size_t c=0; c<root->n_children; c++ )
-                bind_names ( function, root->children[c] );
-            pop_scope();
+                bind_names ( ctx, function, root->children[c] );
+            pop_scope ( ctx );
+            ctx->next_slot = slot_base;
             break;
 
         case DECLARATION:
@@ -261,76 +559,147 @@ bind_names ( symbol_t *function, node_t *root )
                     .type = SYM_LOCAL_VAR,
                     .name = varname->data,
                     .node = NULL,
-                    .seq = local_num,
+                    .seq = ctx->next_slot,
                     .nparms = 0,
+                    .line = varname->line,
                     .locals = NULL
                 };
+                ctx->next_slot += 1;
+                if ( ctx->next_slot > function->nlocals )
+                    function->nlocals = ctx->next_slot;
                 tlhash_insert (
                     function->locals, &local_num, sizeof(size_t), symbol
                 );
-                add_local ( symbol );
+                add_local ( ctx, symbol );
             }
             break;
 
         case IDENTIFIER_DATA:
-            entry = lookup_local ( root->data );
+            entry = lookup_local ( ctx, root->data );
             if ( entry == NULL )
                 tlhash_lookup (
                     function->locals, root->data,
                     strlen(root->data), (void**)&entry
                 );
             if ( entry == NULL )
-                tlhash_lookup (
-                    global_names,root->data,strlen(root->data),(void**)&entry
-                );
+                entry = lookup_global ( ctx, root->data );
             if ( entry == NULL )
             {
-                fprintf ( stderr, "Identifier '%s' does not exist in scope\n",
+                ctx->error_line = root->line;
+                compile_error ( ctx, "Identifier '%s' does not exist in scope",
                     (char *)root->data
                 );
-                exit ( EXIT_FAILURE );
             }
             root->entry = entry;
             break;
 
         case STRING_DATA:
-            add_string ( root );
+            add_string ( ctx, root );
+            break;
+
+        case PRINT_STATEMENT:
+            fold_print_items ( ctx, function, root );
             break;
 
         default:
             for ( size_t c=0; c<root->n_children; c++ )
-                bind_names ( function, root->children[c] );
+                bind_names ( ctx, function, root->children[c] );
             break;
     }
 }
 
 
-void
-destroy_symtab ( void )
+/* Runs of constant items are printed as one string, which holds the spaces
+ * after them, and the newline when they end the statement. The generator
+ * only prints a newline after a statement ending in a variable item.
+ */
+static void
+fold_print_items ( vslc_context_t *ctx, symbol_t *function, node_t *print )
 {
-    for ( size_t i=0; i<stringc; i++ )
-        free ( string_list[i] );
-    free ( string_list );
-
-    size_t n_globals = tlhash_size ( global_names );
-    symbol_t *global_list[n_globals];
-    tlhash_values ( global_names, (void **)&global_list );
-    for ( size_t g=0; g<n_globals; g++ )
+    size_t n_items = 0, i = 0;
+    while ( i < print->n_children )
     {
-        symbol_t *glob = global_list[g];
-        if ( glob->locals != NULL )
+        node_t *item = print->children[i];
+        if ( item->type != STRING_DATA && item->type != NUMBER_DATA )
         {
-            size_t n_locals = tlhash_size ( glob->locals );
-            symbol_t *locals[n_locals];
-            tlhash_values ( glob->locals, (void **)&locals );
-            for ( size_t l=0; l<n_locals; l++ )
-                free ( locals[l] );
-            tlhash_finalize ( glob->locals );
-            free ( glob->locals );
+            bind_names ( ctx, function, item );
+            print->children[n_items++] = item;
+            i += 1;
+            continue;
         }
-        free ( glob );
+
+        /* Strings are kept in their quotes, and joined inside one pair */
+        size_t end = i, length = sizeof("\"\\n\"");
+        for ( ; end < print->n_children; end++ )
+        {
+            node_t *next = print->children[end];
+            if ( next->type == STRING_DATA )
+                length += strlen ( next->data ) - 2 + 1;
+            else if ( next->type == NUMBER_DATA )
+                length += sizeof("-9223372036854775808");
+            else
+                break;
+        }
+        char *text = malloc ( length ), *put = text;
+        *put++ = '"';
+        for ( size_t c=i; c<end; c++ )
+        {
+            node_t *next = print->children[c];
+            if ( next->type == STRING_DATA )
+            {
+                size_t n = strlen ( next->data ) - 2;
+                memcpy ( put, (char *)next->data + 1, n );
+                put += n;
+            }
+            else
+                put += sprintf ( put, "%" PRId64, *(int64_t *)next->data );
+            *put++ = ' ';
+            if ( c > i )
+                destroy_subtree ( ctx, next ); // In tree.c
+        }
+        if ( end == print->n_children )
+            put += sprintf ( put, "\\n" );
+        sprintf ( put, "\"" );
+
+        /* The first item of the run stands for all of it */
+        free ( item->data );
+        item->type = STRING_DATA;
+        item->data = text;
+        add_string ( ctx, item );
+        print->children[n_items++] = item;
+        i = end;
+    }
+    print->n_children = n_items;
+}
+
+
+void
+destroy_symtab ( vslc_context_t *ctx )
+{
+    /* The string list and scope stack keep their capacity, for the next
+     * compilation in this context
+     */
+    release_strings ( ctx );
+    ctx->string_base = 0;
+
+    /* Scopes are only left open by a compile error */
+    while ( ctx->scope_depth > 0 )
+        pop_scope ( ctx );
+    ctx->next_slot = 0;
+
+    if ( ctx->global_names == NULL )
+        return;
+    if ( ctx->streaming )
+    {
+        /* Predeclared globals own their names */
+        size_t n_globals = tlhash_size ( ctx->global_names );
+        symbol_t *global_list[n_globals+1];
+        tlhash_values ( ctx->global_names, (void **)&global_list );
+        for ( size_t g=0; g<n_globals; g++ )
+            free ( global_list[g]->name );
     }
-    tlhash_finalize ( global_names );
-    free ( global_names );
-    free ( scopes );
+    destroy_globals ( ctx->global_names );
+    free ( ctx->global_names );
+    ctx->global_names = NULL;
 }
+
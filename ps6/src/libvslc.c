@@ -0,0 +1,343 @@
+#include <vslc.h>
+
+const vslc_options_t vslc_default_options = {
+    .generate_program = true,
+    .new_print_style = true,
+    .threads = 1,
+    .cache_directory = NULL,
+    .cache_limit = 64 << 20,
+};
+
+static int run_passes ( vslc_context_t *ctx, FILE *summary );
+
+/* External interface */
+
+vslc_context_t *
+vslc_context_create ( const vslc_options_t *options )
+{
+    vslc_context_t *ctx = calloc ( 1, sizeof(vslc_context_t) );
+    if ( ctx == NULL )
+        return NULL;
+    ctx->options = ( options != NULL ) ? *options : vslc_default_options;
+    ctx->n_string_list = 8; // Initial capacities, grow on demand
+    ctx->n_scopes = 1;
+    return ctx;
+}
+
+
+void
+vslc_context_destroy ( vslc_context_t *ctx )
+{
+    if ( ctx == NULL )
+        return;
+    destroy_interfaces ( ctx ); // In ir.c
+    destroy_node_pool ( ctx );  // In tree.c
+    /* Scopes are only left open by a compile error */
+    for ( size_t d=0; d<ctx->scope_depth; d++ )
+    {
+        tlhash_finalize ( ctx->scopes[d] );
+        free ( ctx->scopes[d] );
+    }
+    buffer_free ( &ctx->fragment ); // In emit.c
+    tac_free ( &ctx->lowered );     // In tac.c
+    free ( ctx->string_list );
+    free ( ctx->scopes );
+    free ( ctx );
+}
+
+
+void
+vslc_set_options ( vslc_context_t *ctx, const vslc_options_t *options )
+{
+    ctx->options = *options;
+}
+
+
+void
+vslc_forget_interfaces ( vslc_context_t *ctx )
+{
+    destroy_interfaces ( ctx ); // In ir.c
+}
+
+
+int
+vslc_import_interface (
+    vslc_context_t *ctx, const char *summary, size_t length
+)
+{
+    if ( length == 0 )
+        return EXIT_SUCCESS;
+    FILE *in = fmemopen ( (void *)summary, length, "r" );
+    if ( in == NULL )
+        return EXIT_FAILURE;
+    int status = import_interface ( ctx, in ); // In ir.c
+    fclose ( in );
+    return status;
+}
+
+
+int
+vslc_compile (
+    vslc_context_t *ctx, const char *source, size_t length,
+    vslc_result_t *result
+)
+{
+    return vslc_compile_to ( ctx, source, length, NULL, result );
+}
+
+
+int
+vslc_compile_to (
+    vslc_context_t *ctx, const char *source, size_t length, FILE *code_out,
+    vslc_result_t *result
+)
+{
+    int status = EXIT_FAILURE;
+    FILE *in, *summary = NULL;
+    buffer_t code = { 0 };
+
+    *result = (vslc_result_t) { 0 };
+    ctx->out = open_memstream ( &result->output, &result->output_length );
+    ctx->code = &code;
+    // An object is only assembled from the whole program
+    if ( !ctx->options.object_code )
+        ctx->code_stream = code_out;
+    ctx->diag = open_memstream (
+        &result->diagnostics, &result->diagnostics_length
+    );
+    if ( ctx->options.export_interface )
+        summary = open_memstream (
+            &result->interface, &result->interface_length
+        );
+
+    in = fmemopen ( (void *)source, length, "r" );
+    if ( in == NULL )
+        fprintf ( ctx->diag, "Cannot read source of %zu bytes\n", length );
+    else
+    {
+        yylex_init ( &ctx->scanner );
+        yyset_in ( in, ctx->scanner );
+        if ( setjmp ( ctx->error_exit ) == 0 )
+            status = run_passes ( ctx, summary );
+        yylex_destroy ( ctx->scanner );
+        ctx->scanner = NULL;
+        fclose ( in );
+    }
+
+    destroy_syntax_tree ( ctx );  // In tree.c
+    destroy_symbol_table ( ctx ); // In ir.c
+    fclose ( ctx->out );
+    fclose ( ctx->diag );
+    ctx->out = ctx->diag = NULL;
+    ctx->code = NULL;
+    if ( summary != NULL )
+        fclose ( summary );
+    if ( ctx->code_stream != NULL )
+    {
+        emit_flush ( &code, ctx->code_stream );
+        buffer_free ( &code );
+        ctx->code_stream = NULL;
+        return status;
+    }
+
+    /* The code follows any printed trees, and is the output as it is when
+     * there are none
+     */
+    emit_bytes ( &code, "", 1 );
+    if ( result->output_length == 0 )
+    {
+        free ( result->output );
+        result->output = code.data;
+        result->output_length = code.length - 1;
+    }
+    else
+    {
+        result->output = realloc (
+            result->output, result->output_length + code.length
+        );
+        memcpy ( result->output + result->output_length, code.data,
+            code.length
+        );
+        result->output_length += code.length - 1;
+        buffer_free ( &code );
+    }
+    return status;
+}
+
+
+int
+vslc_compile_stream (
+    vslc_context_t *ctx, FILE *source, FILE *output, FILE *diagnostics,
+    FILE *interface
+)
+{
+    int status = EXIT_FAILURE;
+    buffer_t code = { 0 };
+    ctx->out = output;
+    ctx->code = &code;
+    ctx->diag = diagnostics;
+    ctx->streaming = true;
+    ctx->n_streamed = 0;
+
+    if ( setjmp ( ctx->error_exit ) == 0 )
+    {
+        yylex_init ( &ctx->scanner );
+        yyset_in ( source, ctx->scanner );
+        predeclare_globals ( ctx ); // In ir.c
+        yylex_destroy ( ctx->scanner );
+        ctx->scanner = NULL;
+
+        if ( fseek ( source, 0, SEEK_SET ) != 0 )
+            fprintf ( ctx->diag, "Cannot read the source a second time\n" );
+        else
+        {
+            if ( ctx->options.print_symbol_table )
+                print_symbol_table ( ctx );
+            if ( interface != NULL )
+                export_interface ( ctx, interface ); // In ir.c
+            if ( ctx->options.generate_program )
+                generate_program_start ( ctx ); // In generator.c
+            emit_flush ( ctx->code, ctx->out );
+
+            /* The parser calls stream_global for every global it reduces */
+            yylex_init ( &ctx->scanner );
+            yyset_in ( source, ctx->scanner );
+            if ( yyparse ( ctx->scanner, ctx ) == 0 )
+            {
+                status = EXIT_SUCCESS;
+                if ( ctx->options.generate_program )
+                    generate_program_end ( ctx );
+            }
+        }
+    }
+    if ( ctx->scanner != NULL )
+        yylex_destroy ( ctx->scanner );
+    ctx->scanner = NULL;
+
+    destroy_syntax_tree ( ctx );  // In tree.c
+    destroy_symbol_table ( ctx ); // In ir.c
+    emit_flush ( &code, output );
+    buffer_free ( &code );
+    ctx->streaming = false;
+    ctx->out = ctx->diag = NULL;
+    ctx->code = NULL;
+    return status;
+}
+
+
+/* Compile one global as soon as the parser has reduced it, and free its
+ * tree. Errors are caught here, so the parser can stop and free its stack.
+ * Returns 0 on success.
+ */
+int
+stream_global ( vslc_context_t *ctx, node_t *global )
+{
+    jmp_buf parse_exit;
+    memcpy ( parse_exit, ctx->error_exit, sizeof(jmp_buf) );
+    tlhash_t function_names;
+    tlhash_init ( &function_names, 1 );
+
+    node_t *global_list;
+    node_init ( global_list = node_alloc(ctx), GLOBAL_LIST, NULL, 1, global );
+    node_init ( ctx->root = node_alloc(ctx), PROGRAM, NULL, 1, global_list );
+    int status = EXIT_FAILURE;
+    if ( setjmp ( ctx->error_exit ) == 0 )
+    {
+        if ( ctx->options.print_full_tree )
+            print_syntax_tree ( ctx );
+        simplify_syntax_tree ( ctx ); // In tree.c
+        if ( ctx->options.print_simplified_tree )
+            print_syntax_tree ( ctx );
+
+        /* Declarations were entered by predeclare_globals, and only the
+         * first definition of a function name is compiled, as in whole
+         */
+        node_t *function = ctx->root->children[0]->children[0];
+        symbol_t *declared = NULL;
+        if ( function->type == FUNCTION )
+        {
+            char *name = function->children[0]->data;
+            tlhash_lookup ( ctx->global_names, name, strlen(name),
+                (void **)&declared
+            );
+            ctx->n_streamed += 1;
+        }
+        if ( declared != NULL && declared->type == SYM_FUNCTION &&
+             declared->seq == ctx->n_streamed - 1 )
+        {
+            symbol_t *symbol;
+            declare_globals ( &function_names, ctx->root->children[0] );
+            tlhash_values ( &function_names, (void **)&symbol );
+            symbol->seq = declared->seq;
+            bind_function ( ctx, symbol ); // In ir.c
+            if ( ctx->options.share_expressions )
+                hash_cons_syntax_tree ( ctx ); // In tree.c
+            if ( ctx->options.generate_program )
+                generate_streamed_function ( ctx, symbol ); // In generator.c
+        }
+        status = EXIT_SUCCESS;
+    }
+    memcpy ( ctx->error_exit, parse_exit, sizeof(jmp_buf) );
+    emit_flush ( ctx->code, ctx->out ); // Only one function is held
+
+    ctx->string_base += ctx->stringc;
+    release_strings ( ctx );      // In ir.c
+    destroy_globals ( &function_names );
+    destroy_syntax_tree ( ctx );
+    return status;
+}
+
+
+void
+vslc_result_free ( vslc_result_t *result )
+{
+    free ( result->output );
+    free ( result->diagnostics );
+    free ( result->interface );
+    *result = (vslc_result_t) { 0 };
+}
+
+
+void
+compile_error ( vslc_context_t *ctx, const char *format, ... )
+{
+    va_list args;
+    va_start ( args, format );
+    vfprintf ( ctx->diag, format, args );
+    va_end ( args );
+    fputc ( '\n', ctx->diag );
+    longjmp ( ctx->error_exit, 1 );
+}
+
+/* Internal matters */
+
+
+static int
+run_passes ( vslc_context_t *ctx, FILE *summary )
+{
+    // Generated from grammar/bison, constructs syntax tree
+    if ( yyparse ( ctx->scanner, ctx ) != 0 )
+        return EXIT_FAILURE;
+
+    if ( ctx->options.print_full_tree )
+        print_syntax_tree ( ctx );
+    simplify_syntax_tree ( ctx ); // In tree.c
+    if ( ctx->options.print_simplified_tree )
+        print_syntax_tree ( ctx );
+
+    create_symbol_table ( ctx ); // In ir.c
+    if ( ctx->options.print_symbol_table )
+        print_symbol_table ( ctx );
+    if ( summary != NULL )
+        export_interface ( ctx, summary ); // In ir.c
+    if ( ctx->options.share_expressions )
+        hash_cons_syntax_tree ( ctx ); // In tree.c
+
+    if ( ctx->options.generate_program )
+    {
+        generate_program ( ctx ); // In generator.c
+        if ( ctx->options.object_code )
+            assemble_object ( ctx ); // In object.c
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1582 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lsp.h>
+#include <vslc.h>
+
+/* Messages with longer bodies are dropped */
+#define MAX_MESSAGE_LENGTH ((size_t)1 << 30)
+
+/* Documents are split into chunks, one per function or global declaration,
+ * at the keywords that can only start one. An edit to a range of the text
+ * splits the new text of the chunks around it again, and matches those
+ * against the old ones from both ends, so only the chunks in between are
+ * parsed again. Positions count characters as bytes.
+ *
+ * Global symbols are shared between the chunks of a document. When a chunk
+ * is replaced by one declaring the same kind of symbol under the same name
+ * and arity, the new declaration moves into the old symbol, and the chunks
+ * using it stay bound to it. Other changes to the visible globals make the
+ * chunks that mention a changed name parse and bind again.
+ *
+ * Messages are built in buffers with the emitter of the generator.
+ */
+
+typedef struct {
+    size_t line; // Like node lines, from 1 at the start of the chunk
+    char *message;
+} diagnostic_t;
+
+typedef struct {
+    char *text;
+    size_t length;
+    size_t line, column; // Where the chunk starts in the document, from 0
+    node_t *root;        // Simplified syntax tree, NULL if it did not parse
+    tlhash_t names;      // Global symbols declared in the chunk
+    tlhash_t references; // Every identifier used in the chunk
+    diagnostic_t *diagnostics;
+    size_t n_diagnostics;
+} chunk_t;
+
+typedef struct document {
+    char *uri;
+    chunk_t **chunks;
+    size_t n_chunks;
+    tlhash_t globals;    // The visible declaration of each global name
+    tlhash_t duplicates; // Names that may be declared more than once
+    struct document *next;
+} document_t;
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} json_type_t;
+
+typedef struct json {
+    json_type_t type;
+    char *key; // Name of an object member
+    char *string;
+    double number;
+    bool boolean;
+    struct json *children, *next;
+} json_t;
+
+typedef struct {
+    const char *text;
+    size_t position, length;
+} json_parser_t;
+
+static struct {
+    vslc_context_t *ctx;
+    document_t *documents;
+    FILE *out;
+    bool shutdown;
+} server;
+
+static void handle ( const char *method, json_t *id, json_t *params );
+static void replace_region (
+    document_t *document, size_t first, size_t last,
+    const char *text, size_t length
+);
+static void edit_document (
+    document_t *document, json_t *range, const char *text
+);
+static void replace_chunks (
+    document_t *document, chunk_t **fresh, size_t n_fresh,
+    chunk_t **removed, size_t n_removed, tlhash_t *changed
+);
+static size_t split_document (
+    const char *text, size_t length, size_t **starts
+);
+static chunk_t *parse_chunk ( const char *text, size_t length );
+static void bind_chunk ( document_t *document, chunk_t *chunk );
+static void collect_references ( chunk_t *chunk, node_t *node );
+static void add_diagnostic (
+    chunk_t *chunk, size_t line, const char *message
+);
+static void free_chunk ( chunk_t *chunk );
+static void free_document ( document_t *document );
+static void publish_diagnostics ( document_t *document );
+
+static symbol_t *lookup ( tlhash_t *table, const char *name );
+static void mark ( tlhash_t *set, const char *name );
+static bool marked ( tlhash_t *set, const char *name );
+
+static char *read_message ( FILE *in, size_t *length, bool *dropped );
+static void send_message ( buffer_t *body );
+static void begin_response ( buffer_t *body, json_t *id );
+static void end_response ( buffer_t *body );
+
+static json_t *json_parse ( const char *text, size_t length );
+static json_t *json_parse_value ( json_parser_t *p );
+static char *json_parse_string ( json_parser_t *p );
+static void json_free ( json_t *value );
+static json_t *json_get ( json_t *value, const char *path );
+static const char *json_string ( json_t *value, const char *path );
+static long json_number ( json_t *value, const char *path, long fallback );
+static void json_write_string ( buffer_t *out, const char *string );
+static void json_write_id ( buffer_t *out, json_t *id );
+
+
+/* External interface */
+
+int
+serve_language ( FILE *in, FILE *out )
+{
+    server.ctx = vslc_context_create ( NULL );
+    server.out = out;
+    server.shutdown = false;
+
+    char *message;
+    size_t length;
+    bool dropped;
+    while ( (message = read_message ( in, &length, &dropped )) != NULL
+        || dropped )
+    {
+        if ( dropped )
+        {
+            buffer_t error = { 0 };
+            emit_string ( &error,
+                "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":"
+                "{\"code\":-32600,\"message\":\"Message too large\"}}"
+            );
+            send_message ( &error );
+            buffer_free ( &error );
+            continue;
+        }
+        json_t *request = json_parse ( message, length );
+        free ( message );
+        if ( request == NULL )
+        {
+            buffer_t error = { 0 };
+            emit_string ( &error,
+                "{\"jsonrpc\":\"2.0\",\"id\":null,\"error\":"
+                "{\"code\":-32700,\"message\":\"Parse error\"}}"
+            );
+            send_message ( &error );
+            buffer_free ( &error );
+            continue;
+        }
+        const char *method = json_string ( request, "method" );
+        if ( method != NULL && !strcmp ( method, "exit" ) )
+        {
+            json_free ( request );
+            break;
+        }
+        if ( method != NULL )
+            handle ( method,
+                json_get ( request, "id" ), json_get ( request, "params" )
+            );
+        json_free ( request );
+    }
+
+    while ( server.documents != NULL )
+    {
+        document_t *document = server.documents;
+        server.documents = document->next;
+        free_document ( document );
+    }
+    vslc_context_destroy ( server.ctx );
+    return server.shutdown ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Requests and notifications */
+
+
+static document_t *
+find_document ( json_t *params )
+{
+    const char *uri = json_string ( params, "textDocument.uri" );
+    for ( document_t *d=server.documents; uri!=NULL && d!=NULL; d=d->next )
+        if ( !strcmp ( d->uri, uri ) )
+            return d;
+    return NULL;
+}
+
+
+/* The last chunk starting at or before a position of the document */
+static size_t
+chunk_index ( document_t *document, size_t line, size_t character )
+{
+    size_t low = 0, high = document->n_chunks;
+    while ( high - low > 1 )
+    {
+        size_t middle = (low + high) / 2;
+        chunk_t *chunk = document->chunks[middle];
+        if ( chunk->line < line ||
+             ( chunk->line == line && chunk->column <= character ) )
+            low = middle;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+
+/* A line of a chunk, counted from 1 like node lines */
+static const char *
+chunk_line ( chunk_t *chunk, size_t line, size_t *length )
+{
+    const char *text = chunk->text, *end = chunk->text + chunk->length;
+    for ( size_t l=1; l<line && text!=NULL; l++ )
+    {
+        text = memchr ( text, '\n', end - text );
+        if ( text != NULL )
+            text += 1;
+    }
+    if ( text == NULL )
+        return NULL;
+    const char *newline = memchr ( text, '\n', end - text );
+    *length = ( newline != NULL ? newline : end ) - text;
+    return text;
+}
+
+
+static bool
+is_name ( char c )
+{
+    return isalnum ( (unsigned char)c ) || c == '_';
+}
+
+
+/* Column of the first whole word occurrence of a name in a line of a chunk,
+ * relative to the start of the line in the document
+ */
+static size_t
+name_column ( chunk_t *chunk, size_t line, const char *name )
+{
+    size_t length, name_length = strlen ( name );
+    const char *text = chunk_line ( chunk, line, &length );
+    size_t offset = ( line == 1 ) ? chunk->column : 0;
+    for ( size_t c=0; text!=NULL && c+name_length<=length; c++ )
+        if ( !memcmp ( text + c, name, name_length ) &&
+             ( c == 0 || !is_name ( text[c-1] ) ) &&
+             ( c + name_length == length || !is_name ( text[c+name_length] ) )
+        )
+            return offset + c;
+    return offset;
+}
+
+
+static node_t *
+find_identifier ( node_t *node, const char *name, size_t line )
+{
+    if ( node == NULL )
+        return NULL;
+    if ( node->type == IDENTIFIER_DATA && node->line == line &&
+         !strcmp ( node->data, name ) )
+        return node;
+    node_t *found = NULL;
+    for ( uint64_t i=0; i<node->n_children; i++ )
+    {
+        node_t *candidate = find_identifier ( node->children[i], name, line );
+        if ( candidate != NULL && ( found == NULL || found->entry == NULL ) )
+            found = candidate;
+    }
+    return found;
+}
+
+
+/* The symbol of the identifier at the position of a request */
+static symbol_t *
+symbol_at ( document_t *document, json_t *params, chunk_t **chunk )
+{
+    long line = json_number ( params, "position.line", -1 );
+    long character = json_number ( params, "position.character", -1 );
+    if ( line < 0 || character < 0 || document->n_chunks == 0 )
+        return NULL;
+    *chunk = document->chunks[chunk_index ( document, line, character )];
+    if ( (*chunk)->root == NULL )
+        return NULL;
+
+    size_t chunk_line_number = line - (*chunk)->line + 1, length;
+    const char *text = chunk_line ( *chunk, chunk_line_number, &length );
+    if ( chunk_line_number == 1 )
+        character -= (*chunk)->column;
+    if ( text == NULL || character < 0 || (size_t)character > length )
+        return NULL;
+    size_t start = character, end = character;
+    while ( start > 0 && is_name ( text[start-1] ) )
+        start -= 1;
+    while ( end < length && is_name ( text[end] ) )
+        end += 1;
+    if ( start == end )
+        return NULL;
+    char name[end - start + 1];
+    memcpy ( name, text + start, end - start );
+    name[end - start] = '\0';
+
+    node_t *node = find_identifier ( (*chunk)->root, name, chunk_line_number );
+    if ( node != NULL && node->entry != NULL )
+        return node->entry;
+    /* The name of a function or global being declared */
+    return lookup ( &(*chunk)->names, name );
+}
+
+
+static void
+describe ( buffer_t *out, document_t *document, symbol_t *symbol )
+{
+    switch ( symbol->type )
+    {
+        case SYM_FUNCTION:
+        {
+            /* The parameters are named by the declaration, as the locals
+             * only hold one of those that share a name
+             */
+            node_t *parameters = NULL;
+            for ( size_t c=0; c<document->n_chunks; c++ )
+            {
+                node_t *root = document->chunks[c]->root;
+                if ( root == NULL )
+                    continue;
+                node_t *globals = root->children[0];
+                for ( uint64_t g=0; g<globals->n_children; g++ )
+                    if ( globals->children[g]->type == FUNCTION &&
+                         globals->children[g]->children[2] == symbol->node )
+                        parameters = globals->children[g]->children[1];
+            }
+            emit ( out, "func %s (", symbol->name );
+            size_t n = ( parameters != NULL ) ? parameters->n_children : 0;
+            for ( size_t p=0; p<n; p++ )
+                emit ( out, "%s %s",
+                    p > 0 ? "," : "", (char *)parameters->children[p]->data
+                );
+            emit_string ( out, " )" );
+            break;
+        }
+        case SYM_GLOBAL_VAR:
+            emit ( out, "var %s (global variable)", symbol->name );
+            break;
+        case SYM_PARAMETER:
+            emit ( out, "%s (parameter %u)", symbol->name, symbol->seq + 1 );
+            break;
+        case SYM_LOCAL_VAR:
+            emit ( out, "var %s (local variable)", symbol->name );
+            break;
+    }
+}
+
+
+static void
+initialize ( json_t *id, json_t *params )
+{
+    (void)params;
+    buffer_t body = { 0 };
+    begin_response ( &body, id );
+    emit_string ( &body,
+        "{\"capabilities\":{\"textDocumentSync\":2,\"hoverProvider\":true,"
+        "\"definitionProvider\":true},\"serverInfo\":{\"name\":\"vslc\"}}"
+    );
+    end_response ( &body );
+}
+
+
+static void
+shutdown_server ( json_t *id, json_t *params )
+{
+    (void)params;
+    buffer_t body = { 0 };
+    begin_response ( &body, id );
+    emit_string ( &body, "null" );
+    end_response ( &body );
+    server.shutdown = true;
+}
+
+
+static void
+did_open ( json_t *id, json_t *params )
+{
+    (void)id;
+    const char *uri = json_string ( params, "textDocument.uri" );
+    json_t *text = json_get ( params, "textDocument.text" );
+    if ( uri == NULL || text == NULL || text->type != JSON_STRING )
+        return;
+    document_t *document = find_document ( params );
+    if ( document == NULL )
+    {
+        document = calloc ( 1, sizeof(document_t) );
+        document->uri = strdup ( uri );
+        document->chunks = malloc ( sizeof(chunk_t *) );
+        tlhash_init ( &document->globals, 256 );
+        tlhash_init ( &document->duplicates, 8 );
+        document->next = server.documents;
+        server.documents = document;
+    }
+    replace_region ( document, 0, document->n_chunks,
+        text->string, strlen(text->string)
+    );
+    publish_diagnostics ( document );
+}
+
+
+static void
+did_change ( json_t *id, json_t *params )
+{
+    (void)id;
+    document_t *document = find_document ( params );
+    json_t *changes = json_get ( params, "contentChanges" );
+    if ( document == NULL || changes == NULL || changes->children == NULL )
+        return;
+    /* Changes to a range, or to the whole text, in order */
+    for ( json_t *change=changes->children; change!=NULL; change=change->next )
+    {
+        const char *text = json_string ( change, "text" );
+        json_t *range = json_get ( change, "range" );
+        if ( text == NULL )
+            continue;
+        if ( range != NULL )
+            edit_document ( document, range, text );
+        else
+            replace_region ( document, 0, document->n_chunks,
+                text, strlen(text)
+            );
+    }
+    publish_diagnostics ( document );
+}
+
+
+static void
+did_close ( json_t *id, json_t *params )
+{
+    (void)id;
+    document_t *document = find_document ( params );
+    if ( document == NULL )
+        return;
+    document_t **link = &server.documents;
+    while ( *link != document )
+        link = &(*link)->next;
+    *link = document->next;
+
+    /* Clear the diagnostics of the closed document */
+    for ( size_t c=0; c<document->n_chunks; c++ )
+        free_chunk ( document->chunks[c] );
+    document->n_chunks = 0;
+    publish_diagnostics ( document );
+    free_document ( document );
+}
+
+
+static void
+hover ( json_t *id, json_t *params )
+{
+    document_t *document = find_document ( params );
+    chunk_t *chunk;
+    symbol_t *symbol = ( document != NULL )
+        ? symbol_at ( document, params, &chunk )
+        : NULL;
+    buffer_t body = { 0 };
+    begin_response ( &body, id );
+    if ( symbol != NULL )
+    {
+        buffer_t text = { 0 };
+        describe ( &text, document, symbol );
+        emit_bytes ( &text, "", 1 );
+        emit_string ( &body, "{\"contents\":{\"kind\":\"plaintext\",\"value\":" );
+        json_write_string ( &body, text.data );
+        emit_string ( &body, "}}" );
+        buffer_free ( &text );
+    }
+    else
+        emit_string ( &body, "null" );
+    end_response ( &body );
+}
+
+
+static void
+definition ( json_t *id, json_t *params )
+{
+    document_t *document = find_document ( params );
+    chunk_t *chunk = NULL;
+    symbol_t *symbol = ( document != NULL )
+        ? symbol_at ( document, params, &chunk )
+        : NULL;
+    /* Globals are declared in the chunk whose names hold them */
+    if ( symbol != NULL &&
+         ( symbol->type == SYM_FUNCTION || symbol->type == SYM_GLOBAL_VAR ) )
+    {
+        chunk = NULL;
+        for ( size_t c=0; c<document->n_chunks && chunk==NULL; c++ )
+            if ( lookup ( &document->chunks[c]->names, symbol->name ) == symbol )
+                chunk = document->chunks[c];
+    }
+
+    buffer_t body = { 0 };
+    begin_response ( &body, id );
+    if ( symbol != NULL && chunk != NULL && symbol->line > 0 )
+    {
+        size_t line = chunk->line + symbol->line - 1;
+        size_t column = name_column ( chunk, symbol->line, symbol->name );
+        emit_string ( &body, "{\"uri\":" );
+        json_write_string ( &body, document->uri );
+        emit ( &body,
+            ",\"range\":{\"start\":{\"line\":%u,\"character\":%u},"
+            "\"end\":{\"line\":%u,\"character\":%u}}}",
+            line, column, line, column + strlen(symbol->name)
+        );
+    }
+    else
+        emit_string ( &body, "null" );
+    end_response ( &body );
+}
+
+
+static const struct {
+    const char *method;
+    void (*handler) ( json_t *id, json_t *params );
+} handlers[] = {
+    { "initialize", initialize },
+    { "shutdown", shutdown_server },
+    { "textDocument/didOpen", did_open },
+    { "textDocument/didChange", did_change },
+    { "textDocument/didClose", did_close },
+    { "textDocument/hover", hover },
+    { "textDocument/definition", definition },
+};
+
+
+static void
+handle ( const char *method, json_t *id, json_t *params )
+{
+    for ( size_t h=0; h<sizeof(handlers)/sizeof(handlers[0]); h++ )
+        if ( !strcmp ( method, handlers[h].method ) )
+        {
+            handlers[h].handler ( id, params );
+            return;
+        }
+    /* Notifications we do not handle are ignored, requests are refused */
+    if ( id == NULL )
+        return;
+    buffer_t body = { 0 };
+    emit_string ( &body, "{\"jsonrpc\":\"2.0\",\"id\":" );
+    json_write_id ( &body, id );
+    emit_string ( &body,
+        ",\"error\":{\"code\":-32601,\"message\":\"Method not found\"}}"
+    );
+    send_message ( &body );
+    buffer_free ( &body );
+}
+
+/* Incremental analysis */
+
+
+static bool
+same_text ( chunk_t *chunk, const char *text, size_t length )
+{
+    return chunk->length == length && !memcmp ( chunk->text, text, length );
+}
+
+
+/* Replace the chunks from first up to last by the chunks of a text that
+ * starts where the first of them did, and reanalyse what changed
+ */
+static void
+replace_region (
+    document_t *document, size_t first, size_t last,
+    const char *text, size_t length
+)
+{
+    size_t line = 0, column = 0, next_line = 0, next_column = 0;
+    if ( first < document->n_chunks )
+    {
+        line = document->chunks[first]->line;
+        column = document->chunks[first]->column;
+    }
+    if ( last < document->n_chunks )
+    {
+        next_line = document->chunks[last]->line;
+        next_column = document->chunks[last]->column;
+    }
+
+    size_t *starts;
+    size_t n_new = split_document ( text, length, &starts );
+    size_t *lengths = malloc ( (n_new + 1) * sizeof(size_t) );
+    size_t *lines = malloc ( (n_new + 1) * sizeof(size_t) );
+    size_t *columns = malloc ( (n_new + 1) * sizeof(size_t) );
+    size_t position = 0;
+    for ( size_t c=0; c<=n_new; c++ )
+    {
+        size_t end = ( c < n_new ) ? starts[c] : length;
+        for ( ; position < end; position++, column++ )
+            if ( text[position] == '\n' )
+            {
+                line += 1;
+                column = (size_t)-1;
+            }
+        lines[c] = line;
+        columns[c] = column;
+        if ( c < n_new )
+            lengths[c] = ( (c + 1 < n_new) ? starts[c+1] : length ) - starts[c];
+    }
+
+    /* Chunks with the same text at either end of the region are kept */
+    chunk_t **old = document->chunks + first;
+    size_t n_old = last - first, prefix = 0, suffix = 0;
+    while ( prefix < n_old && prefix < n_new &&
+            same_text ( old[prefix], text + starts[prefix], lengths[prefix] ) )
+        prefix += 1;
+    while ( suffix < n_old - prefix && suffix < n_new - prefix &&
+            same_text ( old[n_old-1-suffix],
+                text + starts[n_new-1-suffix], lengths[n_new-1-suffix] ) )
+        suffix += 1;
+    size_t n_fresh = n_new - prefix - suffix;
+    size_t n_removed = n_old - prefix - suffix;
+    chunk_t **removed = malloc ( (n_removed + 1) * sizeof(chunk_t *) );
+    memcpy ( removed, old + prefix, n_removed * sizeof(chunk_t *) );
+
+    size_t n_after = document->n_chunks - last;
+    size_t n_chunks = first + n_new + n_after;
+    chunk_t **chunks = malloc ( (n_chunks + 1) * sizeof(chunk_t *) );
+    memcpy ( chunks, document->chunks, (first + prefix) * sizeof(chunk_t *) );
+    memcpy ( chunks + first + n_new - suffix, old + n_old - suffix,
+        (suffix + n_after) * sizeof(chunk_t *)
+    );
+    for ( size_t c=prefix; c<prefix+n_fresh; c++ )
+        chunks[first+c] = parse_chunk ( text + starts[c], lengths[c] );
+    for ( size_t c=0; c<n_new; c++ )
+    {
+        chunks[first+c]->line = lines[c];
+        chunks[first+c]->column = columns[c];
+    }
+    /* The chunks after the region move with its end */
+    for ( size_t c=first+n_new; c<n_chunks; c++ )
+    {
+        if ( chunks[c]->line == next_line )
+            chunks[c]->column += columns[n_new] - next_column;
+        chunks[c]->line += lines[n_new] - next_line;
+    }
+    free ( document->chunks );
+    document->chunks = chunks;
+    document->n_chunks = n_chunks;
+
+    tlhash_t changed;
+    tlhash_init ( &changed, 16 );
+    replace_chunks ( document, chunks + first + prefix, n_fresh,
+        removed, n_removed, &changed
+    );
+
+    /* Other chunks that mention a changed global may refer to a symbol
+     * that is gone, or miss one that appeared
+     */
+    size_t n_stale = 0;
+    chunk_t **stale = malloc ( (n_chunks + 1) * sizeof(chunk_t *) );
+    chunk_t **reparsed = malloc ( (n_chunks + 1) * sizeof(chunk_t *) );
+    size_t n_changed = tlhash_size ( &changed );
+    char *changed_names[n_changed + 1];
+    tlhash_keys ( &changed, (void **)&changed_names );
+    for ( size_t c=0; c<n_chunks && n_changed>0; c++ )
+    {
+        if ( c >= first + prefix && c < first + prefix + n_fresh )
+            continue;
+        bool refers = false;
+        for ( size_t n=0; n<n_changed && !refers; n++ )
+            refers = marked ( &chunks[c]->references, changed_names[n] );
+        if ( !refers )
+            continue;
+        stale[n_stale] = chunks[c];
+        chunks[c] = parse_chunk ( chunks[c]->text, chunks[c]->length );
+        chunks[c]->line = stale[n_stale]->line;
+        chunks[c]->column = stale[n_stale]->column;
+        reparsed[n_stale++] = chunks[c];
+    }
+    /* Their declarations are unchanged, so they take over the old symbols */
+    replace_chunks ( document, reparsed, n_stale, stale, n_stale, &changed );
+
+    for ( size_t c=first+prefix; c<first+prefix+n_fresh; c++ )
+        bind_chunk ( document, chunks[c] );
+    for ( size_t s=0; s<n_stale; s++ )
+        bind_chunk ( document, reparsed[s] );
+
+    tlhash_finalize ( &changed );
+    free ( stale );
+    free ( reparsed );
+    free ( removed );
+    free ( starts );
+    free ( lengths );
+    free ( lines );
+    free ( columns );
+}
+
+
+/* Where a position falls, as a chunk and an offset into its text */
+static bool
+locate (
+    document_t *document, json_t *position, size_t *index, size_t *offset
+)
+{
+    long line = json_number ( position, "line", -1 );
+    long character = json_number ( position, "character", -1 );
+    if ( line < 0 || character < 0 || document->n_chunks == 0 )
+        return false;
+    size_t low = chunk_index ( document, line, character );
+    chunk_t *chunk = document->chunks[low];
+    const char *text = chunk->text, *end = chunk->text + chunk->length;
+    size_t skip = character
+        - ( chunk->line == (size_t)line ? chunk->column : 0 );
+    for ( size_t l=chunk->line; l<(size_t)line && text<end; l++ )
+    {
+        const char *newline = memchr ( text, '\n', end - text );
+        text = ( newline != NULL ) ? newline + 1 : end;
+    }
+    for ( ; skip > 0 && text < end && *text != '\n'; skip-- )
+        text += 1;
+    *index = low;
+    *offset = text - chunk->text;
+    return true;
+}
+
+
+/* Apply a change to a range of the document. The region split again
+ * starts a chunk before the ones the change touches, which it may join,
+ * and runs on until the chunk after it still starts one.
+ */
+static void
+edit_document ( document_t *document, json_t *range, const char *text )
+{
+    size_t first, first_offset, last, last_offset;
+    if ( !locate ( document, json_get ( range, "start" ), &first, &first_offset )
+      || !locate ( document, json_get ( range, "end" ), &last, &last_offset )
+      || last < first || ( last == first && last_offset < first_offset ) )
+    {
+        if ( document->n_chunks == 0 )
+            replace_region ( document, 0, 0, text, strlen(text) );
+        return;
+    }
+    size_t from = ( first > 0 ) ? first - 1 : 0, to = last + 1;
+
+    buffer_t region = { 0 };
+    for ( size_t c=from; c<first; c++ )
+        emit_bytes ( &region,
+            document->chunks[c]->text, document->chunks[c]->length
+        );
+    emit_bytes ( &region, document->chunks[first]->text, first_offset );
+    emit_string ( &region, text );
+    emit_bytes ( &region, document->chunks[last]->text + last_offset,
+        document->chunks[last]->length - last_offset
+    );
+    size_t region_length;
+    for ( ;; )
+    {
+        region_length = region.length;
+        if ( to == document->n_chunks )
+            break;
+        chunk_t *next = document->chunks[to];
+        emit_bytes ( &region, next->text, next->length );
+        size_t *starts;
+        size_t n_starts = split_document ( region.data, region.length, &starts );
+        bool still_starts = false;
+        for ( size_t c=0; c<n_starts && !still_starts; c++ )
+            still_starts = starts[c] == region_length;
+        free ( starts );
+        if ( still_starts )
+            break;
+        to += 1;
+    }
+    replace_region ( document, from, to, region.data, region_length );
+    buffer_free ( &region );
+}
+
+
+/* Enter the declarations of fresh chunks into the global table, and drop
+ * those of the removed chunks they replace. Names whose visible symbol
+ * changed are marked.
+ */
+static void
+replace_chunks (
+    document_t *document, chunk_t **fresh, size_t n_fresh,
+    chunk_t **removed, size_t n_removed, tlhash_t *changed
+)
+{
+    tlhash_t *globals = &document->globals;
+    for ( size_t f=0; f<n_fresh; f++ )
+    {
+        size_t n_names = tlhash_size ( &fresh[f]->names );
+        symbol_t *names[n_names + 1];
+        tlhash_values ( &fresh[f]->names, (void **)&names );
+        for ( size_t i=0; i<n_names; i++ )
+        {
+            symbol_t *symbol = names[i];
+            char *name = symbol->name;
+            symbol_t *visible = lookup ( globals, name );
+            chunk_t *owner = NULL;
+            for ( size_t r=0; r<n_removed && visible!=NULL; r++ )
+                if ( lookup ( &removed[r]->names, name ) == visible )
+                    owner = removed[r];
+
+            if ( visible == NULL )
+            {
+                tlhash_insert ( globals, name, strlen(name), symbol );
+                mark ( changed, name );
+            }
+            else if ( owner != NULL && visible->type == symbol->type &&
+                      visible->nparms == symbol->nparms )
+            {
+                /* Same signature: users of the old symbol stay bound to it */
+                symbol_t swap = *visible;
+                *visible = *symbol;
+                *symbol = swap;
+                tlhash_remove ( &fresh[f]->names, name, strlen(name) );
+                tlhash_insert ( &fresh[f]->names, name, strlen(name), visible );
+                tlhash_remove ( &owner->names, name, strlen(name) );
+                tlhash_insert ( &owner->names, name, strlen(name), symbol );
+            }
+            else if ( owner != NULL )
+            {
+                tlhash_remove ( globals, name, strlen(name) );
+                tlhash_insert ( globals, name, strlen(name), symbol );
+                mark ( changed, name );
+            }
+            else // Declared twice, the first one stays visible
+                mark ( &document->duplicates, name );
+        }
+    }
+
+    for ( size_t r=0; r<n_removed; r++ )
+    {
+        size_t n_names = tlhash_size ( &removed[r]->names );
+        symbol_t *names[n_names + 1];
+        tlhash_values ( &removed[r]->names, (void **)&names );
+        for ( size_t i=0; i<n_names; i++ )
+        {
+            char *name = names[i]->name;
+            if ( lookup ( globals, name ) != names[i] )
+                continue;
+            tlhash_remove ( globals, name, strlen(name) );
+            mark ( changed, name );
+            /* Another declaration of the name becomes visible */
+            for ( size_t c=0; c<document->n_chunks; c++ )
+            {
+                symbol_t *other = lookup ( &document->chunks[c]->names, name );
+                if ( other != NULL )
+                {
+                    tlhash_insert ( globals, name, strlen(name), other );
+                    break;
+                }
+            }
+        }
+        free_chunk ( removed[r] );
+    }
+}
+
+
+/* Offsets where chunks start: at every function, and at every declaration
+ * outside of a block. Whatever comes before the first one belongs to the
+ * first chunk.
+ */
+static size_t
+split_document ( const char *text, size_t length, size_t **starts )
+{
+    size_t n_starts = 0, capacity = 64, depth = 0, i = 0;
+    bool seen = false;
+    *starts = malloc ( capacity * sizeof(size_t) );
+    if ( length > 0 )
+        (*starts)[n_starts++] = 0;
+    while ( i < length )
+    {
+        if ( text[i] == '/' && i + 1 < length && text[i+1] == '/' )
+        {
+            while ( i < length && text[i] != '\n' )
+                i += 1;
+        }
+        else if ( text[i] == '"' )
+        {
+            for ( i += 1; i < length && text[i] != '"' && text[i] != '\n';
+                  i += 1 )
+                if ( text[i] == '\\' && i + 1 < length )
+                    i += 1;
+            i += 1;
+        }
+        else if ( isalpha ( (unsigned char)text[i] ) || text[i] == '_' )
+        {
+            size_t start = i;
+            while ( i < length && is_name ( text[i] ) )
+                i += 1;
+            size_t word = i - start;
+            bool function = word == 4 && !memcmp ( text + start, "func", 4 );
+            bool variable = word == 3 && !memcmp ( text + start, "var", 3 );
+            if ( word == 5 && !memcmp ( text + start, "begin", 5 ) )
+                depth += 1;
+            else if ( word == 3 && !memcmp ( text + start, "end", 3 ) &&
+                      depth > 0 )
+                depth -= 1;
+            /* Functions do not nest, so one starts even after an open block */
+            if ( function )
+                depth = 0;
+            if ( !function && !( variable && depth == 0 ) )
+                continue;
+            if ( seen )
+            {
+                if ( n_starts == capacity )
+                {
+                    capacity *= 2;
+                    *starts = realloc ( *starts, capacity * sizeof(size_t) );
+                }
+                (*starts)[n_starts++] = start;
+            }
+            seen = true;
+        }
+        else
+            i += 1;
+    }
+    return n_starts;
+}
+
+
+static chunk_t *
+parse_chunk ( const char *text, size_t length )
+{
+    vslc_context_t *ctx = server.ctx;
+    chunk_t *chunk = calloc ( 1, sizeof(chunk_t) );
+    chunk->text = malloc ( length + 1 );
+    memcpy ( chunk->text, text, length );
+    chunk->text[length] = '\0';
+    chunk->length = length;
+    tlhash_init ( &chunk->names, 8 );
+    tlhash_init ( &chunk->references, 32 );
+
+    /* The compiler reports errors on a stream */
+    char *messages;
+    size_t messages_length;
+    ctx->diag = open_memstream ( &messages, &messages_length );
+    ctx->root = NULL;
+    ctx->error_line = 0;
+    FILE *in = fmemopen ( chunk->text, length, "r" );
+    yylex_init ( &ctx->scanner );
+    yyset_in ( in, ctx->scanner );
+    if ( setjmp ( ctx->error_exit ) == 0 )
+    {
+        if ( yyparse ( ctx->scanner, ctx ) == 0 )
+        {
+            simplify_syntax_tree ( ctx );
+            chunk->root = ctx->root;
+            ctx->root = NULL;
+            declare_globals ( &chunk->names, chunk->root->children[0] );
+        }
+    }
+    destroy_syntax_tree ( ctx );
+    yylex_destroy ( ctx->scanner );
+    ctx->scanner = NULL;
+    fclose ( in );
+    fclose ( ctx->diag );
+    ctx->diag = NULL;
+
+    if ( chunk->root == NULL )
+    {
+        /* The line is given by the position of the diagnostic instead */
+        char *suffix = strstr ( messages, " on line " );
+        if ( suffix != NULL )
+            *suffix = '\0';
+        add_diagnostic ( chunk, ctx->error_line,
+            messages[0] != '\0' ? messages : "syntax error"
+        );
+    }
+    free ( messages );
+    return chunk;
+}
+
+
+static void
+bind_chunk ( document_t *document, chunk_t *chunk )
+{
+    if ( chunk->root == NULL )
+        return;
+    vslc_context_t *ctx = server.ctx;
+    size_t n_names = tlhash_size ( &chunk->names );
+    symbol_t *names[n_names + 1];
+    tlhash_values ( &chunk->names, (void **)&names );
+
+    ctx->global_names = &document->globals;
+    for ( size_t i=0; i<n_names; i++ )
+    {
+        if ( names[i]->type != SYM_FUNCTION )
+            continue;
+        char *message;
+        size_t length;
+        ctx->diag = open_memstream ( &message, &length );
+        ctx->error_line = 0;
+        bool failed = false;
+        if ( setjmp ( ctx->error_exit ) == 0 )
+            bind_function ( ctx, names[i] ); // In ir.c
+        else
+            failed = true;
+        fclose ( ctx->diag );
+        if ( failed )
+        {
+            message[strcspn ( message, "\n" )] = '\0';
+            add_diagnostic ( chunk, ctx->error_line, message );
+        }
+        free ( message );
+    }
+    ctx->diag = NULL;
+    ctx->global_names = NULL;
+    /* String texts are not needed once the tree is bound */
+    release_strings ( ctx );
+    collect_references ( chunk, chunk->root );
+}
+
+
+/* Note every name used in a chunk, and check the calls it makes */
+static void
+collect_references ( chunk_t *chunk, node_t *node )
+{
+    if ( node == NULL )
+        return;
+    if ( node->type == IDENTIFIER_DATA )
+        mark ( &chunk->references, node->data );
+    if ( node->type == EXPRESSION && node->data == NULL &&
+         node->n_children == 2 && node->children[0]->entry != NULL &&
+         node->children[0]->entry->type == SYM_FUNCTION )
+    {
+        symbol_t *function = node->children[0]->entry;
+        size_t n_arguments = 0;
+        if ( node->children[1] != NULL )
+            n_arguments = node->children[1]->n_children;
+        if ( n_arguments != function->nparms )
+        {
+            buffer_t message = { 0 };
+            emit ( &message,
+                "Function %s has %u parameters, called with %u arguments",
+                function->name, function->nparms, n_arguments
+            );
+            emit_bytes ( &message, "", 1 );
+            add_diagnostic ( chunk, node->children[0]->line, message.data );
+            buffer_free ( &message );
+        }
+    }
+    for ( uint64_t i=0; i<node->n_children; i++ )
+        collect_references ( chunk, node->children[i] );
+}
+
+
+static void
+add_diagnostic ( chunk_t *chunk, size_t line, const char *message )
+{
+    chunk->diagnostics = realloc ( chunk->diagnostics,
+        (chunk->n_diagnostics + 1) * sizeof(diagnostic_t)
+    );
+    chunk->diagnostics[chunk->n_diagnostics++] = (diagnostic_t) {
+        .line = line,
+        .message = strdup ( message )
+    };
+}
+
+
+static void
+free_chunk ( chunk_t *chunk )
+{
+    destroy_globals ( &chunk->names ); // In ir.c
+    tlhash_finalize ( &chunk->references );
+    destroy_subtree ( server.ctx, chunk->root );
+    for ( size_t d=0; d<chunk->n_diagnostics; d++ )
+        free ( chunk->diagnostics[d].message );
+    free ( chunk->diagnostics );
+    free ( chunk->text );
+    free ( chunk );
+}
+
+
+static void
+free_document ( document_t *document )
+{
+    for ( size_t c=0; c<document->n_chunks; c++ )
+        free_chunk ( document->chunks[c] );
+    tlhash_finalize ( &document->globals );
+    tlhash_finalize ( &document->duplicates );
+    free ( document->chunks );
+    free ( document->uri );
+    free ( document );
+}
+
+
+static void
+write_diagnostic (
+    buffer_t *out, chunk_t *chunk, size_t line, const char *message,
+    bool *first
+)
+{
+    line = chunk->line + ( line > 0 ? line - 1 : 0 );
+    emit ( out,
+        "%s{\"range\":{\"start\":{\"line\":%u,\"character\":0},"
+        "\"end\":{\"line\":%u,\"character\":0}},\"severity\":1,"
+        "\"source\":\"vslc\",\"message\":",
+        *first ? "" : ",", line, line + 1
+    );
+    json_write_string ( out, message );
+    emit_string ( out, "}" );
+    *first = false;
+}
+
+
+static void
+publish_diagnostics ( document_t *document )
+{
+    buffer_t body = { 0 };
+    emit_string ( &body,
+        "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+        "\"params\":{\"uri\":"
+    );
+    json_write_string ( &body, document->uri );
+    emit_string ( &body, ",\"diagnostics\":[" );
+    bool first = true, duplicates = tlhash_size ( &document->duplicates ) > 0;
+    bool seen = false;
+    buffer_t message = { 0 };
+    for ( size_t c=0; c<document->n_chunks; c++ )
+    {
+        chunk_t *chunk = document->chunks[c];
+        for ( size_t d=0; d<chunk->n_diagnostics; d++ )
+            write_diagnostic ( &body, chunk,
+                chunk->diagnostics[d].line, chunk->diagnostics[d].message,
+                &first
+            );
+        if ( !duplicates )
+            continue;
+
+        size_t n_names = tlhash_size ( &chunk->names );
+        symbol_t *names[n_names + 1];
+        tlhash_values ( &chunk->names, (void **)&names );
+        for ( size_t i=0; i<n_names; i++ )
+        {
+            if ( lookup ( &document->globals, names[i]->name ) == names[i] )
+                continue;
+            message.length = 0;
+            emit ( &message, "'%s' is already declared", names[i]->name );
+            emit_bytes ( &message, "", 1 );
+            write_diagnostic ( &body, chunk,
+                names[i]->line, message.data, &first
+            );
+            seen = true;
+        }
+    }
+    buffer_free ( &message );
+    /* Until a name is declared twice again, the names need no scan */
+    if ( duplicates && !seen )
+    {
+        tlhash_finalize ( &document->duplicates );
+        tlhash_init ( &document->duplicates, 8 );
+    }
+    emit_string ( &body, "]}}" );
+    send_message ( &body );
+    buffer_free ( &body );
+}
+
+
+static symbol_t *
+lookup ( tlhash_t *table, const char *name )
+{
+    symbol_t *symbol = NULL;
+    tlhash_lookup ( table, (void *)name, strlen(name), (void **)&symbol );
+    return symbol;
+}
+
+
+/* Sets of names are keyed with the terminator, so their keys are strings */
+static void
+mark ( tlhash_t *set, const char *name )
+{
+    tlhash_insert ( set, (void *)name, strlen(name) + 1, set );
+}
+
+
+static bool
+marked ( tlhash_t *set, const char *name )
+{
+    void *value;
+    return tlhash_lookup ( set, (void *)name, strlen(name) + 1, &value )
+        == TLHASH_SUCCESS;
+}
+
+/* Base protocol: a Content-Length header, an empty line, and the body.
+ * A body that is too long, or that does not fit in memory, is skipped,
+ * and dropped is set instead of returning it.
+ */
+
+
+static char *
+read_message ( FILE *in, size_t *length, bool *dropped )
+{
+    *dropped = false;
+    char *line = NULL;
+    size_t capacity = 0;
+    bool has_length = false;
+    ssize_t n;
+    while ( (n = getline ( &line, &capacity, in )) > 0 )
+    {
+        if ( !strcmp ( line, "\r\n" ) || !strcmp ( line, "\n" ) )
+        {
+            if ( has_length )
+                break;
+            continue;
+        }
+        if ( sscanf ( line, "Content-Length: %zu", length ) == 1 )
+            has_length = true;
+    }
+    free ( line );
+    if ( n <= 0 )
+        return NULL;
+    char *body = NULL;
+    if ( *length <= MAX_MESSAGE_LENGTH )
+        body = malloc ( *length + 1 );
+    if ( body == NULL )
+    {
+        // The next header starts after the body, or the stream ends first
+        for ( size_t i = 0; i < *length && getc ( in ) != EOF; i++ )
+            ;
+        *dropped = true;
+        return NULL;
+    }
+    if ( fread ( body, 1, *length, in ) != *length )
+    {
+        free ( body );
+        return NULL;
+    }
+    body[*length] = '\0';
+    return body;
+}
+
+
+static void
+send_message ( buffer_t *body )
+{
+    fprintf ( server.out, "Content-Length: %zu\r\n\r\n", body->length );
+    emit_flush ( body, server.out ); // In emit.c
+    fflush ( server.out );
+}
+
+
+static void
+begin_response ( buffer_t *body, json_t *id )
+{
+    emit_string ( body, "{\"jsonrpc\":\"2.0\",\"id\":" );
+    json_write_id ( body, id );
+    emit_string ( body, ",\"result\":" );
+}
+
+
+static void
+end_response ( buffer_t *body )
+{
+    emit_string ( body, "}" );
+    send_message ( body );
+    buffer_free ( body );
+}
+
+/* Just enough JSON for the protocol */
+
+
+static json_t *
+json_parse ( const char *text, size_t length )
+{
+    json_parser_t p = { .text = text, .position = 0, .length = length };
+    return json_parse_value ( &p );
+}
+
+
+static void
+json_skip_space ( json_parser_t *p )
+{
+    while ( p->position < p->length &&
+            isspace ( (unsigned char)p->text[p->position] ) )
+        p->position += 1;
+}
+
+
+static bool
+json_literal ( json_parser_t *p, const char *literal )
+{
+    size_t length = strlen ( literal );
+    if ( p->position + length > p->length ||
+         memcmp ( p->text + p->position, literal, length ) )
+        return false;
+    p->position += length;
+    return true;
+}
+
+
+static json_t *
+json_parse_value ( json_parser_t *p )
+{
+    json_skip_space ( p );
+    if ( p->position >= p->length )
+        return NULL;
+    json_t *value = calloc ( 1, sizeof(json_t) );
+    char c = p->text[p->position];
+    if ( c == '{' || c == '[' )
+    {
+        char close = ( c == '{' ) ? '}' : ']';
+        value->type = ( c == '{' ) ? JSON_OBJECT : JSON_ARRAY;
+        json_t **tail = &value->children;
+        p->position += 1;
+        json_skip_space ( p );
+        if ( p->position < p->length && p->text[p->position] == close )
+        {
+            p->position += 1;
+            return value;
+        }
+        for ( ;; )
+        {
+            char *key = NULL;
+            if ( value->type == JSON_OBJECT )
+            {
+                json_skip_space ( p );
+                if ( p->position >= p->length || p->text[p->position] != '"'
+                  || (key = json_parse_string ( p )) == NULL )
+                    goto fail;
+                json_skip_space ( p );
+                if ( p->position >= p->length || p->text[p->position] != ':' )
+                {
+                    free ( key );
+                    goto fail;
+                }
+                p->position += 1;
+            }
+            json_t *element = json_parse_value ( p );
+            if ( element == NULL )
+            {
+                free ( key );
+                goto fail;
+            }
+            element->key = key;
+            *tail = element;
+            tail = &element->next;
+            json_skip_space ( p );
+            if ( p->position >= p->length )
+                goto fail;
+            c = p->text[p->position++];
+            if ( c == close )
+                return value;
+            if ( c != ',' )
+                goto fail;
+        }
+    }
+    else if ( c == '"' )
+    {
+        value->type = JSON_STRING;
+        if ( (value->string = json_parse_string ( p )) == NULL )
+            goto fail;
+    }
+    else if ( json_literal ( p, "true" ) || json_literal ( p, "false" ) )
+    {
+        value->type = JSON_BOOL;
+        value->boolean = ( c == 't' );
+    }
+    else if ( json_literal ( p, "null" ) )
+        value->type = JSON_NULL;
+    else
+    {
+        /* Messages are terminated, so strtod stops inside the buffer */
+        char *end;
+        value->type = JSON_NUMBER;
+        value->number = strtod ( p->text + p->position, &end );
+        if ( end == p->text + p->position )
+            goto fail;
+        p->position = end - p->text;
+    }
+    return value;
+fail:
+    json_free ( value );
+    return NULL;
+}
+
+
+static unsigned
+json_parse_hex ( json_parser_t *p )
+{
+    unsigned code = 0;
+    for ( int i=0; i<4 && p->position<p->length; i++ )
+    {
+        char c = p->text[p->position++];
+        code = code * 16 + ( isdigit ( (unsigned char)c )
+            ? c - '0'
+            : tolower ( (unsigned char)c ) - 'a' + 10 );
+    }
+    return code;
+}
+
+
+/* The text of a string, with its escapes replaced by the UTF-8 bytes of
+ * the characters they stand for
+ */
+static char *
+json_parse_string ( json_parser_t *p )
+{
+    buffer_t string = { 0 };
+    p->position += 1;
+    while ( p->position < p->length && p->text[p->position] != '"' )
+    {
+        char c = p->text[p->position++];
+        if ( c != '\\' || p->position >= p->length )
+        {
+            emit_bytes ( &string, &c, 1 );
+            continue;
+        }
+        c = p->text[p->position++];
+        unsigned code;
+        char utf8[4];
+        switch ( c )
+        {
+            case 'b': emit_bytes ( &string, "\b", 1 ); break;
+            case 'f': emit_bytes ( &string, "\f", 1 ); break;
+            case 'n': emit_bytes ( &string, "\n", 1 ); break;
+            case 'r': emit_bytes ( &string, "\r", 1 ); break;
+            case 't': emit_bytes ( &string, "\t", 1 ); break;
+            case 'u':
+                code = json_parse_hex ( p );
+                /* Surrogate pairs encode one code point */
+                if ( code >= 0xD800 && code < 0xDC00 &&
+                     p->position + 6 <= p->length &&
+                     p->text[p->position] == '\\' &&
+                     p->text[p->position+1] == 'u' )
+                {
+                    p->position += 2;
+                    code = 0x10000 + ((code - 0xD800) << 10)
+                        + (json_parse_hex ( p ) - 0xDC00);
+                }
+                if ( code < 0x80 )
+                {
+                    utf8[0] = code;
+                    emit_bytes ( &string, utf8, 1 );
+                }
+                else if ( code < 0x800 )
+                {
+                    utf8[0] = 0xC0 | code >> 6;
+                    utf8[1] = 0x80 | (code & 0x3F);
+                    emit_bytes ( &string, utf8, 2 );
+                }
+                else if ( code < 0x10000 )
+                {
+                    utf8[0] = 0xE0 | code >> 12;
+                    utf8[1] = 0x80 | (code >> 6 & 0x3F);
+                    utf8[2] = 0x80 | (code & 0x3F);
+                    emit_bytes ( &string, utf8, 3 );
+                }
+                else
+                {
+                    utf8[0] = 0xF0 | code >> 18;
+                    utf8[1] = 0x80 | (code >> 12 & 0x3F);
+                    utf8[2] = 0x80 | (code >> 6 & 0x3F);
+                    utf8[3] = 0x80 | (code & 0x3F);
+                    emit_bytes ( &string, utf8, 4 );
+                }
+                break;
+            default:
+                emit_bytes ( &string, &c, 1 );
+                break;
+        }
+    }
+    if ( p->position >= p->length )
+    {
+        buffer_free ( &string );
+        return NULL;
+    }
+    p->position += 1;
+    emit_bytes ( &string, "", 1 );
+    return string.data;
+}
+
+
+static void
+json_free ( json_t *value )
+{
+    while ( value != NULL )
+    {
+        json_t *next = value->next;
+        json_free ( value->children );
+        free ( value->key );
+        free ( value->string );
+        free ( value );
+        value = next;
+    }
+}
+
+
+/* Member of nested objects, by names separated with dots */
+static json_t *
+json_get ( json_t *value, const char *path )
+{
+    while ( value != NULL && *path != '\0' )
+    {
+        size_t length = strcspn ( path, "." );
+        json_t *member = NULL;
+        if ( value->type == JSON_OBJECT )
+            for ( member=value->children; member!=NULL; member=member->next )
+                if ( strlen(member->key) == length &&
+                     !memcmp ( member->key, path, length ) )
+                    break;
+        value = member;
+        path += length;
+        if ( *path == '.' )
+            path += 1;
+    }
+    return value;
+}
+
+
+static const char *
+json_string ( json_t *value, const char *path )
+{
+    value = json_get ( value, path );
+    return ( value != NULL && value->type == JSON_STRING )
+        ? value->string
+        : NULL;
+}
+
+
+static long
+json_number ( json_t *value, const char *path, long fallback )
+{
+    value = json_get ( value, path );
+    return ( value != NULL && value->type == JSON_NUMBER )
+        ? (long)value->number
+        : fallback;
+}
+
+
+static void
+json_write_string ( buffer_t *out, const char *string )
+{
+    static const char hex[] = "0123456789abcdef";
+    emit_string ( out, "\"" );
+    const char *plain = string;
+    for ( const char *c=string; *c!='\0'; c++ )
+    {
+        unsigned char byte = *c;
+        if ( byte >= 0x20 && byte != '"' && byte != '\\' )
+            continue;
+        /* Runs of plain characters are copied at once */
+        emit_bytes ( out, plain, c - plain );
+        plain = c + 1;
+        if ( byte == '"' || byte == '\\' )
+        {
+            char escape[2] = { '\\', byte };
+            emit_bytes ( out, escape, 2 );
+        }
+        else if ( byte == '\n' )
+            emit_string ( out, "\\n" );
+        else
+        {
+            char escape[6] = { '\\', 'u', '0', '0', hex[byte>>4], hex[byte&15] };
+            emit_bytes ( out, escape, 6 );
+        }
+    }
+    emit_string ( out, plain );
+    emit_string ( out, "\"" );
+}
+
+
+/* Request ids are strings or integers */
+static void
+json_write_id ( buffer_t *out, json_t *id )
+{
+    if ( id != NULL && id->type == JSON_STRING )
+        json_write_string ( out, id->string );
+    else if ( id != NULL && id->type == JSON_NUMBER )
+        emit ( out, "%d", (int64_t)id->number );
+    else
+        emit_string ( out, "null" );
+}
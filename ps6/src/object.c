@@ -0,0 +1,1250 @@
+#include <ctype.h>
+#include <elf.h>
+#include <errno.h>
+#include <vslc.h>
+
+/* Assembles the program emitted by the generator into a relocatable ELF64
+ * object, so it links without a run of the system assembler. Only the
+ * instructions and directives the generator emits are understood, and they
+ * are encoded as the GNU assembler encodes them, so objects from either
+ * path disassemble alike.
+ */
+
+enum { TEXT, DATA, BSS, RODATA, N_SECTIONS };
+static const char *section_names[N_SECTIONS] = {".text", ".data", ".bss",
+                                                ".rodata"};
+
+#define UNDEFINED (-1)
+
+/* A name in the program, defined in one of the sections or left for the
+ * linker to find in another object
+ */
+typedef struct {
+    char *name;
+    int section;   // Or UNDEFINED
+    uint64_t value; // Offset in the section, once laid out
+    bool global;
+    size_t index;  // In the symbol table
+} label_t;
+
+/* Instructions and directives are items, laid out in order within their
+ * sections. Jumps are kept apart from other instructions, as their length
+ * depends on how far they reach, and so is padding to an alignment, which
+ * depends on where it is.
+ */
+typedef enum { BYTES, LABEL, JUMP, ALIGN } item_kind_t;
+
+/* Opcodes of jumps, after the condition codes of conditional jumps */
+enum { JMP = 16, CALL, LOOP };
+
+typedef struct {
+    item_kind_t kind;
+    int section;
+    uint64_t offset;      // In the section, once laid out
+    size_t start, length; // Encoded bytes in the pool
+    label_t *label;       // Defined here, referred to, or jumped to
+    uint32_t field;       // Offset of the 32-bit field referring to label
+    uint32_t relocation;  // How the linker fills in the field
+    int64_t addend;
+    int opcode; // Of a jump
+    bool near;  // Jump with a 32-bit displacement
+    uint32_t alignment, max_skip; // In bytes, of padding
+} item_t;
+
+typedef struct {
+    vslc_context_t *ctx;
+    tlhash_t labels;
+    label_t **label_list;
+    size_t n_labels, label_capacity;
+    item_t *items;
+    size_t n_items, item_capacity;
+    buffer_t pool; // Encoded bytes of the items
+    int section;
+    char *line, *line_end; // Being assembled, for errors
+    size_t first_global; // Symbol, after the local ones
+    buffer_t contents[N_SECTIONS], relocations[N_SECTIONS];
+    uint32_t alignment[N_SECTIONS]; // Largest asked for in each
+} assembler_t;
+
+typedef enum { REGISTER, IMMEDIATE, MEMORY } operand_kind_t;
+
+#define NO_BASE (-1)
+
+/* Memory is addressed by a displacement from a base register, or from
+ * nothing: an absolute address, often a label. An index register times a
+ * scale of 1, 2, 4 or 8 may be added.
+ */
+typedef struct {
+    operand_kind_t kind;
+    int reg;        // Register, or base register of memory
+    int index;      // Index register of memory, or NO_BASE
+    int scale;
+    int width;      // Bytes of a register: 8, or 2 or 1 of its low part
+    int64_t value;  // Immediate, or displacement
+    label_t *label; // Value of an immediate or displacement, or NULL
+} operand_t;
+
+static const char *registers[16] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+static const char *word_registers[16] = {
+    "ax",  "cx",  "dx",   "bx",   "sp",   "bp",   "si",   "di",
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"};
+static const char *byte_registers[16] = {
+    "al",  "cl",  "dl",   "bl",   "spl",  "bpl",  "sil",  "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+
+typedef enum {
+    ARITHMETIC, // Two operands, with short forms for small immediates
+    UNARY,      // One operand, as an extension of the opcode
+    MULTIPLY,
+    MOVE,
+    MOVE_NARROW, // Of the width in bytes given as extension
+    EXTEND,      // Zero-extended into a register, from that width
+    TO_REGISTER, // From a register or memory
+    SHIFT,       // By an immediate
+    LOAD_ADDRESS,
+    TEST,
+    EXCHANGE,
+    PUSH,
+    POP,
+    PLAIN, // No operands
+    BRANCH,
+} form_t;
+
+static const struct {
+    const char *name;
+    form_t form;
+    int opcode, extension;
+} instructions[] = {
+    {"add", ARITHMETIC, 0x00, 0},  {"or", ARITHMETIC, 0x08, 1},
+    {"adc", ARITHMETIC, 0x10, 2},  {"sbb", ARITHMETIC, 0x18, 3},
+    {"and", ARITHMETIC, 0x20, 4},  {"sub", ARITHMETIC, 0x28, 5},
+    {"xor", ARITHMETIC, 0x30, 6},  {"cmp", ARITHMETIC, 0x38, 7},
+    {"not", UNARY, 0xf7, 2},       {"neg", UNARY, 0xf7, 3},
+    {"inc", UNARY, 0xff, 0},       {"dec", UNARY, 0xff, 1},
+    {"mul", UNARY, 0xf7, 4},       {"imul", MULTIPLY, 0xf7, 5},
+    {"div", UNARY, 0xf7, 6},       {"idiv", UNARY, 0xf7, 7},
+    {"shl", SHIFT, 0xc1, 4},       {"shr", SHIFT, 0xc1, 5},
+    {"sar", SHIFT, 0xc1, 7},       {"bsr", TO_REGISTER, 0x0fbd, 0},
+    {"mov", MOVE, 0x89, 0},        {"movb", MOVE_NARROW, 0x88, 1},
+    {"movw", MOVE_NARROW, 0x88, 2}, {"movzb", EXTEND, 0x0fb6, 1},
+    {"movzw", EXTEND, 0x0fb7, 2},  {"lea", LOAD_ADDRESS, 0x8d, 0},
+    {"test", TEST, 0x85, 0},       {"xchg", EXCHANGE, 0x87, 0},
+    {"push", PUSH, 0x50, 6},       {"pop", POP, 0x58, 0},
+    {"cqo", PLAIN, 0x99, true},    {"leave", PLAIN, 0xc9, false},
+    {"ret", PLAIN, 0xc3, false},   {"syscall", PLAIN, 0x0f05, false},
+    {"call", BRANCH, CALL, 0},
+    {"jmp", BRANCH, JMP, 0},       {"loop", BRANCH, LOOP, 0},
+};
+
+/* Conditional jumps are j followed by one of these */
+static const struct {
+    const char *name;
+    int code;
+} conditions[] = {
+    {"o", 0x0},  {"no", 0x1},  {"b", 0x2},  {"c", 0x2},   {"nae", 0x2},
+    {"ae", 0x3}, {"nb", 0x3},  {"nc", 0x3}, {"e", 0x4},   {"z", 0x4},
+    {"ne", 0x5}, {"nz", 0x5},  {"be", 0x6}, {"na", 0x6},  {"a", 0x7},
+    {"nbe", 0x7}, {"s", 0x8},  {"ns", 0x9}, {"p", 0xa},   {"pe", 0xa},
+    {"np", 0xb}, {"po", 0xb},  {"l", 0xc},  {"nge", 0xc}, {"ge", 0xd},
+    {"nl", 0xd}, {"le", 0xe},  {"ng", 0xe}, {"g", 0xf},   {"nle", 0xf},
+};
+
+#define N_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
+
+static void assemble_line(assembler_t *as, char *line);
+static void assemble_directive(assembler_t *as, const char *directive,
+                               char *arguments);
+static void assemble_instruction(assembler_t *as, const char *mnemonic,
+                                 char *arguments);
+static void lay_out(assembler_t *as);
+static void write_sections(assembler_t *as);
+static void write_object(assembler_t *as, buffer_t *object);
+static void free_assembler(assembler_t *as);
+
+/* The line is cut into pieces in place, which are joined again to report
+ * it
+ */
+static void fail(assembler_t *as) {
+    for (char *c = as->line; c < as->line_end; c++)
+        if (*c == '\0')
+            *c = ' ';
+    compile_error(as->ctx, "internal compiler error: cannot assemble '%s'",
+                  as->line);
+}
+
+/* Replace the assembly in ctx->code with the object it assembles to */
+void assemble_object(vslc_context_t *ctx) {
+    jmp_buf compile_exit;
+    memcpy(compile_exit, ctx->error_exit, sizeof(jmp_buf));
+    assembler_t as = {.ctx = ctx, .section = TEXT};
+    tlhash_init(&as.labels, 64 + ctx->code->length / 256);
+
+    buffer_t object = {0};
+    // Lines are cut out of the code in place, which is not needed after
+    emit_bytes(ctx->code, "", 1);
+    if (setjmp(ctx->error_exit) == 0) {
+        char *line = ctx->code->data;
+        while (line != NULL) {
+            char *end = strchr(line, '\n');
+            as.line = line;
+            as.line_end = (end != NULL) ? end : line + strlen(line);
+            if (end != NULL)
+                *end++ = '\0';
+            assemble_line(&as, line);
+            line = end;
+        }
+        lay_out(&as);
+        write_sections(&as);
+        write_object(&as, &object);
+    } else {
+        free_assembler(&as);
+        longjmp(compile_exit, 1);
+    }
+    memcpy(ctx->error_exit, compile_exit, sizeof(jmp_buf));
+    free_assembler(&as);
+    buffer_free(ctx->code);
+    *ctx->code = object;
+}
+
+static void free_assembler(assembler_t *as) {
+    for (size_t l = 0; l < as->n_labels; l++) {
+        free(as->label_list[l]->name);
+        free(as->label_list[l]);
+    }
+    free(as->label_list);
+    tlhash_finalize(&as->labels);
+    free(as->items);
+    buffer_free(&as->pool);
+    for (int s = 0; s < N_SECTIONS; s++) {
+        buffer_free(&as->contents[s]);
+        buffer_free(&as->relocations[s]);
+    }
+}
+
+/* Labels are entered by their first mention, defined or not */
+static label_t *find_label(assembler_t *as, const char *name) {
+    label_t *label;
+    if (tlhash_lookup(&as->labels, (void *)name, strlen(name),
+                      (void **)&label) == TLHASH_SUCCESS)
+        return label;
+    label = malloc(sizeof(label_t));
+    *label = (label_t){.name = strdup(name), .section = UNDEFINED};
+    tlhash_insert(&as->labels, (void *)name, strlen(name), label);
+    if (as->n_labels == as->label_capacity) {
+        as->label_capacity = as->label_capacity * 2 + 64;
+        as->label_list =
+            realloc(as->label_list, as->label_capacity * sizeof(label_t *));
+    }
+    as->label_list[as->n_labels++] = label;
+    return label;
+}
+
+static item_t *add_item(assembler_t *as, item_kind_t kind) {
+    if (as->n_items == as->item_capacity) {
+        as->item_capacity = as->item_capacity * 2 + 256;
+        as->items = realloc(as->items, as->item_capacity * sizeof(item_t));
+    }
+    item_t *item = &as->items[as->n_items++];
+    *item = (item_t){
+        .kind = kind, .section = as->section, .start = as->pool.length};
+    return item;
+}
+
+/* Bytes are put in the pool as part of the last item */
+static item_t *current_item(assembler_t *as) {
+    return &as->items[as->n_items - 1];
+}
+
+static void put(assembler_t *as, int byte) {
+    uint8_t b = byte;
+    emit_bytes(&as->pool, &b, 1);
+    current_item(as)->length += 1;
+}
+
+static void put32(assembler_t *as, uint32_t word) {
+    for (int i = 0; i < 4; i++)
+        put(as, word >> 8 * i & 0xff);
+}
+
+static void put64(assembler_t *as, uint64_t word) {
+    put32(as, word);
+    put32(as, word >> 32);
+}
+
+/* The next 32-bit field of the item holds the absolute address of a label,
+ * which the linker fills in
+ */
+static void put_address(assembler_t *as, label_t *label, int64_t addend) {
+    item_t *item = current_item(as);
+    if (label != NULL) {
+        if (item->label != NULL)
+            fail(as);
+        item->label = label;
+        item->field = item->length;
+        item->relocation = R_X86_64_32S;
+        item->addend = addend;
+        addend = 0;
+    }
+    put32(as, addend);
+}
+
+static bool fits8(int64_t value) { return value >= -128 && value <= 127; }
+
+static bool fits32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+static char *skip_space(char *text) {
+    while (isspace((unsigned char)*text))
+        text++;
+    return text;
+}
+
+static void trim_end(char *text) {
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char)text[length - 1]))
+        text[--length] = '\0';
+}
+
+/* Comments are blanked out, outside of strings */
+static void strip_comments(char *line) {
+    bool quoted = false;
+    for (char *c = line; *c != '\0'; c++) {
+        if (*c == '"')
+            quoted = !quoted;
+        else if (quoted && *c == '\\' && c[1] != '\0')
+            c++;
+        else if (!quoted && c[0] == '/' && c[1] == '*') {
+            char *end = strstr(c + 2, "*/");
+            end = (end != NULL) ? end + 2 : c + strlen(c);
+            memset(c, ' ', end - c);
+            c = end - 1;
+        }
+    }
+}
+
+static void assemble_line(assembler_t *as, char *line) {
+    strip_comments(line);
+    char *text = skip_space(line);
+    // Labels end with a colon, and can be followed by more on the line
+    for (;;) {
+        char *end = text;
+        while (is_name_char(*end))
+            end++;
+        if (end == text || *end != ':')
+            break;
+        *end = '\0';
+        label_t *defined = find_label(as, text);
+        if (defined->section != UNDEFINED)
+            fail(as);
+        defined->section = as->section;
+        add_item(as, LABEL)->label = defined;
+        text = skip_space(end + 1);
+    }
+    if (*text == '\0')
+        return;
+
+    char *arguments = text;
+    while (*arguments != '\0' && !isspace((unsigned char)*arguments))
+        arguments++;
+    if (*arguments != '\0')
+        *arguments++ = '\0';
+    arguments = skip_space(arguments);
+    trim_end(arguments);
+    if (text[0] == '.')
+        assemble_directive(as, text, arguments);
+    else
+        assemble_instruction(as, text, arguments);
+}
+
+/* Strings are written with the escapes the GNU assembler understands */
+static void put_string(assembler_t *as, char *text) {
+    if (*text++ != '"')
+        fail(as);
+    add_item(as, BYTES);
+    while (*text != '"') {
+        int c = *text++;
+        if (c == '\0')
+            fail(as);
+        if (c == '\\') {
+            c = *text++;
+            switch (c) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'x':
+                for (c = 0; isxdigit((unsigned char)*text); text++)
+                    c = c * 16 + (isdigit((unsigned char)*text)
+                                      ? *text - '0'
+                                      : (*text | 0x20) - 'a' + 10);
+                break;
+            case '\0':
+                fail(as);
+                break;
+            default:
+                if (c >= '0' && c <= '7') {
+                    c -= '0';
+                    for (int d = 1; d < 3 && *text >= '0' && *text <= '7'; d++)
+                        c = c * 8 + *text++ - '0';
+                }
+                break;
+            }
+        }
+        put(as, c);
+    }
+    put(as, '\0');
+    if (*skip_space(text + 1) != '\0')
+        fail(as);
+}
+
+static void select_section(assembler_t *as, const char *name) {
+    for (int s = 0; s < N_SECTIONS; s++)
+        if (!strcmp(name, section_names[s])) {
+            as->section = s;
+            return;
+        }
+    fail(as);
+}
+
+static void assemble_directive(assembler_t *as, const char *directive,
+                               char *arguments) {
+    if (!strcmp(directive, ".section")) {
+        select_section(as, arguments);
+    } else if (!strcmp(directive, ".text") || !strcmp(directive, ".data") ||
+               !strcmp(directive, ".bss")) {
+        select_section(as, directive);
+    } else if (!strcmp(directive, ".globl") && is_name_char(*arguments)) {
+        find_label(as, arguments)->global = true;
+    } else if (!strcmp(directive, ".string") && as->section != BSS) {
+        put_string(as, arguments);
+    } else if (!strcmp(directive, ".quad") && as->section != BSS) {
+        // Numbers only, which need no relocation
+        add_item(as, BYTES);
+        for (char *number = arguments;;) {
+            char *end;
+            // The magnitude is parsed unsigned, so both halves of the range
+            // fit, and a minus sign negates it in two's complement
+            bool negative = (*number == '-');
+            char *digits = negative ? number + 1 : number;
+            errno = 0;
+            uint64_t value = strtoull(digits, &end, 0);
+            end = skip_space(end);
+            if (end == digits || errno != 0 ||
+                !isdigit((unsigned char)*digits) ||
+                (negative && value > (uint64_t)INT64_MAX + 1) ||
+                (*end != ',' && *end != '\0'))
+                fail(as);
+            put64(as, negative ? (uint64_t)0 - value : value);
+            if (*end == '\0')
+                break;
+            number = skip_space(end + 1);
+        }
+    } else if (!strcmp(directive, ".p2align")) {
+        // A power of two, then maybe a fill byte, which is left to the
+        // default, and the most bytes to skip
+        char *end;
+        long power = strtol(arguments, &end, 10);
+        long max_skip = 0;
+        if (end == arguments || power < 0 || power > 12)
+            fail(as);
+        end = skip_space(end);
+        if (*end == ',') {
+            end = skip_space(end + 1);
+            if (*end++ != ',')
+                fail(as);
+            max_skip = strtol(end, &end, 10);
+            if (max_skip <= 0)
+                fail(as);
+        }
+        if (*skip_space(end) != '\0')
+            fail(as);
+        item_t *item = add_item(as, ALIGN);
+        item->alignment = 1u << power;
+        item->max_skip = max_skip > 0 ? max_skip : item->alignment - 1;
+        if (as->alignment[as->section] < item->alignment)
+            as->alignment[as->section] = item->alignment;
+    } else if (!strcmp(directive, ".zero")) {
+        char *end;
+        long long size = strtoll(arguments, &end, 0);
+        if (end == arguments || *end != '\0' || size < 0)
+            fail(as);
+        add_item(as, BYTES);
+        while (size-- > 0)
+            put(as, 0);
+    } else {
+        fail(as);
+    }
+}
+
+static void parse_register(assembler_t *as, const char *name, operand_t *op) {
+    for (int r = 0; r < 16; r++) {
+        op->reg = r;
+        if (!strcmp(name, registers[r]))
+            op->width = 8;
+        else if (!strcmp(name, word_registers[r]))
+            op->width = 2;
+        else if (!strcmp(name, byte_registers[r]))
+            op->width = 1;
+        else
+            continue;
+        return;
+    }
+    fail(as);
+}
+
+/* Numbers, or labels standing for their addresses */
+static char *parse_value(assembler_t *as, char *text, operand_t *op) {
+    if (isdigit((unsigned char)*text) || *text == '-') {
+        char *end;
+        op->value = strtoll(text, &end, 0);
+        if (end == text)
+            fail(as);
+        return end;
+    }
+    char *end = text;
+    while (is_name_char(*end))
+        end++;
+    if (end == text)
+        fail(as);
+    char saved = *end;
+    *end = '\0';
+    op->label = find_label(as, text);
+    *end = saved;
+    // A label may be offset by a number
+    if (*end == '+' || *end == '-') {
+        char *number = end;
+        op->value = strtoll(end, &end, 0);
+        if (end == number)
+            fail(as);
+    }
+    return end;
+}
+
+/* The index register and scale after the base in parentheses */
+static void parse_index(assembler_t *as, char *text, operand_t *op) {
+    char *scale = strchr(text, ',');
+    if (scale != NULL)
+        *scale++ = '\0';
+    operand_t index;
+    if (*text != '%')
+        fail(as);
+    parse_register(as, text + 1, &index);
+    // There is no index register numbered 4, which means none
+    if (index.width != 8 || index.reg == 4)
+        fail(as);
+    op->index = index.reg;
+    op->scale = 1;
+    if (scale != NULL) {
+        char *end;
+        op->scale = strtol(scale, &end, 10);
+        if (*end != '\0' || (op->scale != 1 && op->scale != 2 &&
+                              op->scale != 4 && op->scale != 8))
+            fail(as);
+    }
+}
+
+static void parse_operand(assembler_t *as, char *text, operand_t *op) {
+    *op = (operand_t){.reg = NO_BASE, .index = NO_BASE};
+    text = skip_space(text);
+    trim_end(text);
+    if (*text == '%') {
+        op->kind = REGISTER;
+        parse_register(as, text + 1, op);
+        return;
+    }
+    if (*text == '$') {
+        op->kind = IMMEDIATE;
+        if (*parse_value(as, text + 1, op) != '\0')
+            fail(as);
+        return;
+    }
+    op->kind = MEMORY;
+    if (*text != '(')
+        text = parse_value(as, text, op);
+    if (*text == '(') {
+        char *end = strchr(text, ')');
+        if (op->label != NULL || end == NULL || end[1] != '\0')
+            fail(as);
+        *end = '\0';
+        char *index = strchr(text, ',');
+        if (index != NULL)
+            *index++ = '\0';
+        if (text[1] == '%')
+            parse_register(as, text + 2, op);
+        else if (text[1] != '\0' || index == NULL)
+            fail(as);
+        if (index != NULL)
+            parse_index(as, index, op);
+    } else if (*text != '\0') {
+        fail(as);
+    }
+}
+
+/* Operands are separated by commas outside of parentheses */
+static int parse_operands(assembler_t *as, char *text, operand_t ops[3]) {
+    if (*text == '\0')
+        return 0;
+    int n = 0, depth = 0;
+    char *start = text;
+    for (char *c = text;; c++) {
+        if (*c == '(')
+            depth++;
+        else if (*c == ')')
+            depth--;
+        else if ((*c == ',' && depth == 0) || *c == '\0') {
+            bool last = *c == '\0';
+            if (n == 3)
+                fail(as);
+            *c = '\0';
+            parse_operand(as, start, &ops[n++]);
+            if (last)
+                return n;
+            start = c + 1;
+        }
+    }
+}
+
+/* The prefix for 64-bit operands and registers numbered from 8 */
+static void put_rex(assembler_t *as, bool wide, int reg, int index,
+                    int base) {
+    int rex = wide << 3 | (reg >> 3 & 1) << 2;
+    if (index != NO_BASE)
+        rex |= (index >> 3 & 1) << 1;
+    if (base != NO_BASE)
+        rex |= base >> 3 & 1;
+    if (rex != 0)
+        put(as, 0x40 | rex);
+}
+
+/* The ModRM byte and what follows it, for a register or opcode extension,
+ * and an operand in a register or in memory
+ */
+static void put_modrm(assembler_t *as, int reg, const operand_t *rm) {
+    if (rm->kind == REGISTER) {
+        put(as, 0xc0 | (reg & 7) << 3 | (rm->reg & 7));
+        return;
+    }
+    // A SIB byte holds the scale, the index, or 4 for none, and the base
+    static const int scale_bits[9] = {[2] = 1, [4] = 2, [8] = 3};
+    int sib = 0x20;
+    if (rm->index != NO_BASE)
+        sib = scale_bits[rm->scale] << 6 | (rm->index & 7) << 3;
+    if (rm->reg == NO_BASE) {
+        // An absolute address, by a SIB byte without a base
+        put(as, 0x04 | (reg & 7) << 3);
+        put(as, sib | 5);
+        put_address(as, rm->label, rm->value);
+        return;
+    }
+    int base = rm->reg & 7;
+    int mod = 2;
+    if (rm->value == 0 && base != 5)
+        mod = 0; // rbp and r13 have no form without displacement
+    else if (fits8(rm->value))
+        mod = 1;
+    // rsp and r12 are only addressed by a SIB byte
+    if (base == 4 || rm->index != NO_BASE) {
+        put(as, mod << 6 | (reg & 7) << 3 | 4);
+        put(as, sib | base);
+    } else {
+        put(as, mod << 6 | (reg & 7) << 3 | base);
+    }
+    if (mod == 1)
+        put(as, rm->value & 0xff);
+    else if (mod == 2)
+        put32(as, rm->value);
+}
+
+/* An instruction with a register or extension and an operand */
+static void put_instruction(assembler_t *as, bool wide, int opcode, int reg,
+                            const operand_t *rm) {
+    put_rex(as, wide, reg, rm->index, rm->reg);
+    if (opcode > 0xff)
+        put(as, opcode >> 8);
+    put(as, opcode & 0xff);
+    put_modrm(as, reg, rm);
+}
+
+static void put_immediate(assembler_t *as, const operand_t *imm) {
+    if (imm->label == NULL && !fits32(imm->value))
+        fail(as);
+    put_address(as, imm->label, imm->value);
+}
+
+static bool short_immediate(const operand_t *op) {
+    return op->kind == IMMEDIATE && op->label == NULL && fits8(op->value);
+}
+
+static int find_instruction(const char *mnemonic) {
+    for (size_t i = 0; i < N_ELEMENTS(instructions); i++)
+        if (!strcmp(mnemonic, instructions[i].name))
+            return i;
+    return -1;
+}
+
+static void assemble_branch(assembler_t *as, int opcode, operand_t *ops,
+                            int n) {
+    if (n != 1 || ops[0].kind != MEMORY || ops[0].reg != NO_BASE ||
+        ops[0].label == NULL || ops[0].value != 0)
+        fail(as);
+    item_t *jump = add_item(as, JUMP);
+    jump->label = ops[0].label;
+    jump->opcode = opcode;
+    jump->near = opcode == CALL;
+}
+
+static void assemble_instruction(assembler_t *as, const char *mnemonic,
+                                 char *arguments) {
+    // Only space is reserved in .bss, by .zero
+    if (as->section == BSS)
+        fail(as);
+    operand_t ops[3] = {{0}};
+    int n = parse_operands(as, arguments, ops);
+
+    // Mnemonics may carry the q suffix of 64-bit operands
+    int i = find_instruction(mnemonic);
+    size_t length = strlen(mnemonic);
+    if (i < 0 && length > 1 && mnemonic[length - 1] == 'q') {
+        char base[length];
+        memcpy(base, mnemonic, length - 1);
+        base[length - 1] = '\0';
+        i = find_instruction(base);
+    }
+    if (i < 0) {
+        for (size_t c = 0; mnemonic[0] == 'j' && c < N_ELEMENTS(conditions);
+             c++)
+            if (!strcmp(mnemonic + 1, conditions[c].name)) {
+                assemble_branch(as, conditions[c].code, ops, n);
+                return;
+            }
+        fail(as);
+    }
+
+    int opcode = instructions[i].opcode, extension = instructions[i].extension;
+    if (instructions[i].form == BRANCH) {
+        assemble_branch(as, opcode, ops, n);
+        return;
+    }
+    form_t form = instructions[i].form;
+    for (int k = 0; k < n; k++)
+        if (ops[k].kind == REGISTER && ops[k].width != 8 &&
+            form != MOVE_NARROW && form != EXTEND)
+            fail(as);
+    add_item(as, BYTES);
+    // Operands are in AT&T order, the source before the destination
+    operand_t *source = &ops[0], *destination = &ops[n > 0 ? n - 1 : 0];
+    switch (form) {
+    case ARITHMETIC:
+        if (n != 2 || destination->kind == IMMEDIATE)
+            fail(as);
+        if (short_immediate(source)) {
+            put_instruction(as, true, 0x83, extension, destination);
+            put(as, source->value & 0xff);
+        } else if (source->kind == IMMEDIATE &&
+                   destination->kind == REGISTER && destination->reg == 0) {
+            put(as, 0x48); // The accumulator has a form of its own
+            put(as, opcode + 5);
+            put_immediate(as, source);
+        } else if (source->kind == IMMEDIATE) {
+            put_instruction(as, true, 0x81, extension, destination);
+            put_immediate(as, source);
+        } else if (source->kind == REGISTER) {
+            put_instruction(as, true, opcode + 1, source->reg, destination);
+        } else if (destination->kind == REGISTER) {
+            put_instruction(as, true, opcode + 3, destination->reg, source);
+        } else {
+            fail(as);
+        }
+        break;
+    case MULTIPLY:
+        // Immediates multiply the middle operand, or the destination
+        if (n == 1 && source->kind != IMMEDIATE) {
+            put_instruction(as, true, opcode, extension, source);
+        } else if (n < 2 || destination->kind != REGISTER ||
+                   ops[1].kind == IMMEDIATE) {
+            fail(as);
+        } else if (short_immediate(source)) {
+            put_instruction(as, true, 0x6b, destination->reg, &ops[1]);
+            put(as, source->value & 0xff);
+        } else if (source->kind == IMMEDIATE) {
+            put_instruction(as, true, 0x69, destination->reg, &ops[1]);
+            put_immediate(as, source);
+        } else if (n == 2) {
+            put_instruction(as, true, 0x0faf, destination->reg, source);
+        } else {
+            fail(as);
+        }
+        break;
+    case UNARY:
+        if (n != 1 || source->kind == IMMEDIATE)
+            fail(as);
+        put_instruction(as, true, opcode, extension, source);
+        break;
+    case MOVE:
+        if (n != 2 || destination->kind == IMMEDIATE)
+            fail(as);
+        if (source->kind == IMMEDIATE && destination->kind == REGISTER &&
+            source->label == NULL && !fits32(source->value)) {
+            put_rex(as, true, 0, NO_BASE, destination->reg);
+            put(as, 0xb8 + (destination->reg & 7));
+            put64(as, source->value);
+        } else if (source->kind == IMMEDIATE) {
+            put_instruction(as, true, 0xc7, 0, destination);
+            put_immediate(as, source);
+        } else if (source->kind == REGISTER) {
+            put_instruction(as, true, 0x89, source->reg, destination);
+        } else if (destination->kind == REGISTER) {
+            put_instruction(as, true, 0x8b, destination->reg, source);
+        } else {
+            fail(as);
+        }
+        break;
+    case MOVE_NARROW:
+        if (n != 2 || destination->kind != MEMORY)
+            fail(as);
+        if (extension == 2)
+            put(as, 0x66); // The prefix of 16-bit operands
+        if (source->kind == IMMEDIATE) {
+            if (source->label != NULL || source->value < -(1 << 15) ||
+                source->value >= 1 << (8 * extension))
+                fail(as);
+            put_instruction(as, false, extension == 1 ? 0xc6 : 0xc7, 0,
+                            destination);
+            put(as, source->value & 0xff);
+            if (extension == 2)
+                put(as, source->value >> 8 & 0xff);
+        } else if (source->width == extension) {
+            // Without a prefix, 4 to 7 are the second bytes of ax to dx
+            if (extension == 1 && source->reg >= 4 && source->reg < 8 &&
+                (destination->reg == NO_BASE || destination->reg < 8))
+                put(as, 0x40);
+            put_instruction(as, false, extension == 1 ? opcode : opcode + 1,
+                            source->reg, destination);
+        } else {
+            fail(as);
+        }
+        break;
+    case EXTEND:
+        if (n != 2 || destination->kind != REGISTER ||
+            destination->width != 8 || source->kind == IMMEDIATE ||
+            (source->kind == REGISTER && source->width != extension))
+            fail(as);
+        put_instruction(as, true, opcode, destination->reg, source);
+        break;
+    case TO_REGISTER:
+        if (n != 2 || destination->kind != REGISTER ||
+            source->kind == IMMEDIATE)
+            fail(as);
+        put_instruction(as, true, opcode, destination->reg, source);
+        break;
+    case SHIFT:
+        if (n != 2 || source->kind != IMMEDIATE || source->label != NULL ||
+            source->value < 0 || source->value > 63 ||
+            destination->kind == IMMEDIATE)
+            fail(as);
+        if (source->value == 1) {
+            put_instruction(as, true, 0xd1, extension, destination);
+        } else {
+            put_instruction(as, true, opcode, extension, destination);
+            put(as, source->value);
+        }
+        break;
+    case LOAD_ADDRESS:
+        if (n != 2 || source->kind != MEMORY || destination->kind != REGISTER)
+            fail(as);
+        put_instruction(as, true, opcode, destination->reg, source);
+        break;
+    case TEST:
+        if (n != 2 || destination->kind == IMMEDIATE)
+            fail(as);
+        if (source->kind == IMMEDIATE && destination->kind == REGISTER &&
+            destination->reg == 0) {
+            put(as, 0x48);
+            put(as, 0xa9);
+            put_immediate(as, source);
+        } else if (source->kind == IMMEDIATE) {
+            put_instruction(as, true, 0xf7, 0, destination);
+            put_immediate(as, source);
+        } else if (source->kind == REGISTER) {
+            put_instruction(as, true, opcode, source->reg, destination);
+        } else if (destination->kind == REGISTER) {
+            put_instruction(as, true, opcode, destination->reg, source);
+        } else {
+            fail(as);
+        }
+        break;
+    case EXCHANGE:
+        if (n != 2 || source->kind == IMMEDIATE ||
+            destination->kind == IMMEDIATE)
+            fail(as);
+        if (source->kind == REGISTER && destination->kind == REGISTER &&
+            (source->reg == 0 || destination->reg == 0)) {
+            // Exchanges with the accumulator have a short form
+            int other = source->reg + destination->reg;
+            if (other != 0)
+                put_rex(as, true, 0, NO_BASE, other);
+            put(as, 0x90 + (other & 7));
+        } else if (source->kind == REGISTER) {
+            put_instruction(as, true, opcode, source->reg, destination);
+        } else if (destination->kind == REGISTER) {
+            put_instruction(as, true, opcode, destination->reg, source);
+        } else {
+            fail(as);
+        }
+        break;
+    case PUSH:
+    case POP:
+        if (n != 1)
+            fail(as);
+        if (source->kind == REGISTER) {
+            put_rex(as, false, 0, NO_BASE, source->reg);
+            put(as, opcode + (source->reg & 7));
+        } else if (source->kind == MEMORY) {
+            put_instruction(as, false, opcode == 0x50 ? 0xff : 0x8f,
+                            extension, source);
+        } else if (opcode == 0x58) {
+            fail(as);
+        } else if (short_immediate(source)) {
+            put(as, 0x6a);
+            put(as, source->value & 0xff);
+        } else {
+            put(as, 0x68);
+            put_immediate(as, source);
+        }
+        break;
+    case PLAIN:
+        if (n != 0)
+            fail(as);
+        if (extension)
+            put(as, 0x48);
+        if (opcode > 0xff)
+            put(as, opcode >> 8);
+        put(as, opcode & 0xff);
+        break;
+    case BRANCH:
+        break;
+    }
+}
+
+/* Jumps that reach out of their section are left to the linker, and so
+ * are calls of labels that another object can take over
+ */
+static bool resolved_here(const item_t *jump) {
+    return jump->label->section == jump->section &&
+           !(jump->opcode == CALL && jump->label->global);
+}
+
+/* Padding is left out if it would be longer than allowed */
+static size_t padding(const item_t *item) {
+    size_t length = -item->offset & (item->alignment - 1);
+    return length <= item->max_skip ? length : 0;
+}
+
+static size_t item_length(const item_t *item) {
+    if (item->kind == ALIGN)
+        return padding(item);
+    if (item->kind != JUMP)
+        return item->length;
+    switch (item->opcode) {
+    case CALL:
+    case JMP:
+        return item->near ? 5 : 2;
+    case LOOP:
+        return 2;
+    default:
+        return item->near ? 6 : 2;
+    }
+}
+
+/* Jumps start out short, and are made near when their target is out of
+ * reach, until all reach, as the GNU assembler does
+ */
+static void lay_out(assembler_t *as) {
+    for (size_t i = 0; i < as->n_items; i++) {
+        item_t *item = &as->items[i];
+        if (item->kind == JUMP && !resolved_here(item)) {
+            if (item->opcode == LOOP) {
+                as->line = as->line_end = item->label->name;
+                fail(as);
+            }
+            item->near = true;
+        }
+    }
+    for (bool grown = true; grown;) {
+        uint64_t offsets[N_SECTIONS] = {0};
+        for (size_t i = 0; i < as->n_items; i++) {
+            item_t *item = &as->items[i];
+            item->offset = offsets[item->section];
+            if (item->kind == LABEL)
+                item->label->value = item->offset;
+            offsets[item->section] += item_length(item);
+        }
+        grown = false;
+        for (size_t i = 0; i < as->n_items; i++) {
+            item_t *item = &as->items[i];
+            if (item->kind != JUMP || item->near)
+                continue;
+            int64_t reach = item->label->value - (item->offset + 2);
+            if (fits8(reach))
+                continue;
+            if (item->opcode == LOOP) {
+                as->line = as->line_end = item->label->name;
+                fail(as);
+            }
+            item->near = grown = true;
+        }
+    }
+}
+
+/* Symbols local to the object come before the others, after the symbols
+ * of the sections, which local labels are relocated against. Labels
+ * starting with .L are only for the assembler, and get no symbol.
+ */
+static bool is_local(const label_t *label) {
+    return !label->global && label->section != UNDEFINED;
+}
+
+static void number_symbols(assembler_t *as) {
+    size_t index = 1 + N_SECTIONS;
+    for (size_t l = 0; l < as->n_labels; l++) {
+        label_t *label = as->label_list[l];
+        if (is_local(label) && strncmp(label->name, ".L", 2) != 0)
+            label->index = index++;
+    }
+    as->first_global = index;
+    for (size_t l = 0; l < as->n_labels; l++) {
+        label_t *label = as->label_list[l];
+        if (!is_local(label))
+            label->index = index++;
+    }
+}
+
+static void relocate(assembler_t *as, int section, uint64_t offset,
+                     uint32_t type, label_t *label, int64_t addend) {
+    size_t symbol = label->index;
+    if (is_local(label)) {
+        symbol = 1 + label->section;
+        addend += label->value;
+    }
+    Elf64_Rela relocation = {.r_offset = offset,
+                             .r_info = ELF64_R_INFO(symbol, type),
+                             .r_addend = addend};
+    emit_bytes(&as->relocations[section], &relocation, sizeof(relocation));
+}
+
+/* Code is padded with as few no-ops as the GNU assembler uses, which are
+ * of up to 11 bytes, and data with zeros
+ */
+static void put_padding(assembler_t *as, const item_t *item) {
+    static const uint8_t no_ops[12][11] = {
+        {0},
+        {0x90},
+        {0x66, 0x90},
+        {0x0f, 0x1f, 0x00},
+        {0x0f, 0x1f, 0x40, 0x00},
+        {0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}};
+    bool code = item->section == TEXT;
+    for (size_t left = padding(item), length; left > 0; left -= length) {
+        length = !code ? 1 : left < 11 ? left : 11;
+        emit_bytes(&as->contents[item->section], no_ops[code ? length : 0],
+                   length);
+    }
+}
+
+static void write_sections(assembler_t *as) {
+    number_symbols(as);
+    for (size_t i = 0; i < as->n_items; i++) {
+        item_t *item = &as->items[i];
+        buffer_t *contents = &as->contents[item->section];
+        if (item->kind == BYTES) {
+            emit_bytes(contents, as->pool.data + item->start, item->length);
+            if (item->label != NULL)
+                relocate(as, item->section, item->offset + item->field,
+                         item->relocation, item->label, item->addend);
+        } else if (item->kind == ALIGN) {
+            put_padding(as, item);
+        } else if (item->kind == JUMP) {
+            size_t length = item_length(item);
+            uint8_t code[6];
+            size_t n = 0;
+            if (item->opcode == CALL)
+                code[n++] = 0xe8;
+            else if (item->opcode == JMP)
+                code[n++] = item->near ? 0xe9 : 0xeb;
+            else if (item->opcode == LOOP)
+                code[n++] = 0xe2;
+            else if (item->near) {
+                code[n++] = 0x0f;
+                code[n++] = 0x80 + item->opcode;
+            } else
+                code[n++] = 0x70 + item->opcode;
+
+            int64_t reach = 0;
+            if (resolved_here(item))
+                reach = item->label->value - (item->offset + length);
+            else if (item->opcode == CALL)
+                relocate(as, item->section, item->offset + n, R_X86_64_PLT32,
+                         item->label, -4);
+            for (; n < length; n++, reach >>= 8)
+                code[n] = reach & 0xff;
+            emit_bytes(contents, code, length);
+        }
+    }
+    // The assembler relocates jumps after everything else, as they are
+    // relaxed, so they are listed in its order here
+    for (size_t i = 0; i < as->n_items; i++) {
+        item_t *item = &as->items[i];
+        if (item->kind == JUMP && item->opcode != CALL && !resolved_here(item))
+            relocate(as, item->section,
+                     item->offset + item_length(item) - 4, R_X86_64_PLT32,
+                     item->label, -4);
+    }
+}
+
+/* Section headers and their contents, with the names of the sections */
+typedef struct {
+    Elf64_Shdr headers[2 * N_SECTIONS + 5];
+    const void *contents[2 * N_SECTIONS + 5];
+    size_t n_sections;
+    buffer_t names;
+} elf_sections_t;
+
+static size_t add_section(elf_sections_t *elf, const char *name,
+                          Elf64_Shdr header, const buffer_t *contents) {
+    header.sh_name = elf->names.length;
+    emit_bytes(&elf->names, name, strlen(name) + 1);
+    if (contents != NULL) {
+        header.sh_size = contents->length;
+        elf->contents[elf->n_sections] = contents->data;
+    }
+    elf->headers[elf->n_sections] = header;
+    return elf->n_sections++;
+}
+
+static void write_object(assembler_t *as, buffer_t *object) {
+    static const Elf64_Word flags[N_SECTIONS] = {
+        SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC | SHF_WRITE,
+        SHF_ALLOC | SHF_WRITE, SHF_ALLOC};
+    elf_sections_t elf = {.n_sections = 1};
+    emit_bytes(&elf.names, "", 1);
+
+    // The symbol table comes after the sections and their relocations
+    size_t n_relocated = 0, indices[N_SECTIONS];
+    for (int s = 0; s < N_SECTIONS; s++)
+        n_relocated += as->relocations[s].length > 0;
+    size_t symtab_index = 1 + N_SECTIONS + n_relocated + 1;
+    for (int s = 0; s < N_SECTIONS; s++) {
+        // The zeros of .bss take up no room in the file
+        indices[s] = add_section(
+            &elf, section_names[s],
+            (Elf64_Shdr){.sh_type = s == BSS ? SHT_NOBITS : SHT_PROGBITS,
+                         .sh_flags = flags[s],
+                         .sh_addralign = as->alignment[s] > 1
+                                             ? as->alignment[s]
+                                             : 1},
+            &as->contents[s]);
+        if (as->relocations[s].length == 0)
+            continue;
+        char name[16];
+        snprintf(name, sizeof(name), ".rela%s", section_names[s]);
+        add_section(&elf, name,
+                    (Elf64_Shdr){.sh_type = SHT_RELA,
+                                 .sh_flags = SHF_INFO_LINK,
+                                 .sh_link = symtab_index,
+                                 .sh_info = indices[s],
+                                 .sh_addralign = 8,
+                                 .sh_entsize = sizeof(Elf64_Rela)},
+                    &as->relocations[s]);
+    }
+    // Without this note, linkers assume the stack must be executable
+    add_section(&elf, ".note.GNU-stack",
+                (Elf64_Shdr){.sh_type = SHT_PROGBITS, .sh_addralign = 1},
+                NULL);
+
+    buffer_t symbols = {0}, names = {0};
+    emit_bytes(&names, "", 1);
+    emit_bytes(&symbols, &(Elf64_Sym){0}, sizeof(Elf64_Sym));
+    for (int s = 0; s < N_SECTIONS; s++) {
+        Elf64_Sym symbol = {.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+                            .st_shndx = indices[s]};
+        emit_bytes(&symbols, &symbol, sizeof(symbol));
+    }
+    for (size_t pass = 0; pass < 2; pass++)
+        for (size_t l = 0; l < as->n_labels; l++) {
+            label_t *label = as->label_list[l];
+            bool global = !is_local(label);
+            if (global != (pass == 1) || label->index == 0)
+                continue;
+            Elf64_Sym symbol = {
+                .st_name = names.length,
+                .st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+                                         STT_NOTYPE),
+                .st_shndx = label->section == UNDEFINED
+                                ? SHN_UNDEF
+                                : indices[label->section],
+                .st_value = label->value};
+            emit_bytes(&names, label->name, strlen(label->name) + 1);
+            emit_bytes(&symbols, &symbol, sizeof(symbol));
+        }
+    add_section(&elf, ".symtab",
+                (Elf64_Shdr){.sh_type = SHT_SYMTAB,
+                             .sh_link = symtab_index + 1,
+                             .sh_info = as->first_global,
+                             .sh_addralign = 8,
+                             .sh_entsize = sizeof(Elf64_Sym)},
+                &symbols);
+    add_section(&elf, ".strtab",
+                (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_addralign = 1},
+                &names);
+    size_t shstrtab_index = elf.n_sections;
+    emit_bytes(&elf.names, ".shstrtab", sizeof(".shstrtab"));
+    elf.headers[elf.n_sections] =
+        (Elf64_Shdr){.sh_name = elf.names.length - sizeof(".shstrtab"),
+                     .sh_type = SHT_STRTAB,
+                     .sh_size = elf.names.length,
+                     .sh_addralign = 1};
+    elf.contents[elf.n_sections++] = elf.names.data;
+
+    // The file header, the contents of the sections, and their headers
+    Elf64_Ehdr header = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64,
+                    ELFDATA2LSB, EV_CURRENT, ELFOSABI_NONE},
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = elf.n_sections,
+        .e_shstrndx = shstrtab_index};
+    emit_bytes(object, &header, sizeof(header));
+    static const char padding[8];
+    for (size_t s = 1; s < elf.n_sections; s++) {
+        Elf64_Shdr *section = &elf.headers[s];
+        size_t align = section->sh_addralign;
+        emit_bytes(object, padding, (align - object->length % align) % align);
+        section->sh_offset = object->length;
+        if (section->sh_size > 0 && section->sh_type != SHT_NOBITS)
+            emit_bytes(object, elf.contents[s], section->sh_size);
+    }
+    emit_bytes(object, padding, (8 - object->length % 8) % 8);
+    ((Elf64_Ehdr *)object->data)->e_shoff = object->length;
+    emit_bytes(object, elf.headers, elf.n_sections * sizeof(Elf64_Shdr));
+
+    buffer_free(&symbols);
+    buffer_free(&names);
+    buffer_free(&elf.names);
+}
@@ -2,20 +2,48 @@
 #include <vslc.h>
 
 #define N0C(n,t,d) do { \
-    node_init ( n = malloc(sizeof(node_t)), t, d, 0 ); \
+    node_init ( n = node_alloc(ctx), t, d, 0 ); \
+    n->line = yyget_lineno ( scanner ); \
 } while ( false )
 #define N1C(n,t,d,a) do { \
-    node_init ( n = malloc(sizeof(node_t)), t, d, 1, a ); \
+    node_init ( n = node_alloc(ctx), t, d, 1, a ); \
+    n->line = yyget_lineno ( scanner ); \
 } while ( false )
 #define N2C(n,t,d,a,b) do { \
-    node_init ( n = malloc(sizeof(node_t)), t, d, 2, a, b ); \
+    node_init ( n = node_alloc(ctx), t, d, 2, a, b ); \
+    n->line = yyget_lineno ( scanner ); \
 } while ( false )
 #define N3C(n,t,d,a,b,c) do { \
-    node_init ( n = malloc(sizeof(node_t)), t, d, 3, a, b, c ); \
+    node_init ( n = node_alloc(ctx), t, d, 3, a, b, c ); \
+    n->line = yyget_lineno ( scanner ); \
+} while ( false )
+
+/* When streaming, globals are compiled and freed as soon as they reduce,
+ * and leave nothing in the global list
+ */
+#define STREAM(n) do { \
+    if ( ctx->streaming ) \
+    { \
+        if ( stream_global ( ctx, n ) != 0 ) \
+            YYABORT; \
+        n = NULL; \
+    } \
 } while ( false )
 
 %}
 
+%define api.pure full
+%parse-param { yyscan_t scanner } { vslc_context_t *ctx }
+%lex-param { yyscan_t scanner }
+
+/* Subtrees left on the stack when parsing stops at a syntax error */
+%destructor { destroy_subtree ( ctx, $$ ); }
+    global_list global statement_list print_list expression_list
+    variable_list argument_list parameter_list declaration_list function
+    statement block assignment_statement return_statement print_statement
+    null_statement if_statement while_statement relation expression
+    declaration print_item identifier number string
+
 %left '|'
 %left '^'
 %left '&'
@@ -30,15 +58,23 @@
 
 %%
 program :
-      global_list { N1C ( root, PROGRAM, NULL, $1 ); }
+      global_list { N1C ( ctx->root, PROGRAM, NULL, $1 ); }
     ;
 global_list :
-      global { N1C ( $$, GLOBAL_LIST, NULL, $1 ); }
-    | global_list global { N2C ( $$, GLOBAL_LIST, NULL, $1, $2 ); }
+      global
+        {
+          if ( $1 != NULL ) N1C ( $$, GLOBAL_LIST, NULL, $1 );
+          else $$ = NULL;
+        }
+    | global_list global
+        {
+          if ( $2 != NULL ) N2C ( $$, GLOBAL_LIST, NULL, $1, $2 );
+          else $$ = $1;
+        }
     ;
 global:
-      function { N1C ( $$, GLOBAL, NULL, $1 ); }
-    | declaration { N1C ( $$, GLOBAL, NULL, $1 ); }
+      function { N1C ( $$, GLOBAL, NULL, $1 ); STREAM ( $$ ); }
+    | declaration { N1C ( $$, GLOBAL, NULL, $1 ); STREAM ( $$ ); }
     ;
 statement_list :
       statement { N1C ( $$, STATEMENT_LIST, NULL, $1 ); }
@@ -163,19 +199,21 @@ print_item :
     | string
         { N1C ( $$, PRINT_ITEM, NULL, $1 ); }
     ;
-identifier: IDENTIFIER { N0C($$, IDENTIFIER_DATA, strdup(yytext) ); }
+identifier: IDENTIFIER
+      { N0C($$, IDENTIFIER_DATA, strdup(yyget_text(scanner)) ); }
 number: NUMBER
       {
         int64_t *value = malloc ( sizeof(int64_t) );
-        *value = strtol ( yytext, NULL, 10 );
+        *value = strtol ( yyget_text(scanner), NULL, 10 );
         N0C($$, NUMBER_DATA, value );
       }
-string: STRING { N0C($$, STRING_DATA, strdup(yytext) ); }
+string: STRING { N0C($$, STRING_DATA, strdup(yyget_text(scanner)) ); }
 %%
 
 int
-yyerror ( const char *error )
+yyerror ( yyscan_t scanner, vslc_context_t *ctx, const char *error )
 {
-    fprintf ( stderr, "%s on line %d\n", error, yylineno );
-    exit ( EXIT_FAILURE );
+    ctx->error_line = yyget_lineno ( scanner );
+    fprintf ( ctx->diag, "%s on line %zu\n", error, ctx->error_line );
+    return 0;
 }
@@ -0,0 +1,444 @@
+#include <vslc.h>
+
+/* Peephole optimization of the assembly of one function. The code is cut
+ * into a list of lines, each a label, an instruction with its operands, or
+ * a directive kept as it is. The rules look at a window of instructions
+ * from each one in turn, and rewrite it in place, until none applies. Then
+ * the list is emitted again over the code it was cut from.
+ */
+
+typedef enum { LABEL, INSTRUCTION, DIRECTIVE, REMOVED } line_kind_t;
+
+typedef struct {
+    line_kind_t kind;
+    char *text;        // Label name, mnemonic, or the directive
+    char *operands[3];
+    int n_operands;
+    size_t tail;       // First line of the return a jump is replaced by,
+                       // or NO_TAIL
+} line_t;
+
+#define NO_TAIL SIZE_MAX
+#define NO_LINE SIZE_MAX
+
+// The longest return copied in place of a jump to it
+#define MAX_TAIL 8
+// The longest chain of jumps followed
+#define MAX_HOPS 16
+
+typedef struct {
+    line_t *lines;
+    size_t n_lines;
+    tlhash_t labels; // Line of each label
+} peephole_t;
+
+typedef bool (*rewrite_t)(peephole_t *p, size_t i);
+
+static bool remove_self_move(peephole_t *p, size_t i);
+static bool remove_reload(peephole_t *p, size_t i);
+static bool remove_jump_to_next(peephole_t *p, size_t i);
+static bool retarget_jump_to_jump(peephole_t *p, size_t i);
+static bool invert_branch_over_jump(peephole_t *p, size_t i);
+static bool copy_return(peephole_t *p, size_t i);
+static bool fold_push_pop(peephole_t *p, size_t i);
+static bool remove_zero_addition(peephole_t *p, size_t i);
+static bool fold_address_move(peephole_t *p, size_t i);
+static bool remove_flag_test(peephole_t *p, size_t i);
+
+/* In the order they are tried, and reported; the names follow
+ * peephole_rules in tac.h
+ */
+static const rewrite_t rules[PEEPHOLE_RULES] = {
+    remove_self_move,      remove_reload,
+    remove_jump_to_next,   retarget_jump_to_jump,
+    invert_branch_over_jump, copy_return,
+    fold_push_pop,         remove_zero_addition,
+    fold_address_move,     remove_flag_test};
+
+const char *peephole_rules[PEEPHOLE_RULES] = {
+    "self moves",          "reloads",
+    "jumps to the next line", "jumps to jumps",
+    "branches over jumps", "jumps to returns",
+    "pushes and pops",     "additions of zero",
+    "address moves",       "tests of set flags"};
+
+/* Conditional jumps, and those taken when they are not */
+static const char *inverse_jumps[][2] = {{"jl", "jge"}, {"jge", "jl"},
+                                         {"jg", "jle"}, {"jle", "jg"},
+                                         {"je", "jne"}, {"jne", "je"}};
+
+static void cut_lines(peephole_t *p, char *text);
+static void emit_lines(peephole_t *p, buffer_t *code,
+                       tac_statistics_t *stats);
+
+void optimize_peephole(vslc_context_t *ctx, size_t start) {
+    buffer_t *code = ctx->code;
+    size_t length = code->length - start;
+    char *text = malloc(length + 1);
+    memcpy(text, code->data + start, length);
+    text[length] = '\0';
+    code->length = start;
+
+    peephole_t p = {0};
+    tlhash_init(&p.labels, 64 + length / 256);
+    cut_lines(&p, text);
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < p.n_lines; i++)
+            for (int r = 0; r < PEEPHOLE_RULES; r++)
+                if (p.lines[i].kind == INSTRUCTION && rules[r](&p, i)) {
+                    ctx->statistics.peephole_hits[r] += 1;
+                    changed = true;
+                }
+    }
+
+    emit_lines(&p, code, &ctx->statistics);
+    tlhash_finalize(&p.labels);
+    free(p.lines);
+    free(text);
+}
+
+/* Lines are cut out of the text in place, and their operands at the commas
+ * outside of parentheses
+ */
+static void cut_lines(peephole_t *p, char *text) {
+    size_t capacity = 0;
+    for (char *line = text; *line != '\0';) {
+        char *end = strchr(line, '\n');
+        if (end != NULL)
+            *end++ = '\0';
+        else
+            end = line + strlen(line);
+        if (p->n_lines == capacity) {
+            capacity = capacity * 2 + 64;
+            p->lines = realloc(p->lines, capacity * sizeof(line_t));
+        }
+        line_t *l = &p->lines[p->n_lines];
+        *l = (line_t){.kind = DIRECTIVE, .text = line, .tail = NO_TAIL};
+        size_t length = strlen(line);
+        if (*line != '\t' && *line != ' ') {
+            if (length > 0 && line[length - 1] == ':') {
+                l->kind = LABEL;
+                line[length - 1] = '\0';
+                tlhash_insert(&p->labels, line, length - 1,
+                              (void *)(uintptr_t)p->n_lines);
+            }
+            p->n_lines += 1;
+            line = end;
+            continue;
+        }
+
+        l->kind = INSTRUCTION;
+        l->text = line + strspn(line, " \t");
+        char *operand = l->text + strcspn(l->text, " \t");
+        if (*operand != '\0')
+            *operand++ = '\0';
+        operand += strspn(operand, " \t");
+        int depth = 0;
+        for (char *c = operand; *operand != '\0'; c++) {
+            if (*c == '(')
+                depth++;
+            else if (*c == ')')
+                depth--;
+            else if ((*c == ',' && depth == 0 && l->n_operands < 2) ||
+                     *c == '\0') {
+                // The last operand kept takes the rest of the line
+                bool last = *c == '\0';
+                *c = '\0';
+                l->operands[l->n_operands++] = operand;
+                if (last)
+                    break;
+                operand = c + 1 + strspn(c + 1, " \t");
+            }
+        }
+        p->n_lines += 1;
+        line = end;
+    }
+}
+
+static void emit_instruction(line_t *l, buffer_t *code) {
+    emit(code, "\t%s", l->text);
+    for (int o = 0; o < l->n_operands; o++)
+        emit(code, o == 0 ? "\t%s" : ", %s", l->operands[o]);
+    emit_string(code, "\n");
+}
+
+/* Jumps replaced by the returns they went to count as removed, and the
+ * instructions of the returns as copied
+ */
+static void emit_lines(peephole_t *p, buffer_t *code,
+                       tac_statistics_t *stats) {
+    for (size_t i = 0; i < p->n_lines; i++) {
+        line_t *l = &p->lines[i];
+        switch (l->kind) {
+        case LABEL:
+            emit(code, "%s:\n", l->text);
+            break;
+        case DIRECTIVE:
+            emit(code, "%s\n", l->text);
+            break;
+        case INSTRUCTION:
+            if (l->tail == NO_TAIL) {
+                emit_instruction(l, code);
+                break;
+            }
+            stats->peephole_removed += 1;
+            for (size_t t = l->tail; t < p->n_lines; t++) {
+                if (p->lines[t].kind != INSTRUCTION)
+                    continue;
+                emit_instruction(&p->lines[t], code);
+                stats->peephole_copied += 1;
+                if (!strcmp(p->lines[t].text, "ret"))
+                    break;
+            }
+            break;
+        case REMOVED:
+            stats->peephole_removed += 1;
+            break;
+        }
+    }
+}
+
+/* The next instruction from a line on, past labels and removed lines, or
+ * NO_LINE
+ */
+static size_t next_instruction(peephole_t *p, size_t i) {
+    for (; i < p->n_lines; i++)
+        if (p->lines[i].kind == INSTRUCTION)
+            return i;
+        else if (p->lines[i].kind == DIRECTIVE)
+            return NO_LINE;
+    return NO_LINE;
+}
+
+static bool is(line_t *l, const char *mnemonic, int n_operands) {
+    return l->kind == INSTRUCTION && l->tail == NO_TAIL &&
+           l->n_operands == n_operands && !strcmp(l->text, mnemonic);
+}
+
+static bool is_jump(line_t *l) {
+    return l->kind == INSTRUCTION && l->tail == NO_TAIL &&
+           l->n_operands == 1 && l->text[0] == 'j' &&
+           l->operands[0][0] == '.';
+}
+
+static bool is_register(const char *operand) { return operand[0] == '%'; }
+
+static size_t find_label(peephole_t *p, char *name) {
+    void *line;
+    if (tlhash_lookup(&p->labels, name, strlen(name), &line) !=
+        TLHASH_SUCCESS)
+        return NO_LINE;
+    return (uintptr_t)line;
+}
+
+/* Whether the label is on the lines between an instruction and the next,
+ * which padding to align it may come before
+ */
+static bool falls_to(peephole_t *p, size_t i, char *label) {
+    for (size_t j = i + 1; j < p->n_lines; j++)
+        if (p->lines[j].kind == LABEL && !strcmp(p->lines[j].text, label))
+            return true;
+        else if (p->lines[j].kind == INSTRUCTION ||
+                 (p->lines[j].kind == DIRECTIVE &&
+                  strncmp(p->lines[j].text, ".p2align", 8)))
+            return false;
+    return false;
+}
+
+// movq A, A
+static bool remove_self_move(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i];
+    if (!is(l, "movq", 2) || strcmp(l->operands[0], l->operands[1]))
+        return false;
+    l->kind = REMOVED;
+    return true;
+}
+
+/* The instruction right after another, with no label between, or NULL */
+static line_t *following(peephole_t *p, size_t i) {
+    for (i++; i < p->n_lines && p->lines[i].kind == REMOVED; i++)
+        ;
+    if (i == p->n_lines || p->lines[i].kind != INSTRUCTION)
+        return NULL;
+    return &p->lines[i];
+}
+
+// movq A, B; movq B, A, where B is not addressed by A
+static bool remove_reload(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i], *next = following(p, i);
+    if (!is(l, "movq", 2) || next == NULL || !is(next, "movq", 2) ||
+        strcmp(l->operands[0], next->operands[1]) ||
+        strcmp(l->operands[1], next->operands[0]) ||
+        strstr(l->operands[1], l->operands[0]) != NULL)
+        return false;
+    next->kind = REMOVED;
+    return true;
+}
+
+// jmp L; L:
+static bool remove_jump_to_next(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i];
+    if (!is_jump(l) || !falls_to(p, i, l->operands[0]))
+        return false;
+    l->kind = REMOVED;
+    return true;
+}
+
+/* The line a jump to the label goes on at, or NO_LINE */
+static size_t jump_target(peephole_t *p, char *label) {
+    size_t line = find_label(p, label);
+    return line == NO_LINE ? NO_LINE : next_instruction(p, line);
+}
+
+// j L; ... L: jmp M
+static bool retarget_jump_to_jump(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i];
+    if (!is_jump(l))
+        return false;
+    // Through the chain of jumps, unless it is a loop
+    char *destination = l->operands[0];
+    for (int hops = 0;; hops++) {
+        size_t target = jump_target(p, destination);
+        if (target == NO_LINE || !is(&p->lines[target], "jmp", 1) ||
+            !is_jump(&p->lines[target]))
+            break;
+        if (hops == MAX_HOPS)
+            return false;
+        destination = p->lines[target].operands[0];
+    }
+    if (!strcmp(destination, l->operands[0]))
+        return false;
+    l->operands[0] = destination;
+    return true;
+}
+
+// jcc L; jmp M; L:
+static bool invert_branch_over_jump(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i], *next = following(p, i);
+    if (!is_jump(l) || next == NULL || !is(next, "jmp", 1) ||
+        !is_jump(next) || !falls_to(p, next - p->lines, l->operands[0]))
+        return false;
+    for (size_t j = 0; j < sizeof(inverse_jumps) / sizeof(inverse_jumps[0]);
+         j++)
+        if (!strcmp(l->text, inverse_jumps[j][0])) {
+            l->text = (char *)inverse_jumps[j][1];
+            l->operands[0] = next->operands[0];
+            next->kind = REMOVED;
+            return true;
+        }
+    return false;
+}
+
+// jmp L; ... L: a few instructions; ret
+static bool copy_return(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i];
+    if (!is_jump(l) || strcmp(l->text, "jmp"))
+        return false;
+    size_t first = jump_target(p, l->operands[0]);
+    size_t n = 0;
+    for (size_t t = first; t != NO_LINE && n < MAX_TAIL;
+         t = next_instruction(p, t + 1), n++) {
+        line_t *copied = &p->lines[t];
+        if (copied->tail != NO_TAIL || copied->text[0] == 'j' ||
+            !strcmp(copied->text, "call"))
+            return false;
+        if (!strcmp(copied->text, "ret")) {
+            l->tail = first;
+            return true;
+        }
+    }
+    return false;
+}
+
+// pushq A; popq B
+static bool fold_push_pop(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i], *next = following(p, i);
+    if (!is(l, "pushq", 1) || next == NULL || !is(next, "popq", 1) ||
+        !(is_register(l->operands[0]) || is_register(next->operands[0])))
+        return false;
+    l->text = "movq";
+    l->operands[1] = next->operands[0];
+    l->n_operands = 2;
+    next->kind = REMOVED;
+    return true;
+}
+
+static bool is_branch(line_t *l) {
+    return l != NULL && is_jump(l) && strcmp(l->text, "jmp");
+}
+
+// addq $0, A; subq $0, A, unless a branch reads the flags
+static bool remove_zero_addition(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i];
+    if ((!is(l, "addq", 2) && !is(l, "subq", 2)) ||
+        strcmp(l->operands[0], "$0") || is_branch(following(p, i)))
+        return false;
+    l->kind = REMOVED;
+    return true;
+}
+
+// leaq 0(A), B
+static bool fold_address_move(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i];
+    char *address = l->operands[0];
+    if (!is(l, "leaq", 2) || strncmp(address, "0(%", 3) ||
+        strchr(address, ',') != NULL)
+        return false;
+    // The register is cut out of the parentheses
+    address[strlen(address) - 1] = '\0';
+    l->text = "movq";
+    l->operands[0] = address + 2;
+    return true;
+}
+
+/* Instructions that set the zero and sign flags by their result, and whether
+ * they clear the overflow flag too
+ */
+static const struct {
+    const char *mnemonic;
+    int n_operands;
+    bool clears_overflow;
+} flag_setters[] = {{"addq", 2, false}, {"subq", 2, false},
+                    {"andq", 2, true},  {"orq", 2, true},
+                    {"xorq", 2, true},  {"incq", 1, false},
+                    {"decq", 1, false}, {"negq", 1, false}};
+
+/* op A; testq A, A; jcc, or cmpq $0, A in place of the test, with a copy
+ * of A to a register maybe tested in place of it
+ */
+static bool remove_flag_test(peephole_t *p, size_t i) {
+    line_t *l = &p->lines[i], *test = following(p, i);
+    if (l->n_operands == 0)
+        return false;
+    char *result = l->operands[l->n_operands - 1], *copy = result;
+    if (test != NULL && is(test, "movq", 2) &&
+        !strcmp(test->operands[0], result) && is_register(test->operands[1])) {
+        copy = test->operands[1];
+        test = following(p, test - p->lines);
+    }
+    if (test == NULL || !((is(test, "testq", 2) &&
+                           !strcmp(test->operands[0], test->operands[1])) ||
+                          (is(test, "cmpq", 2) &&
+                           !strcmp(test->operands[0], "$0"))))
+        return false;
+    size_t s = 0, n_setters = sizeof(flag_setters) / sizeof(flag_setters[0]);
+    while (s < n_setters && !is(l, flag_setters[s].mnemonic,
+                                flag_setters[s].n_operands))
+        s++;
+    if (s == n_setters || (strcmp(result, test->operands[1]) &&
+                           strcmp(copy, test->operands[1])))
+        return false;
+    // Signed jumps other than je and jne also read the overflow flag
+    size_t n_branches = 0;
+    for (line_t *next = following(p, test - p->lines); is_branch(next);
+         next = following(p, next - p->lines), n_branches++)
+        if (!flag_setters[s].clears_overflow && strcmp(next->text, "je") &&
+            strcmp(next->text, "jne"))
+            return false;
+    if (n_branches == 0)
+        return false;
+    test->kind = REMOVED;
+    return true;
+}
@@ -0,0 +1,343 @@
+#include <vslc.h>
+
+/* Linear scan register allocation [Poletto and Sarkar 1999] over the
+ * blocks of a function, in the order they are generated. Each value gets
+ * one interval, from the first point it is live to the last, found by
+ * liveness analysis of the values that live in more than one block.
+ * Intervals that cross a call are only given callee-saved registers, the
+ * rest prefer the caller-saved ones. When the registers run out, the
+ * interval that ends last is spilled to the frame.
+ *
+ * The argument registers are scratch registers for the intervals that hold
+ * no call, where the generator does not pass arguments through them. A
+ * parameter may only keep the register it was passed in, so the entry of
+ * the function never writes one that has not been read yet. Rax, rcx and
+ * rdx are left to the generator, which divides and loads wide constants
+ * through them, so no value needs to move out of their way.
+ */
+
+#define NONE SIZE_MAX
+
+static const char *registers[] = {"%r10", "%r11", "%rsi", "%rdi",
+                                  "%r8",  "%r9",  "%rbx", "%r12",
+                                  "%r13", "%r14", "%r15"};
+#define N_REGISTERS 11
+#define FIRST_ARGUMENT 2
+#define FIRST_CALLEE_SAVED 6
+
+#define MASK(first, last) (((1u << (last)) - 1) & ~((1u << (first)) - 1))
+
+// Index in the registers of each argument register, or -1
+static const int argument_registers[6] = {3, 2, -1, -1, 4, 5};
+
+typedef struct {
+    size_t value;
+    size_t start, end; // Positions, two per instruction: uses, then results
+    unsigned allowed;  // Bits of the registers it may be given
+    int reg;           // Index in the registers, or -1 if spilled
+} interval_t;
+
+/* Live sets, as bits over the values that live in more than one block */
+typedef struct {
+    size_t n_words;
+    uint64_t *gen, *kill, *in, *out; // n_words per block
+} liveness_t;
+
+static void find_liveness(tac_function_t *code, size_t *global_index,
+                          size_t n_global, liveness_t *live);
+static void scan(interval_t *intervals, size_t n_intervals);
+
+static bool is_call(tac_instruction_t *instruction) {
+    switch (instruction->opcode) {
+    case TAC_CALL:
+    case TAC_PRINT_INT:
+    case TAC_PRINT_TEXT:
+    case TAC_PRINT_NEWLINE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int by_start(const void *a, const void *b) {
+    const interval_t *x = a, *y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+void allocate_registers(tac_function_t *code) {
+    size_t n_values = code->n_values, n_blocks = code->n_blocks;
+    size_t n_parameters = code->symbol->nparms;
+    if (code->location_capacity < n_values) {
+        code->location_capacity = code->value_capacity;
+        code->locations = realloc(code->locations, code->location_capacity *
+                                                       sizeof(tac_location_t));
+    }
+    for (size_t v = 0; v < n_values; v++)
+        code->locations[v] = (tac_location_t){0};
+
+    /* Values read in a block before it assigns them are live into it, and
+     * take part in the liveness analysis. The parameters are assigned
+     * before the entry block.
+     */
+    size_t *start = malloc((n_values + 1) * sizeof(size_t));
+    size_t *end = calloc(n_values + 1, sizeof(size_t));
+    size_t *assigned_in = malloc((n_values + 1) * sizeof(size_t));
+    size_t *global_index = malloc((n_values + 1) * sizeof(size_t));
+    size_t *block_start = malloc((n_blocks + 1) * sizeof(size_t));
+    size_t n_global = 0, n_calls = 0, k = 0;
+    for (size_t v = 0; v < n_values; v++) {
+        start[v] = v < n_parameters ? 0 : NONE;
+        assigned_in[v] = v < n_parameters ? 0 : NONE;
+        global_index[v] = NONE;
+    }
+    for (size_t b = 0; b < n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        block_start[b] = k;
+        for (size_t i = 0; i < block->n_instructions; i++, k++) {
+            tac_instruction_t *instruction = &block->instructions[i];
+            tac_operand_t *operands[2] = {&instruction->left,
+                                          &instruction->right};
+            for (size_t a = 0; a < 2 + instruction->n_arguments; a++) {
+                tac_operand_t *op =
+                    a < 2 ? operands[a]
+                          : &code->arguments[instruction->first_argument + a -
+                                             2];
+                if (op->kind != TAC_VALUE)
+                    continue;
+                size_t v = op->number;
+                if (start[v] == NONE)
+                    start[v] = 2 * k + 2;
+                end[v] = 2 * k + 2;
+                if (assigned_in[v] != b && global_index[v] == NONE)
+                    global_index[v] = n_global++;
+            }
+            if (instruction->result.kind == TAC_VALUE) {
+                size_t v = instruction->result.number;
+                if (start[v] == NONE)
+                    start[v] = 2 * k + 3;
+                if (end[v] < 2 * k + 3)
+                    end[v] = 2 * k + 3;
+                assigned_in[v] = b;
+            }
+            n_calls += is_call(instruction);
+        }
+    }
+    block_start[n_blocks] = k;
+
+    // Live values cover the blocks they live through
+    liveness_t live;
+    find_liveness(code, global_index, n_global, &live);
+    for (size_t v = 0; v < n_values; v++) {
+        size_t g = global_index[v];
+        if (g == NONE)
+            continue;
+        for (size_t b = 0; b < n_blocks; b++) {
+            uint64_t bit = (uint64_t)1 << (g % 64);
+            size_t word = b * live.n_words + g / 64;
+            if ((live.in[word] & bit) && start[v] > 2 * block_start[b] + 2)
+                start[v] = 2 * block_start[b] + 2;
+            if ((live.out[word] & bit) && end[v] < 2 * block_start[b + 1] + 1)
+                end[v] = 2 * block_start[b + 1] + 1;
+        }
+    }
+    free(live.gen);
+    free(live.kill);
+    free(live.in);
+    free(live.out);
+
+    // Intervals holding a call only keep callee-saved registers over it
+    size_t *calls = malloc((n_calls + 1) * sizeof(size_t));
+    n_calls = k = 0;
+    for (size_t b = 0; b < n_blocks; b++)
+        for (size_t i = 0; i < code->blocks[b].n_instructions; i++, k++)
+            if (is_call(&code->blocks[b].instructions[i]))
+                calls[n_calls++] = 2 * k + 2;
+
+    size_t n_intervals = 0;
+    interval_t *intervals = malloc((n_values + 1) * sizeof(interval_t));
+    for (size_t v = 0; v < n_values; v++) {
+        if (start[v] == NONE || (v < n_parameters && end[v] == 0))
+            continue;
+        // The first call from the start on
+        size_t low = 0, high = n_calls;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (calls[middle] < start[v])
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        unsigned allowed = MASK(0, N_REGISTERS);
+        if (low < n_calls && calls[low] <= end[v])
+            allowed &= ~MASK(FIRST_ARGUMENT, FIRST_CALLEE_SAVED);
+        if (low < n_calls && calls[low] == start[v])
+            low += 1;
+        if (low < n_calls && calls[low] < end[v])
+            allowed &= ~MASK(0, FIRST_CALLEE_SAVED);
+        if (v < n_parameters && v < 6) {
+            allowed &= ~MASK(FIRST_ARGUMENT, FIRST_CALLEE_SAVED) |
+                       (argument_registers[v] >= 0
+                            ? 1u << argument_registers[v]
+                            : 0);
+        }
+        intervals[n_intervals++] = (interval_t){
+            .value = v,
+            .start = start[v],
+            .end = end[v],
+            .allowed = allowed,
+        };
+    }
+    qsort(intervals, n_intervals, sizeof(interval_t), by_start);
+    scan(intervals, n_intervals);
+
+    /* The callee-saved registers used are pushed below the frame pointer,
+     * and the spill slots follow. Parameters passed on the stack are kept
+     * where they were passed when spilled.
+     */
+    bool used[N_REGISTERS] = {false};
+    for (size_t i = 0; i < n_intervals; i++)
+        if (intervals[i].reg >= 0)
+            used[intervals[i].reg] = true;
+    code->n_saved_registers = 0;
+    for (int r = FIRST_CALLEE_SAVED; r < N_REGISTERS; r++)
+        if (used[r])
+            code->saved_registers[code->n_saved_registers++] = registers[r];
+    code->n_spill_slots = 0;
+    for (size_t i = 0; i < n_intervals; i++) {
+        tac_location_t *location = &code->locations[intervals[i].value];
+        size_t v = intervals[i].value;
+        location->last_live = intervals[i].end / 2 - 1;
+        if (intervals[i].reg >= 0)
+            location->reg = registers[intervals[i].reg];
+        else if (v < n_parameters && v > 5)
+            location->offset = 16 + 8 * ((int64_t)v - 6);
+        else
+            location->offset =
+                -8 * (int64_t)(code->n_saved_registers +
+                               code->n_spill_slots++ + 1);
+    }
+
+    free(start);
+    free(end);
+    free(assigned_in);
+    free(global_index);
+    free(block_start);
+    free(calls);
+    free(intervals);
+}
+
+/* Live values flow backwards from the uses, until nothing changes */
+static void find_liveness(tac_function_t *code, size_t *global_index,
+                          size_t n_global, liveness_t *live) {
+    size_t n_blocks = code->n_blocks, n_words = (n_global + 63) / 64;
+    size_t n_parameters = code->symbol->nparms;
+    live->n_words = n_words;
+    live->gen = calloc(n_blocks * n_words + 1, sizeof(uint64_t));
+    live->kill = calloc(n_blocks * n_words + 1, sizeof(uint64_t));
+    live->in = calloc(n_blocks * n_words + 1, sizeof(uint64_t));
+    live->out = calloc(n_blocks * n_words + 1, sizeof(uint64_t));
+    if (n_global == 0)
+        return;
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        uint64_t *gen = &live->gen[b * n_words];
+        uint64_t *kill = &live->kill[b * n_words];
+        if (b == 0)
+            for (size_t p = 0; p < n_parameters; p++)
+                if (global_index[p] != NONE)
+                    kill[global_index[p] / 64] |= (uint64_t)1
+                                                  << (global_index[p] % 64);
+        for (size_t i = 0; i < block->n_instructions; i++) {
+            tac_instruction_t *instruction = &block->instructions[i];
+            tac_operand_t *operands[2] = {&instruction->left,
+                                          &instruction->right};
+            for (size_t a = 0; a < 2 + instruction->n_arguments; a++) {
+                tac_operand_t *op =
+                    a < 2 ? operands[a]
+                          : &code->arguments[instruction->first_argument + a -
+                                             2];
+                if (op->kind != TAC_VALUE || global_index[op->number] == NONE)
+                    continue;
+                size_t g = global_index[op->number];
+                uint64_t bit = (uint64_t)1 << (g % 64);
+                if (!(kill[g / 64] & bit))
+                    gen[g / 64] |= bit;
+            }
+            if (instruction->result.kind == TAC_VALUE &&
+                global_index[instruction->result.number] != NONE) {
+                size_t g = global_index[instruction->result.number];
+                kill[g / 64] |= (uint64_t)1 << (g % 64);
+            }
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t b = n_blocks; b > 0; b--) {
+            tac_block_t *block = &code->blocks[b - 1];
+            uint64_t *in = &live->in[(b - 1) * n_words];
+            uint64_t *out = &live->out[(b - 1) * n_words];
+            uint64_t *gen = &live->gen[(b - 1) * n_words];
+            uint64_t *kill = &live->kill[(b - 1) * n_words];
+            for (size_t w = 0; w < n_words; w++) {
+                uint64_t word = 0;
+                for (size_t s = 0; s < block->n_successors; s++)
+                    word |= live->in[block->successors[s] * n_words + w];
+                out[w] = word;
+                word = gen[w] | (word & ~kill[w]);
+                if (word != in[w]) {
+                    in[w] = word;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static void scan(interval_t *intervals, size_t n_intervals) {
+    interval_t *active[N_REGISTERS]; // By increasing end
+    size_t n_active = 0;
+    bool free_registers[N_REGISTERS];
+    for (int r = 0; r < N_REGISTERS; r++)
+        free_registers[r] = true;
+
+    for (size_t i = 0; i < n_intervals; i++) {
+        interval_t *current = &intervals[i];
+        size_t n_expired = 0;
+        while (n_expired < n_active && active[n_expired]->end < current->start)
+            free_registers[active[n_expired++]->reg] = true;
+        n_active -= n_expired;
+        memmove(active, &active[n_expired], n_active * sizeof(interval_t *));
+
+        current->reg = -1;
+        for (int r = 0; r < N_REGISTERS && current->reg < 0; r++)
+            if (free_registers[r] && (current->allowed & 1u << r))
+                current->reg = r;
+        if (current->reg < 0) {
+            // Spill the interval that ends last, if it ends after this one
+            size_t last = n_active;
+            while (last > 0 &&
+                   !(current->allowed & 1u << active[last - 1]->reg))
+                last -= 1;
+            if (last == 0 || active[last - 1]->end <= current->end)
+                continue;
+            interval_t *spilled = active[last - 1];
+            current->reg = spilled->reg;
+            spilled->reg = -1;
+            n_active -= 1;
+            memmove(&active[last - 1], &active[last],
+                    (n_active - (last - 1)) * sizeof(interval_t *));
+        }
+        free_registers[current->reg] = false;
+
+        size_t at = n_active++;
+        while (at > 0 && active[at - 1]->end > current->end) {
+            active[at] = active[at - 1];
+            at -= 1;
+        }
+        active[at] = current;
+    }
+}
@@ -0,0 +1,288 @@
+#include <vslc.h>
+
+/* The runtime of VSL programs, emitted with the entry point, so it goes
+ * into the program unit, and library units call it there.
+ *
+ * Printed items are gathered in a buffer, which is written by a system
+ * call when it is full and when the program exits. The routines may
+ * change the registers a C function may change.
+ */
+static const char *runtime =
+    ".section .bss\n"
+    ".Lvsl_buffer: .zero 65536\n"
+    ".Lvsl_buffered: .zero 8\n"
+    ".section .text\n"
+
+    // Write out the buffered output, giving up on errors
+    ".globl __vsl_flush\n"
+    "__vsl_flush:\n"
+    "\tmovq\t$.Lvsl_buffer, %rsi\n"
+    "\tmovq\t.Lvsl_buffered, %rdx\n"
+    "\tmovq\t$0, .Lvsl_buffered\n"
+    ".Lvsl_write:\n"
+    "\ttestq\t%rdx, %rdx\n"
+    "\tjz\t.Lvsl_written\n"
+    "\tmovq\t$1, %rax\n"
+    "\tmovq\t$1, %rdi\n"
+    "\tsyscall\n"
+    "\ttestq\t%rax, %rax\n"
+    "\tjle\t.Lvsl_written\n"
+    "\taddq\t%rax, %rsi\n"
+    "\tsubq\t%rax, %rdx\n"
+    "\tjmp\t.Lvsl_write\n"
+    ".Lvsl_written:\n"
+    "\tret\n"
+
+    // The next free byte of the buffer in rdx, and its end in r8
+    ".Lvsl_cursor:\n"
+    "\tmovq\t$.Lvsl_buffer, %r8\n"
+    "\tmovq\t%r8, %rdx\n"
+    "\taddq\t.Lvsl_buffered, %rdx\n"
+    "\taddq\t$65536, %r8\n"
+    "\tret\n"
+
+    // Flush the buffer up to the cursor, keeping rax and rdi
+    ".Lvsl_spill:\n"
+    "\tpushq\t%rax\n"
+    "\tpushq\t%rdi\n"
+    "\tsubq\t$.Lvsl_buffer, %rdx\n"
+    "\tmovq\t%rdx, .Lvsl_buffered\n"
+    "\tcall\t__vsl_flush\n"
+    "\tpopq\t%rdi\n"
+    "\tpopq\t%rax\n"
+    "\tjmp\t.Lvsl_cursor\n"
+
+    // Put the string at rdi at the cursor, leaving rdi at its end
+    ".Lvsl_put_string:\n"
+    "\tmovzbq\t(%rdi), %rax\n"
+    "\ttestq\t%rax, %rax\n"
+    "\tjz\t.Lvsl_put_done\n"
+    "\tcmpq\t%r8, %rdx\n"
+    "\tjb\t.Lvsl_put_char\n"
+    "\tcall\t.Lvsl_spill\n"
+    ".Lvsl_put_char:\n"
+    "\tmovb\t%al, (%rdx)\n"
+    "\taddq\t$1, %rdx\n"
+    "\taddq\t$1, %rdi\n"
+    "\tjmp\t.Lvsl_put_string\n"
+    ".Lvsl_put_done:\n"
+    "\tret\n"
+
+    // Put the byte in rax at the cursor, and store the cursor
+    ".Lvsl_put_last:\n"
+    "\tcmpq\t%r8, %rdx\n"
+    "\tjb\t.Lvsl_put_stored\n"
+    "\tcall\t.Lvsl_spill\n"
+    ".Lvsl_put_stored:\n"
+    "\tmovb\t%al, (%rdx)\n"
+    "\taddq\t$1, %rdx\n"
+    "\tsubq\t$.Lvsl_buffer, %rdx\n"
+    "\tmovq\t%rdx, .Lvsl_buffered\n"
+    "\tret\n"
+
+    // The string at rdi, as it is
+    ".globl __vsl_print_text\n"
+    "__vsl_print_text:\n"
+    "\tcall\t.Lvsl_cursor\n"
+    "\tcall\t.Lvsl_put_string\n"
+    "\tsubq\t$.Lvsl_buffer, %rdx\n"
+    "\tmovq\t%rdx, .Lvsl_buffered\n"
+    "\tret\n"
+
+    // The integer in rdi in decimal, then a space. The digits are counted
+    // first, from the bit length of the magnitude, which gives the count
+    // or one more, and one comparison with a power of ten. They are then
+    // put from the last, two at a time, from a table of the pairs 00 to
+    // 99. Quotients by 100 are multiplied out, as division is slow
+    ".globl __vsl_print_int\n"
+    "__vsl_print_int:\n"
+    "\tcall\t.Lvsl_cursor\n"
+    "\tmovq\t%r8, %rax\n"
+    "\tsubq\t%rdx, %rax\n"
+    "\tcmpq\t$21, %rax\n" // A sign, 19 digits and a space
+    "\tjae\t.Lvsl_int_room\n"
+    "\tcall\t.Lvsl_spill\n"
+    ".Lvsl_int_room:\n"
+    "\tmovq\t%rdx, %rsi\n"
+    "\tmovq\t%rdi, %rcx\n"
+    "\ttestq\t%rdi, %rdi\n"
+    "\tjns\t.Lvsl_count\n"
+    "\tmovb\t$45, (%rsi)\n"
+    "\taddq\t$1, %rsi\n"
+    "\tnegq\t%rcx\n" // Unsigned from here, so the most negative works
+    ".Lvsl_count:\n"
+    "\tmovq\t%rcx, %r10\n"
+    "\torq\t$1, %r10\n" // Zero has one digit, like one
+    "\tbsrq\t%r10, %rax\n"
+    "\taddq\t$1, %rax\n"
+    "\timulq\t$1233, %rax\n" // Times log10(2), in 12-bit fixed point
+    "\tshrq\t$12, %rax\n"
+    "\tmovq\t%rax, %r9\n"
+    "\tshlq\t$3, %r9\n"
+    "\taddq\t$.Lvsl_powers, %r9\n"
+    "\tcmpq\t(%r9), %r10\n"
+    "\tsbbq\t$0, %rax\n"
+    "\taddq\t%rax, %rsi\n"
+    "\taddq\t$1, %rsi\n"
+    "\tmovq\t%rsi, %r11\n" // Past the last digit
+    "\tmovq\t%rcx, %rax\n"
+    ".Lvsl_pair:\n"
+    "\tcmpq\t$100, %rax\n"
+    "\tjb\t.Lvsl_last_digits\n"
+    "\tmovq\t%rax, %r9\n"
+    "\tshrq\t$2, %rax\n"
+    "\tmovq\t$0x28f5c28f5c28f5c3, %rdx\n"
+    "\tmulq\t%rdx\n"
+    "\tshrq\t$2, %rdx\n"
+    "\tmovq\t%rdx, %rax\n"
+    "\timulq\t$100, %rdx, %r10\n"
+    "\tsubq\t%r10, %r9\n"
+    "\taddq\t%r9, %r9\n"
+    "\taddq\t$.Lvsl_pairs, %r9\n"
+    "\tmovzwq\t(%r9), %r10\n"
+    "\tsubq\t$2, %rsi\n"
+    "\tmovw\t%r10w, (%rsi)\n"
+    "\tjmp\t.Lvsl_pair\n"
+    ".Lvsl_last_digits:\n"
+    "\tcmpq\t$10, %rax\n"
+    "\tjb\t.Lvsl_last_digit\n"
+    "\taddq\t%rax, %rax\n"
+    "\taddq\t$.Lvsl_pairs, %rax\n"
+    "\tmovzwq\t(%rax), %r10\n"
+    "\tmovw\t%r10w, -2(%rsi)\n"
+    "\tjmp\t.Lvsl_int_done\n"
+    ".Lvsl_last_digit:\n"
+    "\taddq\t$48, %rax\n"
+    "\tmovb\t%al, -1(%rsi)\n"
+    ".Lvsl_int_done:\n"
+    "\tmovb\t$32, (%r11)\n"
+    "\taddq\t$1, %r11\n"
+    "\tsubq\t$.Lvsl_buffer, %r11\n"
+    "\tmovq\t%r11, .Lvsl_buffered\n"
+    "\tret\n"
+
+    ".globl __vsl_print_newline\n"
+    "__vsl_print_newline:\n"
+    "\tcall\t.Lvsl_cursor\n"
+    "\tmovq\t$10, %rax\n"
+    "\tjmp\t.Lvsl_put_last\n";
+
+/* Leaving through the C library, which closes its own streams */
+static const char *hosted_exit =
+    // Leave with the status in rdi, like exit(rdi)
+    "__vsl_exit:\n"
+    "\tpushq\t%rdi\n"
+    "\tcall\t__vsl_flush\n"
+    "\tpopq\t%rdi\n"
+    "\tjmp\texit\n";
+
+/* Without the C library, the rest of what the entry point calls */
+static const char *freestanding_runtime =
+    "__vsl_exit:\n"
+    "\tpushq\t%rdi\n"
+    "\tcall\t__vsl_flush\n"
+    "\tpopq\t%rdi\n"
+    "\tmovq\t$60, %rax\n"
+    "\tsyscall\n"
+
+    // The string at rdi and a newline, returning the bytes put, like
+    // puts(rdi)
+    "__vsl_puts:\n"
+    "\tpushq\t%rdi\n"
+    "\tcall\t.Lvsl_cursor\n"
+    "\tcall\t.Lvsl_put_string\n"
+    "\tpopq\t%rsi\n"
+    "\tsubq\t%rsi, %rdi\n"
+    "\tpushq\t%rdi\n"
+    "\tmovq\t$10, %rax\n"
+    "\tcall\t.Lvsl_put_last\n"
+    "\tpopq\t%rax\n"
+    "\taddq\t$1, %rax\n"
+    "\tret\n"
+
+    // The decimal integer at the start of the string at rdi, after blanks
+    // and with an optional sign, like strtol(rdi, NULL, 10) without errno.
+    // Blanks are spaces and the controls \t to \r, 9 to 13. Values out of
+    // range saturate at the limit of their sign, as they do with strtol.
+    "__vsl_parse_int:\n"
+    "\txorq\t%rax, %rax\n"
+    ".Lvsl_blank:\n"
+    "\tmovzbq\t(%rdi), %rsi\n"
+    "\tcmpq\t$32, %rsi\n"
+    "\tje\t.Lvsl_skip\n"
+    "\tmovq\t%rsi, %rdx\n"
+    "\tsubq\t$9, %rdx\n"
+    "\tcmpq\t$4, %rdx\n"
+    "\tja\t.Lvsl_signed\n"
+    ".Lvsl_skip:\n"
+    "\taddq\t$1, %rdi\n"
+    "\tjmp\t.Lvsl_blank\n"
+    ".Lvsl_signed:\n"
+    "\tcmpq\t$45, %rsi\n"
+    "\tje\t.Lvsl_sign\n"
+    "\tcmpq\t$43, %rsi\n"
+    "\tjne\t.Lvsl_limit\n"
+    ".Lvsl_sign:\n"
+    "\taddq\t$1, %rdi\n"
+    // The magnitude is kept at most rcx, 2^63 - 1, or 2^63 after a minus,
+    // and a digit is only appended to one of at most r8, a tenth of that
+    ".Lvsl_limit:\n"
+    "\tmovq\t$922337203685477580, %r8\n"
+    "\tmovq\t$9223372036854775807, %rcx\n"
+    "\tcmpq\t$45, %rsi\n"
+    "\tjne\t.Lvsl_parse\n"
+    "\taddq\t$1, %rcx\n"
+    ".Lvsl_parse:\n"
+    "\tmovzbq\t(%rdi), %rdx\n"
+    "\tsubq\t$48, %rdx\n"
+    "\tcmpq\t$9, %rdx\n"
+    "\tja\t.Lvsl_parsed\n"
+    "\taddq\t$1, %rdi\n"
+    "\tcmpq\t%r8, %rax\n"
+    "\tja\t.Lvsl_saturate\n"
+    "\timulq\t$10, %rax\n"
+    "\taddq\t%rdx, %rax\n"
+    "\tcmpq\t%rcx, %rax\n"
+    "\tjbe\t.Lvsl_parse\n"
+    ".Lvsl_saturate:\n"
+    "\tmovq\t%rcx, %rax\n"
+    "\tjmp\t.Lvsl_parse\n"
+    ".Lvsl_parsed:\n"
+    "\tcmpq\t$45, %rsi\n"
+    "\tjne\t.Lvsl_positive\n"
+    "\tnegq\t%rax\n"
+    ".Lvsl_positive:\n"
+    "\tret\n";
+
+/* Tables of the integer formatting: the digits of 0 to 99 in pairs, and
+ * the powers of ten that fit 64 bits
+ */
+static void
+generate_tables ( vslc_context_t *ctx )
+{
+    char pairs[201];
+    for ( int n = 0; n < 100; n++ )
+    {
+        pairs[2*n] = '0' + n / 10;
+        pairs[2*n+1] = '0' + n % 10;
+    }
+    pairs[200] = '\0';
+    emit_string ( ctx->code, ".section .rodata\n" );
+    emit ( ctx->code, ".Lvsl_pairs: .string \"%s\"\n", pairs );
+    emit_string ( ctx->code, ".Lvsl_powers:\n" );
+    size_t power = 1;
+    for ( int n = 0; n < 20; n++, power *= 10 )
+        emit ( ctx->code, ".quad %u\n", power );
+}
+
+
+void
+generate_runtime ( vslc_context_t *ctx )
+{
+    generate_tables ( ctx );
+    emit_string ( ctx->code, runtime );
+    emit_string ( ctx->code, ctx->options.freestanding
+        ? freestanding_runtime
+        : hosted_exit
+    );
+}
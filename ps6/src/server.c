@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <server.h>
+
+/* Requests larger than this are refused */
+#define MAX_REQUEST_LENGTH ((uint64_t)1 << 30)
+#define QUEUE_LENGTH 256
+/* Threads one request may generate its functions on */
+#define MAX_THREADS 64
+/* Seconds a connection may go without sending or taking data */
+#define CONNECTION_TIMEOUT 30
+
+/* Accepted connections waiting for a worker */
+static struct {
+    int fds[QUEUE_LENGTH];
+    size_t head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .not_empty = PTHREAD_COND_INITIALIZER,
+           .not_full = PTHREAD_COND_INITIALIZER};
+
+static void *worker(void *arg);
+static void serve_connection(vslc_context_t *ctx,
+                             const vslc_options_t *defaults, int fd);
+static int open_socket(const char *socket_path, struct sockaddr_un *address);
+
+static void pack_options(const vslc_options_t *options,
+                         request_header_t *request);
+static vslc_options_t unpack_options(const request_header_t *request);
+static int read_all(int fd, void *buffer, size_t length);
+static int write_all(int fd, const void *buffer, size_t length);
+
+int serve(const char *socket_path, int n_workers,
+          const vslc_options_t *defaults) {
+    struct sockaddr_un address;
+    int listener = open_socket(socket_path, &address);
+    if (listener < 0)
+        return EXIT_FAILURE;
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, QUEUE_LENGTH) != 0) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+    // Clients that hang up should not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int w = 0; w < n_workers; w++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, (void *)defaults) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stderr, "vslc: serving on %s with %d workers\n", socket_path,
+            n_workers);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+        // A client that stalls would otherwise hold its worker forever
+        struct timeval timeout = {.tv_sec = CONNECTION_TIMEOUT};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == QUEUE_LENGTH)
+            pthread_cond_wait(&queue.not_full, &queue.lock);
+        queue.fds[(queue.head + queue.count) % QUEUE_LENGTH] = fd;
+        queue.count += 1;
+        pthread_cond_signal(&queue.not_empty);
+        pthread_mutex_unlock(&queue.lock);
+    }
+}
+
+int compile_remote(const char *socket_path, const vslc_options_t *options,
+                   const char *interfaces, size_t interfaces_length,
+                   const char *source, size_t length,
+                   vslc_result_t *result) {
+    struct sockaddr_un address;
+    *result = (vslc_result_t){0};
+    int fd = open_socket(socket_path, &address);
+    if (fd < 0)
+        return EXIT_FAILURE;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror(socket_path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    request_header_t request = {.interface_length = interfaces_length,
+                                .source_length = length};
+    pack_options(options, &request);
+    response_header_t response;
+    int status = EXIT_FAILURE;
+    if (write_all(fd, &request, sizeof(request)) ||
+        write_all(fd, interfaces, interfaces_length) ||
+        write_all(fd, source, length) ||
+        read_all(fd, &response, sizeof(response))) {
+        fprintf(stderr, "%s: lost connection to compile server\n",
+                socket_path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    result->output_length = response.output_length;
+    result->diagnostics_length = response.diagnostics_length;
+    result->interface_length = response.interface_length;
+    result->output = malloc(response.output_length + 1);
+    result->diagnostics = malloc(response.diagnostics_length + 1);
+    result->interface = malloc(response.interface_length + 1);
+    if (!read_all(fd, result->output, result->output_length) &&
+        !read_all(fd, result->diagnostics, result->diagnostics_length) &&
+        !read_all(fd, result->interface, result->interface_length))
+        status = response.status;
+    else
+        fprintf(stderr, "%s: truncated response from compile server\n",
+                socket_path);
+    close(fd);
+    return status;
+}
+
+static void *worker(void *arg) {
+    const vslc_options_t *defaults = arg;
+    // One context per worker, reused for every request it serves
+    vslc_context_t *ctx = vslc_context_create(defaults);
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0)
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        int fd = queue.fds[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_LENGTH;
+        queue.count -= 1;
+        pthread_cond_signal(&queue.not_full);
+        pthread_mutex_unlock(&queue.lock);
+
+        serve_connection(ctx, defaults, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void serve_connection(vslc_context_t *ctx,
+                             const vslc_options_t *defaults, int fd) {
+    request_header_t request;
+    if (read_all(fd, &request, sizeof(request)) ||
+        request.interface_length > MAX_REQUEST_LENGTH ||
+        request.source_length > MAX_REQUEST_LENGTH)
+        return;
+
+    char *interfaces = malloc(request.interface_length + 1);
+    char *source = malloc(request.source_length + 1);
+    if (!read_all(fd, interfaces, request.interface_length) &&
+        !read_all(fd, source, request.source_length)) {
+        // The cache belongs to the server, not to its clients
+        vslc_options_t options = unpack_options(&request);
+        options.cache_directory = defaults->cache_directory;
+        options.cache_limit = defaults->cache_limit;
+        vslc_result_t result;
+        vslc_set_options(ctx, &options);
+        vslc_forget_interfaces(ctx);
+
+        response_header_t response = {.status = EXIT_FAILURE};
+        if (vslc_import_interface(ctx, interfaces, request.interface_length))
+            result = (vslc_result_t){
+                .diagnostics = strdup("malformed interface summary\n"),
+                .diagnostics_length = strlen("malformed interface summary\n")};
+        else
+            response.status =
+                vslc_compile(ctx, source, request.source_length, &result);
+
+        response.output_length = result.output_length;
+        response.diagnostics_length = result.diagnostics_length;
+        response.interface_length = result.interface_length;
+        if (!write_all(fd, &response, sizeof(response)) &&
+            !write_all(fd, result.output, result.output_length) &&
+            !write_all(fd, result.diagnostics, result.diagnostics_length))
+            write_all(fd, result.interface, result.interface_length);
+        vslc_result_free(&result);
+    }
+    free(interfaces);
+    free(source);
+}
+
+static int open_socket(const char *socket_path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "%s: socket path is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(address->sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        perror("socket");
+    return fd;
+}
+
+static void pack_options(const vslc_options_t *options,
+                         request_header_t *request) {
+    request->threads = (options->threads > 1) ? options->threads : 1;
+    request->options =
+        options->print_full_tree << 0 | options->print_simplified_tree << 1 |
+        options->print_symbol_table << 2 | options->generate_program << 3 |
+        options->new_print_style << 4 | options->library_unit << 5 |
+        options->share_expressions << 6 | options->export_interface << 7 |
+        options->object_code << 8 | options->freestanding << 9 |
+        options->print_ir << 10 | options->optimize << 11 |
+        options->report_passes << 12;
+}
+
+static vslc_options_t unpack_options(const request_header_t *request) {
+    uint32_t bits = request->options;
+    uint32_t threads = request->threads;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    return (vslc_options_t){.threads = (threads > 1) ? (int)threads : 1,
+                            .print_full_tree = bits & 1 << 0,
+                            .print_simplified_tree = bits & 1 << 1,
+                            .print_symbol_table = bits & 1 << 2,
+                            .generate_program = bits & 1 << 3,
+                            .new_print_style = bits & 1 << 4,
+                            .library_unit = bits & 1 << 5,
+                            .share_expressions = bits & 1 << 6,
+                            .export_interface = bits & 1 << 7,
+                            .object_code = bits & 1 << 8,
+                            .freestanding = bits & 1 << 9,
+                            .print_ir = bits & 1 << 10,
+                            .optimize = bits & 1 << 11,
+                            .report_passes = bits & 1 << 12};
+}
+
+/* Transfer whole buffers, returns nonzero if the connection failed */
+static int read_all(int fd, void *buffer, size_t length) {
+    char *position = buffer;
+    while (length > 0) {
+        ssize_t n = read(fd, position, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        position += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t length) {
+    const char *position = buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, position, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        position += n;
+        length -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,945 @@
+#include <vslc.h>
+
+/* SSA form of three-address code, with phis placed on the dominance
+ * frontiers of the assignments to each variable [Cytron et al. 1991], and
+ * sparse conditional constant propagation over it [Wegman and Zadeck 1991].
+ * Values are only replaced by constants, never by other values, so the
+ * values of one variable are never live at the same time, and can share
+ * its stack slot when the form is left.
+ */
+
+#define NONE SIZE_MAX
+
+/* Lists of blocks for each block are kept in one array per kind, from the
+ * index in first_ of the block to that of the next
+ */
+typedef struct {
+    size_t *order;    // Blocks in reverse postorder
+    size_t *position; // Of each block in that order
+    size_t *idom;     // Immediate dominator of each block
+    size_t *first_child, *children;
+    size_t *first_frontier, *frontiers;
+} dominance_t;
+
+typedef enum { UNKNOWN, CONSTANT, VARYING } level_t;
+
+typedef struct {
+    level_t level;
+    int64_t constant;
+} lattice_t;
+
+/* State of constant propagation, with the uses of each value listed */
+typedef struct {
+    tac_function_t *code;
+    lattice_t *values;
+    bool *reached;   // Blocks found to execute
+    bool *taken;     // Edges found to execute, two per block
+    size_t *first_use, *use_blocks, *use_indices;
+    size_t *blocks_to_visit, n_blocks_to_visit;
+    size_t *values_to_visit, n_values_to_visit;
+} propagation_t;
+
+static void find_dominance(tac_function_t *code, dominance_t *d);
+static void free_dominance(dominance_t *d);
+static void place_phis(tac_function_t *code, dominance_t *d,
+                       size_t n_variables);
+static void rename_values(tac_function_t *code, dominance_t *d,
+                          size_t n_variables);
+static void visit(propagation_t *p, size_t b, size_t i);
+static void remove_dead_code(tac_function_t *code, bool *dead,
+                             size_t *first_instruction);
+
+static bool is_variable(tac_function_t *code, tac_operand_t *op,
+                        size_t n_variables) {
+    return op->kind == TAC_VALUE && (size_t)op->number < n_variables &&
+           code->variables[op->number] != NULL;
+}
+
+static bool is_phi(tac_block_t *block, size_t i) {
+    return i < block->n_instructions &&
+           block->instructions[i].opcode == TAC_PHI;
+}
+
+/* Every assignment to a parameter or local makes a new value of it */
+void construct_ssa(tac_function_t *code) {
+    dominance_t d;
+    size_t n_variables = code->n_values;
+    find_dominance(code, &d);
+    place_phis(code, &d, n_variables);
+    rename_values(code, &d, n_variables);
+    free_dominance(&d);
+}
+
+/* Values found to be constant are replaced by the constant, and branches
+ * found to go one way by a jump. The blocks never reached, and the
+ * instructions whose results are no longer used, are removed.
+ */
+void propagate_constants(tac_function_t *code, tac_statistics_t *stats) {
+    size_t n_blocks = code->n_blocks, n_values = code->n_values;
+    propagation_t p = {
+        .code = code,
+        .values = calloc(n_values, sizeof(lattice_t)),
+        .reached = calloc(n_blocks, sizeof(bool)),
+        .taken = calloc(2 * n_blocks, sizeof(bool)),
+        .first_use = calloc(n_values + 1, sizeof(size_t)),
+        .blocks_to_visit = malloc(2 * n_blocks * sizeof(size_t)),
+        // A value is lowered at most twice, to a constant and to varying
+        .values_to_visit = malloc(2 * n_values * sizeof(size_t)),
+    };
+
+    // Values without an assignment come into the function
+    size_t n_instructions = 0, n_uses = 0;
+    bool *assigned = calloc(n_values, sizeof(bool));
+    for (size_t b = 0; b < n_blocks; b++)
+        for (size_t i = 0; i < code->blocks[b].n_instructions; i++) {
+            tac_instruction_t *instruction = &code->blocks[b].instructions[i];
+            tac_operand_t *arguments =
+                &code->arguments[instruction->first_argument];
+            if (instruction->result.kind == TAC_VALUE)
+                assigned[instruction->result.number] = true;
+            if (instruction->left.kind == TAC_VALUE)
+                p.first_use[instruction->left.number + 1] += 1;
+            if (instruction->right.kind == TAC_VALUE)
+                p.first_use[instruction->right.number + 1] += 1;
+            for (size_t a = 0; a < instruction->n_arguments; a++)
+                if (arguments[a].kind == TAC_VALUE)
+                    p.first_use[arguments[a].number + 1] += 1;
+            n_instructions += 1;
+        }
+    for (size_t v = 0; v < n_values; v++) {
+        if (!assigned[v])
+            p.values[v].level = VARYING;
+        p.first_use[v + 1] += p.first_use[v];
+    }
+    free(assigned);
+
+    n_uses = p.first_use[n_values];
+    p.use_blocks = malloc((n_uses + 1) * sizeof(size_t));
+    p.use_indices = malloc((n_uses + 1) * sizeof(size_t));
+    size_t *filled = calloc(n_values, sizeof(size_t));
+    for (size_t b = 0; b < n_blocks; b++)
+        for (size_t i = 0; i < code->blocks[b].n_instructions; i++) {
+            tac_instruction_t *instruction = &code->blocks[b].instructions[i];
+            tac_operand_t *operands[2] = {&instruction->left,
+                                          &instruction->right};
+            for (size_t a = 0; a < 2 + instruction->n_arguments; a++) {
+                tac_operand_t *op =
+                    a < 2 ? operands[a]
+                          : &code->arguments[instruction->first_argument +
+                                             a - 2];
+                if (op->kind != TAC_VALUE)
+                    continue;
+                size_t use = p.first_use[op->number] + filled[op->number]++;
+                p.use_blocks[use] = b;
+                p.use_indices[use] = i;
+            }
+        }
+    free(filled);
+
+    p.reached[0] = true;
+    for (size_t i = 0; i < code->blocks[0].n_instructions; i++)
+        visit(&p, 0, i);
+    while (p.n_blocks_to_visit > 0 || p.n_values_to_visit > 0) {
+        if (p.n_blocks_to_visit > 0) {
+            // Phis merge one more edge, and the rest runs once
+            size_t b = p.blocks_to_visit[--p.n_blocks_to_visit];
+            tac_block_t *block = &code->blocks[b];
+            size_t i = 0;
+            for (; is_phi(block, i); i++)
+                visit(&p, b, i);
+            if (!p.reached[b]) {
+                p.reached[b] = true;
+                for (; i < block->n_instructions; i++)
+                    visit(&p, b, i);
+            }
+        } else {
+            size_t v = p.values_to_visit[--p.n_values_to_visit];
+            for (size_t u = p.first_use[v]; u < p.first_use[v + 1]; u++)
+                if (p.reached[p.use_blocks[u]])
+                    visit(&p, p.use_blocks[u], p.use_indices[u]);
+        }
+    }
+
+    /* Constants replace the values, and phis keep the arguments of edges
+     * that are taken, before branches that go one way become jumps
+     */
+    size_t n_before = 0, n_branches = 0;
+    size_t *first_instruction = malloc((n_blocks + 1) * sizeof(size_t));
+    bool *dead = calloc(n_instructions + 1, sizeof(bool));
+    first_instruction[0] = 0;
+    for (size_t b = 0; b < n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        first_instruction[b + 1] = first_instruction[b] + block->n_instructions;
+        for (size_t i = 0; i < block->n_instructions; i++) {
+            tac_instruction_t *instruction = &block->instructions[i];
+            n_before += instruction->opcode != TAC_PHI;
+            n_branches += instruction->opcode == TAC_BRANCH;
+            if (!p.reached[b]) {
+                dead[first_instruction[b] + i] = true;
+                continue;
+            }
+            tac_operand_t *arguments =
+                &code->arguments[instruction->first_argument];
+            tac_operand_t *operands[2] = {&instruction->left,
+                                          &instruction->right};
+            size_t n_kept = 0;
+            for (size_t a = 0; a < 2 + instruction->n_arguments; a++) {
+                tac_operand_t *op = a < 2 ? operands[a] : &arguments[a - 2];
+                if (a >= 2 && instruction->opcode == TAC_PHI) {
+                    size_t from = code->predecessors[block->first_predecessor +
+                                                     a - 2];
+                    tac_block_t *predecessor = &code->blocks[from];
+                    bool taken = false;
+                    for (size_t s = 0; s < predecessor->n_successors; s++)
+                        taken |= predecessor->successors[s] == b &&
+                                 p.taken[2 * from + s];
+                    if (!taken)
+                        continue;
+                    arguments[n_kept++] = *op;
+                    op = &arguments[n_kept - 1];
+                }
+                if (op->kind == TAC_VALUE &&
+                    p.values[op->number].level == CONSTANT)
+                    *op = (tac_operand_t){
+                        .kind = TAC_CONSTANT,
+                        .number = p.values[op->number].constant};
+            }
+            if (instruction->opcode == TAC_PHI)
+                instruction->n_arguments = n_kept;
+            // Calls are made for their effects, whatever they return
+            if (instruction->result.kind == TAC_VALUE &&
+                instruction->opcode != TAC_CALL &&
+                p.values[instruction->result.number].level == CONSTANT)
+                dead[first_instruction[b] + i] = true;
+        }
+    }
+    for (size_t b = 0; b < n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        if (!p.reached[b] || block->n_successors < 2 ||
+            (p.taken[2 * b] && p.taken[2 * b + 1]))
+            continue;
+        tac_instruction_t *branch =
+            &block->instructions[block->n_instructions - 1];
+        *branch = (tac_instruction_t){.opcode = TAC_JUMP};
+        block->successors[0] = block->successors[p.taken[2 * b] ? 0 : 1];
+        block->n_successors = 1;
+    }
+    remove_dead_code(code, dead, first_instruction);
+
+    // Unreached blocks are unreachable once the branches are jumps
+    tac_remove_unreachable_blocks(code);
+    tac_find_predecessors(code);
+    size_t n_after = 0;
+    for (size_t b = 0; b < code->n_blocks; b++)
+        for (size_t i = 0; i < code->blocks[b].n_instructions; i++) {
+            tac_instruction_t *instruction = &code->blocks[b].instructions[i];
+            n_after += instruction->opcode != TAC_PHI;
+            n_branches -= instruction->opcode == TAC_BRANCH;
+        }
+    stats->instructions_removed += n_before - n_after;
+    stats->branches_removed += n_branches;
+
+    free(dead);
+    free(first_instruction);
+    free(p.values);
+    free(p.reached);
+    free(p.taken);
+    free(p.first_use);
+    free(p.use_blocks);
+    free(p.use_indices);
+    free(p.blocks_to_visit);
+    free(p.values_to_visit);
+}
+
+/* The blocks of the uses of each value, lowest and highest, counting phi
+ * arguments as used in the block of the phi
+ */
+static void find_use_blocks(tac_function_t *code, size_t *lowest,
+                            size_t *highest) {
+    for (size_t v = 0; v < code->n_values; v++) {
+        lowest[v] = NONE;
+        highest[v] = 0;
+    }
+    for (size_t b = 0; b < code->n_blocks; b++)
+        for (size_t i = 0; i < code->blocks[b].n_instructions; i++) {
+            tac_instruction_t *instruction = &code->blocks[b].instructions[i];
+            tac_operand_t *operands[2] = {&instruction->left,
+                                          &instruction->right};
+            for (size_t a = 0; a < 2 + instruction->n_arguments; a++) {
+                tac_operand_t *op =
+                    a < 2 ? operands[a]
+                          : &code->arguments[instruction->first_argument +
+                                             a - 2];
+                if (op->kind != TAC_VALUE)
+                    continue;
+                if (lowest[op->number] == NONE)
+                    lowest[op->number] = b;
+                highest[op->number] = b;
+            }
+        }
+}
+
+/* Whether the moves to the phis of a block can be made before the branch
+ * of a predecessor after it, which is the end of a rotated loop. The
+ * results must not be tested by the branch, nor used out of the blocks
+ * from the phis to the branch, where the loop is laid out, as the way out
+ * of it is only entered from its end.
+ */
+static bool before_branch(tac_function_t *code, size_t b, size_t from,
+                          size_t n_phis, size_t *lowest, size_t *highest) {
+    if (from < b)
+        return false;
+    tac_block_t *block = &code->blocks[from];
+    tac_instruction_t *branch = &block->instructions[block->n_instructions - 1];
+    for (size_t k = 0; k < n_phis; k++) {
+        tac_operand_t *result = &code->blocks[b].instructions[k].result;
+        size_t v = result->number;
+        if ((branch->left.kind == TAC_VALUE &&
+             (size_t)branch->left.number == v) ||
+            (branch->right.kind == TAC_VALUE &&
+             (size_t)branch->right.number == v) ||
+            (lowest[v] != NONE && (lowest[v] < b || highest[v] > from)))
+            return false;
+    }
+    return true;
+}
+
+/* Phis become moves at the end of the predecessors. An edge from a block
+ * that branches is split by a block of its own, laid out after that block,
+ * so the moves are only made on the way to the phis, unless they can be
+ * made before the branch.
+ */
+void destruct_ssa(tac_function_t *code) {
+    size_t n_blocks = code->n_blocks;
+    size_t *lowest = malloc(code->n_values * sizeof(size_t));
+    size_t *highest = malloc(code->n_values * sizeof(size_t));
+    find_use_blocks(code, lowest, highest);
+    for (size_t b = 0; b < n_blocks; b++) {
+        size_t n_phis = 0;
+        while (is_phi(&code->blocks[b], n_phis))
+            n_phis += 1;
+        if (n_phis == 0)
+            continue;
+
+        for (size_t j = 0; j < code->blocks[b].n_predecessors; j++) {
+            size_t from =
+                code->predecessors[code->blocks[b].first_predecessor + j];
+            size_t into = from;
+            if (code->blocks[from].n_successors > 1 &&
+                !before_branch(code, b, from, n_phis, lowest, highest)) {
+                into = tac_new_block(code);
+                tac_block_t *split = &code->blocks[into];
+                tac_insert(split, 0)->opcode = TAC_JUMP;
+                split->successors[0] = b;
+                split->n_successors = 1;
+                size_t *successors = code->blocks[from].successors;
+                successors[successors[0] == b ? 0 : 1] = into;
+            }
+            for (size_t k = 0; k < n_phis; k++) {
+                tac_instruction_t phi = code->blocks[b].instructions[k];
+                tac_operand_t argument =
+                    code->arguments[phi.first_argument + j];
+                if (argument.kind == TAC_VALUE &&
+                    argument.number == phi.result.number)
+                    continue;
+                tac_block_t *block = &code->blocks[into];
+                tac_instruction_t *move =
+                    tac_insert(block, block->n_instructions - 1);
+                move->opcode = TAC_MOVE;
+                move->result = phi.result;
+                move->left = argument;
+            }
+        }
+
+        tac_block_t *block = &code->blocks[b];
+        block->n_instructions -= n_phis;
+        memmove(block->instructions, &block->instructions[n_phis],
+                block->n_instructions * sizeof(tac_instruction_t));
+    }
+    free(lowest);
+    free(highest);
+
+    // The block split from an edge to the next block goes last, to fall
+    // into it
+    size_t *number = code->block_numbers, n_placed = 0;
+    for (size_t b = 0; b < n_blocks; b++) {
+        number[b] = n_placed++;
+        for (int next = 0; next < 2; next++)
+            for (size_t s = 0; s < code->blocks[b].n_successors; s++) {
+                size_t split = code->blocks[b].successors[s];
+                if (split >= n_blocks &&
+                    (code->blocks[split].successors[0] == b + 1) == next)
+                    number[split] = n_placed++;
+            }
+    }
+    tac_move_blocks(code, number);
+    tac_find_predecessors(code);
+}
+
+/* Dominators by the iterative algorithm of Cooper, Harvey and Kennedy */
+
+static size_t intersect(dominance_t *d, size_t a, size_t b) {
+    while (a != b) {
+        while (d->position[a] > d->position[b])
+            a = d->idom[a];
+        while (d->position[b] > d->position[a])
+            b = d->idom[b];
+    }
+    return a;
+}
+
+/* All blocks are reachable from the entry, when they are made */
+static void find_order(tac_function_t *code, dominance_t *d) {
+    size_t n_blocks = code->n_blocks, depth = 0, n_left = n_blocks;
+    size_t *stack = malloc(n_blocks * sizeof(size_t));
+    size_t *next = calloc(n_blocks, sizeof(size_t));
+    for (size_t b = 0; b < n_blocks; b++)
+        d->position[b] = NONE;
+    d->position[0] = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        size_t b = stack[depth - 1];
+        tac_block_t *block = &code->blocks[b];
+        if (next[b] == block->n_successors) {
+            d->order[--n_left] = b;
+            depth -= 1;
+            continue;
+        }
+        size_t successor = block->successors[next[b]++];
+        if (d->position[successor] == NONE) {
+            d->position[successor] = 0;
+            stack[depth++] = successor;
+        }
+    }
+    for (size_t i = 0; i < n_blocks; i++)
+        d->position[d->order[i]] = i;
+    free(stack);
+    free(next);
+}
+
+static void find_dominance(tac_function_t *code, dominance_t *d) {
+    size_t n_blocks = code->n_blocks;
+    d->order = malloc(n_blocks * sizeof(size_t));
+    d->position = malloc(n_blocks * sizeof(size_t));
+    d->idom = malloc(n_blocks * sizeof(size_t));
+    d->first_child = calloc(n_blocks + 1, sizeof(size_t));
+    d->children = malloc(n_blocks * sizeof(size_t));
+    d->first_frontier = calloc(n_blocks + 1, sizeof(size_t));
+    find_order(code, d);
+
+    for (size_t b = 0; b < n_blocks; b++)
+        d->idom[b] = NONE;
+    d->idom[0] = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 1; i < n_blocks; i++) {
+            size_t b = d->order[i], idom = NONE;
+            tac_block_t *block = &code->blocks[b];
+            for (size_t j = 0; j < block->n_predecessors; j++) {
+                size_t from = code->predecessors[block->first_predecessor + j];
+                if (d->idom[from] != NONE)
+                    idom = idom == NONE ? from : intersect(d, from, idom);
+            }
+            if (d->idom[b] != idom) {
+                d->idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t b = 1; b < n_blocks; b++)
+        d->first_child[d->idom[b] + 1] += 1;
+    for (size_t b = 0; b < n_blocks; b++)
+        d->first_child[b + 1] += d->first_child[b];
+    size_t *filled = calloc(n_blocks, sizeof(size_t));
+    for (size_t b = 1; b < n_blocks; b++)
+        d->children[d->first_child[d->idom[b]] + filled[d->idom[b]]++] = b;
+
+    /* The frontier of a block holds the joins it reaches without
+     * dominating them, found by walking up from their predecessors. The
+     * lists are counted on the first walk, and filled on the second.
+     */
+    size_t *mark = malloc(n_blocks * sizeof(size_t));
+    d->frontiers = NULL;
+    for (int walk = 0; walk < 2; walk++) {
+        for (size_t b = 0; b < n_blocks; b++) {
+            mark[b] = NONE;
+            filled[b] = 0;
+        }
+        for (size_t b = 0; b < n_blocks; b++) {
+            tac_block_t *block = &code->blocks[b];
+            if (block->n_predecessors < 2)
+                continue;
+            for (size_t j = 0; j < block->n_predecessors; j++)
+                for (size_t runner =
+                         code->predecessors[block->first_predecessor + j];
+                     runner != d->idom[b]; runner = d->idom[runner]) {
+                    if (mark[runner] == b)
+                        continue;
+                    mark[runner] = b;
+                    if (walk == 0)
+                        d->first_frontier[runner + 1] += 1;
+                    else
+                        d->frontiers[d->first_frontier[runner] +
+                                     filled[runner]++] = b;
+                }
+        }
+        if (walk == 0) {
+            for (size_t b = 0; b < n_blocks; b++)
+                d->first_frontier[b + 1] += d->first_frontier[b];
+            d->frontiers =
+                malloc((d->first_frontier[n_blocks] + 1) * sizeof(size_t));
+        }
+    }
+    free(mark);
+    free(filled);
+}
+
+static void free_dominance(dominance_t *d) {
+    free(d->order);
+    free(d->position);
+    free(d->idom);
+    free(d->first_child);
+    free(d->children);
+    free(d->first_frontier);
+    free(d->frontiers);
+}
+
+/* A variable needs a phi on the frontiers of the blocks assigning it, and
+ * on the frontiers of the blocks given phis, in turn
+ */
+static void place_phis(tac_function_t *code, dominance_t *d,
+                       size_t n_variables) {
+    size_t n_blocks = code->n_blocks;
+    size_t *first_assignment = calloc(n_variables + 1, sizeof(size_t));
+    size_t *last = malloc(n_variables * sizeof(size_t));
+    size_t *assignments = NULL;
+    for (int walk = 0; walk < 2; walk++) {
+        for (size_t v = 0; v < n_variables; v++)
+            last[v] = NONE;
+        for (size_t b = 0; b < n_blocks; b++)
+            for (size_t i = 0; i < code->blocks[b].n_instructions; i++) {
+                tac_operand_t *result = &code->blocks[b].instructions[i].result;
+                if (!is_variable(code, result, n_variables) ||
+                    last[result->number] == b)
+                    continue;
+                last[result->number] = b;
+                if (walk == 0)
+                    first_assignment[result->number + 1] += 1;
+                else
+                    assignments[first_assignment[result->number]++] = b;
+            }
+        if (walk == 0) {
+            for (size_t v = 0; v < n_variables; v++)
+                first_assignment[v + 1] += first_assignment[v];
+            assignments = malloc((first_assignment[n_variables] + 1) *
+                                 sizeof(size_t));
+        } else {
+            // The filling moved each start to the next
+            memmove(&first_assignment[1], first_assignment,
+                    n_variables * sizeof(size_t));
+            first_assignment[0] = 0;
+        }
+    }
+
+    size_t *has_phi = malloc(n_blocks * sizeof(size_t));
+    size_t *queued = malloc(n_blocks * sizeof(size_t));
+    size_t *work = malloc(n_blocks * sizeof(size_t));
+    size_t *n_phis = calloc(n_blocks, sizeof(size_t));
+    for (size_t b = 0; b < n_blocks; b++)
+        has_phi[b] = queued[b] = NONE;
+    for (size_t v = 0; v < n_variables; v++) {
+        size_t n_work = 0;
+        for (size_t a = first_assignment[v]; a < first_assignment[v + 1];
+             a++) {
+            queued[assignments[a]] = v;
+            work[n_work++] = assignments[a];
+        }
+        while (n_work > 0) {
+            size_t b = work[--n_work];
+            for (size_t f = d->first_frontier[b]; f < d->first_frontier[b + 1];
+                 f++) {
+                size_t join = d->frontiers[f];
+                if (has_phi[join] == v)
+                    continue;
+                has_phi[join] = v;
+                tac_block_t *block = &code->blocks[join];
+                tac_instruction_t *phi = tac_insert(block, n_phis[join]++);
+                phi->opcode = TAC_PHI;
+                phi->result = (tac_operand_t){.kind = TAC_VALUE, .number = v};
+                phi->n_arguments = block->n_predecessors;
+                phi->first_argument =
+                    tac_add_arguments(code, block->n_predecessors);
+                for (size_t j = 0; j < block->n_predecessors; j++)
+                    code->arguments[phi->first_argument + j] = phi->result;
+                if (queued[join] != v) {
+                    queued[join] = v;
+                    work[n_work++] = join;
+                }
+            }
+        }
+    }
+    free(first_assignment);
+    free(last);
+    free(assignments);
+    free(has_phi);
+    free(queued);
+    free(work);
+    free(n_phis);
+}
+
+static void rename_use(tac_function_t *code, tac_operand_t *op,
+                       size_t *current, size_t n_variables) {
+    if (is_variable(code, op, n_variables))
+        op->number = current[op->number];
+}
+
+/* Each use of a variable is given the value assigned last on the way down
+ * the dominator tree, which is undone on the way back up
+ */
+static void rename_values(tac_function_t *code, dominance_t *d,
+                          size_t n_variables) {
+    size_t n_blocks = code->n_blocks, n_assignments = 0;
+    for (size_t b = 0; b < n_blocks; b++)
+        n_assignments += code->blocks[b].n_instructions;
+    size_t *current = malloc((n_variables + 1) * sizeof(size_t));
+    size_t *replaced = malloc((n_assignments + 1) * sizeof(size_t));
+    size_t *replaced_value = malloc((n_assignments + 1) * sizeof(size_t));
+    size_t *n_before = malloc(n_blocks * sizeof(size_t));
+    size_t *stack = malloc(2 * n_blocks * sizeof(size_t));
+    size_t n_replaced = 0, depth = 0;
+    for (size_t v = 0; v < n_variables; v++)
+        current[v] = v;
+
+    // Even entries enter a block, odd ones leave it
+    stack[depth++] = 0;
+    while (depth > 0) {
+        size_t b = stack[--depth] / 2;
+        if (stack[depth] & 1) {
+            while (n_replaced > n_before[b]) {
+                n_replaced -= 1;
+                current[replaced[n_replaced]] = replaced_value[n_replaced];
+            }
+            continue;
+        }
+        n_before[b] = n_replaced;
+        stack[depth++] = 2 * b + 1;
+        for (size_t c = d->first_child[b + 1]; c > d->first_child[b]; c--)
+            stack[depth++] = 2 * d->children[c - 1];
+
+        tac_block_t *block = &code->blocks[b];
+        for (size_t i = 0; i < block->n_instructions; i++) {
+            tac_instruction_t *instruction = &block->instructions[i];
+            if (instruction->opcode != TAC_PHI) {
+                rename_use(code, &instruction->left, current, n_variables);
+                rename_use(code, &instruction->right, current, n_variables);
+                for (size_t a = 0; a < instruction->n_arguments; a++)
+                    rename_use(
+                        code,
+                        &code->arguments[instruction->first_argument + a],
+                        current, n_variables);
+            }
+            tac_operand_t *result = &instruction->result;
+            if (!is_variable(code, result, n_variables))
+                continue;
+            replaced[n_replaced] = result->number;
+            replaced_value[n_replaced++] = current[result->number];
+            symbol_t *variable = code->variables[result->number];
+            current[result->number] = tac_new_value(code, variable);
+            result->number = current[result->number];
+        }
+
+        for (size_t s = 0; s < block->n_successors; s++) {
+            tac_block_t *successor = &code->blocks[block->successors[s]];
+            for (size_t j = 0; j < successor->n_predecessors; j++) {
+                if (code->predecessors[successor->first_predecessor + j] != b)
+                    continue;
+                for (size_t i = 0; is_phi(successor, i); i++)
+                    rename_use(code,
+                               &code->arguments[successor->instructions[i]
+                                                    .first_argument +
+                                                j],
+                               current, n_variables);
+            }
+        }
+    }
+    free(current);
+    free(replaced);
+    free(replaced_value);
+    free(n_before);
+    free(stack);
+}
+
+/* Constant propagation */
+
+static lattice_t meet(lattice_t a, lattice_t b) {
+    if (a.level == UNKNOWN)
+        return b;
+    if (b.level == UNKNOWN)
+        return a;
+    if (a.level == CONSTANT && b.level == CONSTANT &&
+        a.constant == b.constant)
+        return a;
+    return (lattice_t){.level = VARYING};
+}
+
+static lattice_t operand_lattice(propagation_t *p, tac_operand_t *op) {
+    switch (op->kind) {
+    case TAC_CONSTANT:
+        return (lattice_t){.level = CONSTANT, .constant = op->number};
+    case TAC_VALUE:
+        return p->values[op->number];
+    default:
+        return (lattice_t){.level = VARYING};
+    }
+}
+
+/* Arithmetic wraps around as the instructions do, and a division that
+ * would trap is left to trap when the program runs
+ */
+static lattice_t fold(tac_opcode_t opcode, lattice_t left, lattice_t right) {
+    // Multiplying by 0, and masking all bits off or on, needs one operand
+    lattice_t operands[2] = {left, right};
+    for (int o = 0; o < 2; o++) {
+        if (operands[o].level != CONSTANT)
+            continue;
+        if ((opcode == TAC_MULTIPLY || opcode == TAC_AND) &&
+            operands[o].constant == 0)
+            return (lattice_t){.level = CONSTANT, .constant = 0};
+        if (opcode == TAC_OR && operands[o].constant == -1)
+            return (lattice_t){.level = CONSTANT, .constant = -1};
+    }
+    if (left.level == VARYING || right.level == VARYING)
+        return (lattice_t){.level = VARYING};
+    if (left.level == UNKNOWN || right.level == UNKNOWN)
+        return (lattice_t){.level = UNKNOWN};
+    uint64_t a = left.constant, b = right.constant;
+    lattice_t result = {.level = CONSTANT};
+    switch (opcode) {
+    case TAC_NEGATE:
+        result.constant = -a;
+        break;
+    case TAC_NOT:
+        result.constant = ~a;
+        break;
+    case TAC_ADD:
+        result.constant = a + b;
+        break;
+    case TAC_SUBTRACT:
+        result.constant = a - b;
+        break;
+    case TAC_MULTIPLY:
+        result.constant = a * b;
+        break;
+    case TAC_DIVIDE:
+        if (right.constant == 0 ||
+            (right.constant == -1 && left.constant == INT64_MIN))
+            return (lattice_t){.level = VARYING};
+        result.constant = left.constant / right.constant;
+        break;
+    case TAC_OR:
+        result.constant = a | b;
+        break;
+    case TAC_XOR:
+        result.constant = a ^ b;
+        break;
+    case TAC_AND:
+        result.constant = a & b;
+        break;
+    default:
+        return (lattice_t){.level = VARYING};
+    }
+    return result;
+}
+
+static void take_edge(propagation_t *p, size_t b, size_t s) {
+    if (p->taken[2 * b + s])
+        return;
+    p->taken[2 * b + s] = true;
+    p->blocks_to_visit[p->n_blocks_to_visit++] =
+        p->code->blocks[b].successors[s];
+}
+
+static bool holds(tac_relation_t relation, int64_t left, int64_t right) {
+    switch (relation) {
+    case TAC_LESS:
+        return left < right;
+    case TAC_GREATER:
+        return left > right;
+    default:
+        return left == right;
+    }
+}
+
+/* Evaluate an instruction on what is known of its operands so far */
+static void visit(propagation_t *p, size_t b, size_t i) {
+    tac_function_t *code = p->code;
+    tac_block_t *block = &code->blocks[b];
+    tac_instruction_t *instruction = &block->instructions[i];
+    lattice_t left = operand_lattice(p, &instruction->left);
+    lattice_t right = operand_lattice(p, &instruction->right);
+    lattice_t result = {.level = VARYING};
+    switch (instruction->opcode) {
+    case TAC_PHI:
+        result.level = UNKNOWN;
+        for (size_t j = 0; j < block->n_predecessors; j++) {
+            size_t from = code->predecessors[block->first_predecessor + j];
+            tac_block_t *predecessor = &code->blocks[from];
+            for (size_t s = 0; s < predecessor->n_successors; s++)
+                if (predecessor->successors[s] == b &&
+                    p->taken[2 * from + s]) {
+                    result = meet(
+                        result,
+                        operand_lattice(
+                            p, &code->arguments[instruction->first_argument +
+                                                j]));
+                    break;
+                }
+        }
+        break;
+    case TAC_MOVE:
+        result = left;
+        break;
+    case TAC_NEGATE:
+    case TAC_NOT:
+        result = fold(instruction->opcode, left,
+                      (lattice_t){.level = CONSTANT});
+        break;
+    case TAC_ADD:
+    case TAC_SUBTRACT:
+    case TAC_MULTIPLY:
+    case TAC_DIVIDE:
+    case TAC_OR:
+    case TAC_XOR:
+    case TAC_AND:
+        result = fold(instruction->opcode, left, right);
+        break;
+    case TAC_JUMP:
+        take_edge(p, b, 0);
+        return;
+    case TAC_BRANCH:
+        if (left.level == UNKNOWN || right.level == UNKNOWN)
+            return;
+        if (left.level == CONSTANT && right.level == CONSTANT) {
+            take_edge(p, b,
+                      holds(instruction->relation, left.constant,
+                            right.constant)
+                          ? 0
+                          : 1);
+        } else {
+            take_edge(p, b, 0);
+            take_edge(p, b, 1);
+        }
+        return;
+    default:
+        break;
+    }
+
+    if (instruction->result.kind != TAC_VALUE)
+        return;
+    size_t v = instruction->result.number;
+    result = meet(p->values[v], result);
+    if (result.level != p->values[v].level) {
+        p->values[v] = result;
+        p->values_to_visit[p->n_values_to_visit++] = v;
+    }
+}
+
+/* Instructions that only compute a value are needed when it is used */
+static bool is_removable(tac_instruction_t *instruction) {
+    if (instruction->result.kind != TAC_VALUE)
+        return false;
+    switch (instruction->opcode) {
+    case TAC_MOVE:
+    case TAC_NEGATE:
+    case TAC_NOT:
+    case TAC_ADD:
+    case TAC_SUBTRACT:
+    case TAC_MULTIPLY:
+    case TAC_OR:
+    case TAC_XOR:
+    case TAC_AND:
+    case TAC_PHI:
+        return true;
+    case TAC_DIVIDE:
+        return instruction->right.kind == TAC_CONSTANT &&
+               instruction->right.number != 0 &&
+               instruction->right.number != -1;
+    default:
+        return false;
+    }
+}
+
+/* Keep the instructions with effects, and those computing the values they
+ * use, in turn, except the ones marked dead. Values that only feed each
+ * other around a loop go with the rest. Phis of a single predecessor become
+ * moves.
+ */
+static void remove_dead_code(tac_function_t *code, bool *dead,
+                             size_t *first_instruction) {
+    size_t n_values = code->n_values, n_blocks = code->n_blocks;
+    size_t n_instructions = first_instruction[n_blocks];
+    size_t *assigned_at = malloc((n_values + 1) * sizeof(size_t));
+    size_t *blocks = malloc((n_instructions + 1) * sizeof(size_t));
+    size_t *work = malloc((n_instructions + 1) * sizeof(size_t));
+    bool *needed = calloc(n_instructions + 1, sizeof(bool));
+    size_t n_work = 0;
+    for (size_t v = 0; v < n_values; v++)
+        assigned_at[v] = NONE;
+
+    for (size_t b = 0; b < n_blocks; b++)
+        for (size_t i = 0; i < code->blocks[b].n_instructions; i++) {
+            size_t id = first_instruction[b] + i;
+            tac_instruction_t *instruction = &code->blocks[b].instructions[i];
+            blocks[id] = b;
+            if (instruction->result.kind == TAC_VALUE)
+                assigned_at[instruction->result.number] = id;
+            if (!dead[id] && !is_removable(instruction)) {
+                needed[id] = true;
+                work[n_work++] = id;
+            }
+        }
+
+    while (n_work > 0) {
+        size_t id = work[--n_work];
+        tac_instruction_t *instruction =
+            &code->blocks[blocks[id]]
+                 .instructions[id - first_instruction[blocks[id]]];
+        tac_operand_t *operands[2] = {&instruction->left, &instruction->right};
+        for (size_t a = 0; a < 2 + instruction->n_arguments; a++) {
+            tac_operand_t *op =
+                a < 2 ? operands[a]
+                      : &code->arguments[instruction->first_argument + a - 2];
+            if (op->kind != TAC_VALUE)
+                continue;
+            size_t at = assigned_at[op->number];
+            if (at == NONE || needed[at] || dead[at])
+                continue;
+            needed[at] = true;
+            work[n_work++] = at;
+        }
+    }
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        size_t n_kept = 0;
+        for (size_t i = 0; i < block->n_instructions; i++) {
+            if (!needed[first_instruction[b] + i])
+                continue;
+            tac_instruction_t *instruction = &block->instructions[i];
+            if (instruction->opcode == TAC_PHI &&
+                instruction->n_arguments == 1) {
+                instruction->opcode = TAC_MOVE;
+                instruction->left =
+                    code->arguments[instruction->first_argument];
+                instruction->n_arguments = 0;
+            }
+            block->instructions[n_kept++] = *instruction;
+        }
+        block->n_instructions = n_kept;
+    }
+    free(assigned_at);
+    free(blocks);
+    free(work);
+    free(needed);
+}
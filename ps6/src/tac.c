@@ -0,0 +1,778 @@
+#include <vslc.h>
+
+/* Where lowering of a function has come to */
+typedef struct {
+    vslc_context_t *ctx;
+    tac_function_t *code;
+    size_t block;     // Where instructions are appended
+    bool in_loop;
+    size_t continues; // Last block ending in a continue of the innermost
+                      // loop, or NO_BLOCK. Its successor is the one before,
+                      // until the test they go to is made.
+} lowering_t;
+
+#define NO_BLOCK SIZE_MAX
+#define NO_VALUE SIZE_MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define ICE(MSG) compile_error(l->ctx, "internal compiler error: " MSG)
+
+static tac_instruction_t *append(lowering_t *l, tac_opcode_t opcode);
+static void jump(lowering_t *l, size_t target);
+static tac_operand_t value_operand(size_t value);
+static tac_operand_t constant_operand(int64_t constant);
+static tac_operand_t variable_operand(lowering_t *l, node_t *identifier);
+static tac_operand_t lower_expression(lowering_t *l, node_t *expr);
+static void lower_statement(lowering_t *l, node_t *node);
+static void lay_out_blocks(tac_function_t *code);
+static void print_operand(vslc_context_t *ctx, tac_function_t *code,
+                          tac_operand_t *op);
+
+static const char *opcode_names[] = {
+    [TAC_MOVE] = "move",         [TAC_NEGATE] = "neg",
+    [TAC_NOT] = "not",           [TAC_ADD] = "add",
+    [TAC_SUBTRACT] = "sub",      [TAC_MULTIPLY] = "mul",
+    [TAC_DIVIDE] = "div",        [TAC_OR] = "or",
+    [TAC_XOR] = "xor",           [TAC_AND] = "and",
+    [TAC_CALL] = "call",         [TAC_PRINT_INT] = "print_int",
+    [TAC_PRINT_TEXT] = "print_text", [TAC_PRINT_NEWLINE] = "print_newline",
+    [TAC_JUMP] = "jump",         [TAC_BRANCH] = "branch",
+    [TAC_RETURN] = "return",     [TAC_PHI] = "phi"};
+
+static const char *relation_names[] = {
+    [TAC_LESS] = "<", [TAC_GREATER] = ">", [TAC_EQUAL] = "="};
+
+/* Lower the bound tree of a function into blocks of three-address code. The
+ * operands of an instruction are evaluated in the order the tree generator
+ * evaluated them, so calls with side effects happen in the same order.
+ */
+void lower_function(vslc_context_t *ctx, symbol_t *function,
+                    tac_function_t *code) {
+    code->symbol = function;
+    code->n_blocks = code->n_values = code->n_arguments = 0;
+
+    // Parameters are the first values, in order
+    size_t n_locals = tlhash_size(function->locals);
+    symbol_t *locals[n_locals + 1];
+    tlhash_values(function->locals, (void **)&locals);
+    for (size_t p = 0; p < function->nparms; p++)
+        tac_new_value(code, NULL);
+    for (size_t v = 0; v < n_locals; v++)
+        if (locals[v]->type == SYM_PARAMETER)
+            code->variables[locals[v]->seq] = locals[v];
+
+    // Locals get their values as they are met, one per declaration
+    if (code->n_slots < function->nlocals) {
+        code->n_slots = function->nlocals;
+        code->slot_values =
+            realloc(code->slot_values, code->n_slots * sizeof(size_t));
+    }
+    for (size_t s = 0; s < function->nlocals; s++)
+        code->slot_values[s] = NO_VALUE;
+
+    lowering_t l = {.ctx = ctx,
+                    .code = code,
+                    .block = tac_new_block(code),
+                    .continues = NO_BLOCK};
+    lower_statement(&l, function->node);
+    // Falling off the end returns 0
+    append(&l, TAC_RETURN)->left = constant_operand(0);
+
+    tac_remove_unreachable_blocks(code);
+    lay_out_blocks(code);
+    tac_find_predecessors(code);
+}
+
+/* Print the code of a function in place of its assembly */
+void print_tac(vslc_context_t *ctx, tac_function_t *code) {
+    emit(ctx->code, "function %s(", code->symbol->name);
+    for (size_t p = 0; p < code->symbol->nparms; p++) {
+        emit_string(ctx->code, p > 0 ? ", " : "");
+        print_operand(ctx, code, &(tac_operand_t){TAC_VALUE, p, NULL});
+    }
+    emit_string(ctx->code, ")\n");
+
+    for (size_t b = 0; b < code->n_blocks; b++) {
+        tac_block_t *block = &code->blocks[b];
+        emit(ctx->code, "L%u:", b);
+        for (size_t p = 0; p < block->n_predecessors; p++)
+            emit(ctx->code, "%sL%u", p > 0 ? ", " : "\t// from ",
+                 code->predecessors[block->first_predecessor + p]);
+        emit_string(ctx->code, "\n");
+
+        for (size_t i = 0; i < block->n_instructions; i++) {
+            tac_instruction_t *instruction = &block->instructions[i];
+            emit_string(ctx->code, "\t");
+            if (instruction->result.kind != TAC_NONE) {
+                print_operand(ctx, code, &instruction->result);
+                emit_string(ctx->code, " = ");
+            }
+            emit_string(ctx->code, opcode_names[instruction->opcode]);
+            if (instruction->opcode == TAC_CALL ||
+                instruction->opcode == TAC_PHI) {
+                if (instruction->opcode == TAC_CALL)
+                    emit(ctx->code, " %s", instruction->function->name);
+                emit_string(ctx->code, "(");
+                for (size_t a = 0; a < instruction->n_arguments; a++) {
+                    emit_string(ctx->code, a > 0 ? ", " : "");
+                    print_operand(
+                        ctx, code,
+                        &code->arguments[instruction->first_argument + a]);
+                }
+                emit_string(ctx->code, ")");
+            }
+            if (instruction->left.kind != TAC_NONE) {
+                emit_string(ctx->code, " ");
+                print_operand(ctx, code, &instruction->left);
+            }
+            if (instruction->opcode == TAC_BRANCH)
+                emit(ctx->code, " %s", relation_names[instruction->relation]);
+            else if (instruction->right.kind != TAC_NONE)
+                emit_string(ctx->code, ",");
+            if (instruction->right.kind != TAC_NONE) {
+                emit_string(ctx->code, " ");
+                print_operand(ctx, code, &instruction->right);
+            }
+            for (size_t s = 0; s < block->n_successors &&
+                               i + 1 == block->n_instructions;
+                 s++)
+                emit(ctx->code, "%sL%u",
+                     s > 0 || instruction->opcode == TAC_BRANCH ? ", " : " ",
+                     block->successors[s]);
+            emit_string(ctx->code, "\n");
+        }
+    }
+    emit_string(ctx->code, "\n");
+}
+
+void tac_free(tac_function_t *code) {
+    for (size_t b = 0; b < code->block_capacity; b++)
+        free(code->blocks[b].instructions);
+    free(code->blocks);
+    free(code->variables);
+    free(code->arguments);
+    free(code->predecessors);
+    free(code->block_numbers);
+    free(code->slot_values);
+    free(code->locations);
+    *code = (tac_function_t){0};
+}
+
+/* Blocks that were lowered into before keep their instruction lists */
+size_t tac_new_block(tac_function_t *code) {
+    if (code->n_blocks == code->block_capacity) {
+        size_t capacity = code->block_capacity ? 2 * code->block_capacity : 16;
+        code->blocks = realloc(code->blocks, capacity * sizeof(tac_block_t));
+        for (size_t b = code->block_capacity; b < capacity; b++)
+            code->blocks[b] = (tac_block_t){0};
+        // Blocks have at most two successors, so the edges are at most
+        // twice as many
+        code->predecessors =
+            realloc(code->predecessors, 2 * capacity * sizeof(size_t));
+        code->block_numbers =
+            realloc(code->block_numbers, capacity * sizeof(size_t));
+        code->block_capacity = capacity;
+    }
+    tac_block_t *block = &code->blocks[code->n_blocks];
+    block->n_instructions = block->n_successors = 0;
+    block->n_predecessors = 0;
+    return code->n_blocks++;
+}
+
+size_t tac_new_value(tac_function_t *code, symbol_t *variable) {
+    if (code->n_values == code->value_capacity) {
+        code->value_capacity =
+            code->value_capacity ? 2 * code->value_capacity : 64;
+        code->variables = realloc(
+            code->variables, code->value_capacity * sizeof(symbol_t *));
+    }
+    code->variables[code->n_values] = variable;
+    return code->n_values++;
+}
+
+/* Room for the arguments of a call or phi, returns the index of the first */
+size_t tac_add_arguments(tac_function_t *code, size_t n_arguments) {
+    if (code->n_arguments + n_arguments > code->argument_capacity) {
+        while (code->n_arguments + n_arguments > code->argument_capacity)
+            code->argument_capacity =
+                code->argument_capacity ? 2 * code->argument_capacity : 64;
+        code->arguments = realloc(
+            code->arguments, code->argument_capacity * sizeof(tac_operand_t));
+    }
+    code->n_arguments += n_arguments;
+    return code->n_arguments - n_arguments;
+}
+
+/* Make room for an instruction before the one at the index, and return it */
+tac_instruction_t *tac_insert(tac_block_t *block, size_t index) {
+    if (block->n_instructions == block->capacity) {
+        block->capacity = block->capacity ? 2 * block->capacity : 8;
+        block->instructions = realloc(
+            block->instructions, block->capacity * sizeof(tac_instruction_t));
+    }
+    memmove(&block->instructions[index + 1], &block->instructions[index],
+            (block->n_instructions - index) * sizeof(tac_instruction_t));
+    block->n_instructions += 1;
+    block->instructions[index] = (tac_instruction_t){0};
+    return &block->instructions[index];
+}
+
+static tac_instruction_t *append(lowering_t *l, tac_opcode_t opcode) {
+    tac_block_t *block = &l->code->blocks[l->block];
+    tac_instruction_t *instruction = tac_insert(block, block->n_instructions);
+    instruction->opcode = opcode;
+    return instruction;
+}
+
+/* End the block lowered into with a jump to the target */
+static void jump(lowering_t *l, size_t target) {
+    append(l, TAC_JUMP);
+    tac_block_t *block = &l->code->blocks[l->block];
+    block->successors[0] = target;
+    block->n_successors = 1;
+}
+
+static tac_operand_t value_operand(size_t value) {
+    return (tac_operand_t){.kind = TAC_VALUE, .number = value};
+}
+
+static tac_operand_t constant_operand(int64_t constant) {
+    return (tac_operand_t){.kind = TAC_CONSTANT, .number = constant};
+}
+
+static tac_operand_t temporary(lowering_t *l) {
+    return value_operand(tac_new_value(l->code, NULL));
+}
+
+/* A local shares its stack slot with locals of disjoint blocks, but each
+ * declaration is a value of its own
+ */
+static tac_operand_t variable_operand(lowering_t *l, node_t *identifier) {
+    symbol_t *symbol = identifier->entry;
+    tac_function_t *code = l->code;
+    size_t *value;
+    switch (symbol->type) {
+    case SYM_GLOBAL_VAR:
+        return (tac_operand_t){.kind = TAC_GLOBAL, .global = symbol};
+    case SYM_PARAMETER:
+        return value_operand(symbol->seq);
+    case SYM_LOCAL_VAR:
+        value = &code->slot_values[symbol->seq];
+        if (*value == NO_VALUE || code->variables[*value] != symbol)
+            *value = tac_new_value(code, symbol);
+        return value_operand(*value);
+    default:
+        ICE("invalid identifier");
+        return value_operand(0);
+    }
+}
+
+/* Labels an expression with the number of values it keeps live at once
+ * while it is evaluated [Sethi and Ullman 1970], counting the reads of
+ * globals but not constants and locals, which are used where they are. The
+ * labels of the children are equal only if both are needed at once. Calls
+ * are labelled CALLS, as the order they are made in can not change.
+ */
+#define CALLS (SIZE_MAX - 1)
+
+static size_t registers_needed(node_t *expr) {
+    if (expr->registers != 0)
+        return expr->registers - 1;
+    size_t needed = 0;
+    switch (expr->type) {
+    case IDENTIFIER_DATA:
+        needed = expr->entry != NULL && expr->entry->type == SYM_GLOBAL_VAR;
+        break;
+    case EXPRESSION:
+        if (expr->data == NULL) {
+            needed = CALLS;
+        } else if (expr->n_children == 1) {
+            needed = MAX(1, registers_needed(expr->children[0]));
+        } else {
+            size_t left = registers_needed(expr->children[0]);
+            size_t right = registers_needed(expr->children[1]);
+            if (left == CALLS || right == CALLS)
+                needed = CALLS;
+            else if (left == right)
+                needed = left + 1;
+            else
+                needed = MAX(left, right);
+        }
+        break;
+    default:
+        break;
+    }
+    expr->registers = needed + 1;
+    return needed;
+}
+
+/* Labels every node of a tree at once, so that functions sharing subtrees
+ * (with -d) can be lowered on several threads that only read the labels.
+ */
+void label_registers(node_t *node) {
+    if (node == NULL)
+        return;
+    registers_needed(node);
+    for (uint64_t c = 0; c < node->n_children; c++)
+        label_registers(node->children[c]);
+}
+
+/* Evaluates the operand that needs more registers first, so the result of
+ * the other is not kept while it is evaluated. Calls are made in the order
+ * of the tree generator, which evaluated the right operand of products and
+ * quotients first.
+ */
+static bool right_first(tac_opcode_t opcode, node_t *left, node_t *right) {
+    size_t needed_left = registers_needed(left);
+    size_t needed_right = registers_needed(right);
+    if (needed_left != CALLS && needed_right != CALLS &&
+        needed_left != needed_right)
+        return needed_right > needed_left;
+    return opcode == TAC_MULTIPLY || opcode == TAC_DIVIDE;
+}
+
+static tac_operand_t lower_binary(lowering_t *l, tac_opcode_t opcode,
+                                  node_t *left, node_t *right) {
+    tac_instruction_t instruction = {.opcode = opcode};
+    if (right_first(opcode, left, right)) {
+        instruction.right = lower_expression(l, right);
+        instruction.left = lower_expression(l, left);
+    } else {
+        instruction.left = lower_expression(l, left);
+        instruction.right = lower_expression(l, right);
+    }
+    instruction.result = temporary(l);
+    *append(l, opcode) = instruction;
+    return instruction.result;
+}
+
+static tac_operand_t lower_call(lowering_t *l, node_t *call) {
+    tac_function_t *code = l->code;
+    size_t n_arguments = 0;
+    if (call->children[1] != NULL)
+        n_arguments = call->children[1]->n_children;
+    symbol_t *function = call->children[0]->entry;
+    if (function->type != SYM_FUNCTION || n_arguments != function->nparms) {
+        l->ctx->error_line = call->children[0]->line;
+        compile_error(
+            l->ctx, "Function %s has %zu parameters, called with %zu arguments",
+            (char *)call->children[0]->data, (size_t)function->nparms,
+            n_arguments);
+    }
+
+    // The last argument is evaluated first
+    tac_operand_t arguments[n_arguments + 1];
+    for (size_t a = n_arguments; a > 0; a--)
+        arguments[a - 1] = lower_expression(l, call->children[1]->children[a - 1]);
+    size_t first = tac_add_arguments(code, n_arguments);
+    memcpy(&code->arguments[first], arguments,
+           n_arguments * sizeof(tac_operand_t));
+
+    tac_instruction_t *instruction = append(l, TAC_CALL);
+    instruction->function = function;
+    instruction->first_argument = first;
+    instruction->n_arguments = n_arguments;
+    instruction->result = temporary(l);
+    return instruction->result;
+}
+
+static tac_operand_t lower_expression(lowering_t *l, node_t *expr) {
+    tac_operand_t operand;
+    tac_instruction_t *instruction;
+    switch (expr->type) {
+    case IDENTIFIER_DATA:
+        operand = variable_operand(l, expr);
+        if (operand.kind != TAC_GLOBAL)
+            return operand;
+        // Globals are read when the tree generator read them, as calls
+        // made later may change them
+        instruction = append(l, TAC_MOVE);
+        instruction->left = operand;
+        instruction->result = temporary(l);
+        return instruction->result;
+    case NUMBER_DATA:
+        return constant_operand(*(int64_t *)expr->data);
+    case EXPRESSION:
+        break;
+    default:
+        ICE("invalid expression");
+    }
+
+    if (expr->data == NULL)
+        return lower_call(l, expr);
+    if (expr->n_children == 1) {
+        operand = lower_expression(l, expr->children[0]);
+        switch (*(char *)expr->data) {
+        case '-':
+            instruction = append(l, TAC_NEGATE);
+            break;
+        case '~':
+            instruction = append(l, TAC_NOT);
+            break;
+        default:
+            ICE("invalid unary operator");
+        }
+        instruction->left = operand;
+        instruction->result = temporary(l);
+        return instruction->result;
+    }
+
+    node_t *left = expr->children[0], *right = expr->children[1];
+    switch (*(char *)expr->data) {
+    case '+':
+        return lower_binary(l, TAC_ADD, left, right);
+    case '-':
+        return lower_binary(l, TAC_SUBTRACT, left, right);
+    case '*':
+        return lower_binary(l, TAC_MULTIPLY, left, right);
+    case '/':
+        return lower_binary(l, TAC_DIVIDE, left, right);
+    case '|':
+        return lower_binary(l, TAC_OR, left, right);
+    case '^':
+        return lower_binary(l, TAC_XOR, left, right);
+    case '&':
+        return lower_binary(l, TAC_AND, left, right);
+    default:
+        ICE("invalid binary operator");
+        return operand;
+    }
+}
+
+/* The right side is evaluated before the variable is read */
+static void lower_assignment(lowering_t *l, node_t *statement) {
+    tac_operand_t target = variable_operand(l, statement->children[0]);
+    tac_operand_t source = lower_expression(l, statement->children[1]);
+    tac_opcode_t opcode = TAC_MOVE;
+    switch (statement->type) {
+    case ASSIGNMENT_STATEMENT:
+        break;
+    case ADD_STATEMENT:
+        opcode = TAC_ADD;
+        break;
+    case SUBTRACT_STATEMENT:
+        opcode = TAC_SUBTRACT;
+        break;
+    case MULTIPLY_STATEMENT:
+        opcode = TAC_MULTIPLY;
+        break;
+    case DIVIDE_STATEMENT:
+        opcode = TAC_DIVIDE;
+        break;
+    default:
+        ICE("invalid assignment");
+    }
+
+    tac_block_t *block = &l->code->blocks[l->block];
+    tac_instruction_t *last = NULL;
+    if (block->n_instructions > 0)
+        last = &block->instructions[block->n_instructions - 1];
+    if (opcode == TAC_MOVE && target.kind == TAC_VALUE && last != NULL &&
+        source.kind == TAC_VALUE && last->result.kind == TAC_VALUE &&
+        last->result.number == source.number &&
+        l->code->variables[source.number] == NULL) {
+        // The temporary just computed is the variable instead
+        last->result = target;
+        return;
+    }
+
+    tac_instruction_t *instruction;
+    if (opcode != TAC_MOVE && target.kind == TAC_GLOBAL) {
+        instruction = append(l, TAC_MOVE);
+        instruction->left = target;
+        instruction->result = temporary(l);
+        tac_operand_t loaded = instruction->result;
+        instruction = append(l, opcode);
+        instruction->left = loaded;
+        instruction->right = source;
+        instruction->result = temporary(l);
+        source = instruction->result;
+        opcode = TAC_MOVE;
+    }
+    instruction = append(l, opcode);
+    instruction->result = target;
+    if (opcode == TAC_MOVE) {
+        instruction->left = source;
+    } else {
+        instruction->left = target;
+        instruction->right = source;
+    }
+}
+
+static void lower_print(lowering_t *l, node_t *statement) {
+    node_t *item = NULL;
+    for (size_t i = 0; i < statement->n_children; i++) {
+        item = statement->children[i];
+        tac_instruction_t instruction = {.opcode = TAC_PRINT_INT};
+        if (item->type == STRING_DATA) {
+            instruction.opcode = TAC_PRINT_TEXT;
+            instruction.left = (tac_operand_t){
+                .kind = TAC_STRING, .number = *(size_t *)item->data};
+        } else {
+            instruction.left = lower_expression(l, item);
+        }
+        *append(l, instruction.opcode) = instruction;
+    }
+    // Strings that end a statement hold its newline
+    if (item == NULL || item->type != STRING_DATA)
+        append(l, TAC_PRINT_NEWLINE);
+}
+
+/* Branch to the successor if the relation holds, or else to the block
+ * given by the caller when it is made
+ */
+static void lower_relation(lowering_t *l, node_t *relation, size_t then) {
+    tac_instruction_t instruction = {.opcode = TAC_BRANCH};
+    switch (*(char *)relation->data) {
+    case '<':
+        instruction.relation = TAC_LESS;
+        break;
+    case '>':
+        instruction.relation = TAC_GREATER;
+        break;
+    case '=':
+        instruction.relation = TAC_EQUAL;
+        break;
+    default:
+        ICE("invalid relation");
+    }
+    node_t *left = relation->children[0], *right = relation->children[1];
+    if (right_first(TAC_BRANCH, left, right)) {
+        instruction.right = lower_expression(l, right);
+        instruction.left = lower_expression(l, left);
+    } else {
+        instruction.left = lower_expression(l, left);
+        instruction.right = lower_expression(l, right);
+    }
+    *append(l, TAC_BRANCH) = instruction;
+    tac_block_t *block = &l->code->blocks[l->block];
+    block->successors[0] = then;
+    block->successors[1] = NO_BLOCK;
+    block->n_successors = 2;
+}
+
+/* Blocks are made in the order of the source, which is the order the
+ * generator lays them out in, but for returns before the end
+ */
+static void lower_if(lowering_t *l, node_t *statement) {
+    size_t test = l->block;
+    size_t then = tac_new_block(l->code);
+    lower_relation(l, statement->children[0], then);
+    l->block = then;
+    lower_statement(l, statement->children[1]);
+    size_t then_end = l->block, else_end = NO_BLOCK;
+    if (statement->n_children == 3) {
+        l->block = tac_new_block(l->code);
+        l->code->blocks[test].successors[1] = l->block;
+        lower_statement(l, statement->children[2]);
+        else_end = l->block;
+    }
+
+    size_t end = tac_new_block(l->code);
+    if (else_end == NO_BLOCK)
+        l->code->blocks[test].successors[1] = end;
+    else {
+        l->block = else_end;
+        jump(l, end);
+    }
+    l->block = then_end;
+    jump(l, end);
+    l->block = end;
+}
+
+/* Loops are rotated: the test is made once before the body, to skip it,
+ * and again after it, to go back, so each round takes one branch
+ */
+static void lower_while(lowering_t *l, node_t *statement) {
+    size_t guard = l->block;
+    size_t body = tac_new_block(l->code);
+    lower_relation(l, statement->children[0], body);
+
+    bool outer_in_loop = l->in_loop;
+    size_t outer_continues = l->continues;
+    l->in_loop = true;
+    l->continues = NO_BLOCK;
+    l->block = body;
+    lower_statement(l, statement->children[1]);
+    if (l->continues != NO_BLOCK) {
+        size_t test = tac_new_block(l->code);
+        jump(l, test);
+        while (l->continues != NO_BLOCK) {
+            size_t *successor = &l->code->blocks[l->continues].successors[0];
+            l->continues = *successor;
+            *successor = test;
+        }
+        l->block = test;
+    }
+    size_t latch = l->block;
+    lower_relation(l, statement->children[0], body);
+    l->in_loop = outer_in_loop;
+    l->continues = outer_continues;
+
+    l->block = tac_new_block(l->code);
+    l->code->blocks[guard].successors[1] = l->block;
+    l->code->blocks[latch].successors[1] = l->block;
+}
+
+static void lower_statement(lowering_t *l, node_t *node) {
+    tac_operand_t operand;
+    if (node == NULL)
+        return;
+    switch (node->type) {
+    case PRINT_STATEMENT:
+        lower_print(l, node);
+        break;
+    case ASSIGNMENT_STATEMENT:
+    case ADD_STATEMENT:
+    case SUBTRACT_STATEMENT:
+    case MULTIPLY_STATEMENT:
+    case DIVIDE_STATEMENT:
+        lower_assignment(l, node);
+        break;
+    case RETURN_STATEMENT:
+        operand = lower_expression(l, node->children[0]);
+        append(l, TAC_RETURN)->left = operand;
+        // What follows is unreachable, up to the next label
+        l->block = tac_new_block(l->code);
+        break;
+    case IF_STATEMENT:
+        lower_if(l, node);
+        break;
+    case WHILE_STATEMENT:
+        lower_while(l, node);
+        break;
+    case NULL_STATEMENT:
+        if (!l->in_loop) {
+            l->ctx->error_line = node->line;
+            compile_error(l->ctx, "continue outside of a loop");
+        }
+        jump(l, l->continues);
+        l->continues = l->block;
+        l->block = tac_new_block(l->code);
+        break;
+    case DECLARATION_LIST:
+        break;
+    default:
+        for (size_t i = 0; i < node->n_children; i++)
+            lower_statement(l, node->children[i]);
+        break;
+    }
+}
+
+/* Move each block to the place it is numbered, and its successors with it.
+ * Blocks numbered NO_BLOCK are left out, but keep their instruction lists
+ * for reuse.
+ */
+void tac_move_blocks(tac_function_t *code, size_t *number) {
+    size_t n_kept = 0;
+    for (size_t b = 0; b < code->n_blocks; b++)
+        n_kept += number[b] != NO_BLOCK;
+    tac_block_t *moved = malloc(code->n_blocks * sizeof(tac_block_t));
+    for (size_t b = 0, n_left_out = n_kept; b < code->n_blocks; b++)
+        moved[number[b] != NO_BLOCK ? number[b] : n_left_out++] =
+            code->blocks[b];
+    memcpy(code->blocks, moved, code->n_blocks * sizeof(tac_block_t));
+    free(moved);
+    code->n_blocks = n_kept;
+    for (size_t b = 0; b < code->n_blocks; b++)
+        for (size_t s = 0; s < code->blocks[b].n_successors; s++)
+            code->blocks[b].successors[s] =
+                number[code->blocks[b].successors[s]];
+}
+
+/* Code after a return or continue is left out, and the blocks that remain
+ * keep their order
+ */
+void tac_remove_unreachable_blocks(tac_function_t *code) {
+    size_t *number = code->block_numbers, *work = code->predecessors;
+    for (size_t b = 0; b < code->n_blocks; b++)
+        number[b] = NO_BLOCK;
+    size_t n_work = 0;
+    number[0] = 0;
+    work[n_work++] = 0;
+    while (n_work > 0) {
+        tac_block_t *block = &code->blocks[work[--n_work]];
+        for (size_t s = 0; s < block->n_successors; s++)
+            if (number[block->successors[s]] == NO_BLOCK) {
+                number[block->successors[s]] = 0;
+                work[n_work++] = block->successors[s];
+            }
+    }
+
+    for (size_t b = 0, n_kept = 0; b < code->n_blocks; b++)
+        if (number[b] != NO_BLOCK)
+            number[b] = n_kept++;
+    tac_move_blocks(code, number);
+}
+
+/* Returns before the end of the function are laid out after the rest,
+ * where the branches to them are taken, and the other way is fallen into
+ */
+static void lay_out_blocks(tac_function_t *code) {
+    size_t *number = code->block_numbers, n_placed = 0;
+    for (int early = 0; early < 2; early++)
+        for (size_t b = 0; b < code->n_blocks; b++) {
+            tac_block_t *block = &code->blocks[b];
+            tac_opcode_t last =
+                block->instructions[block->n_instructions - 1].opcode;
+            if ((last == TAC_RETURN && b + 1 < code->n_blocks) == early)
+                number[b] = n_placed++;
+        }
+    tac_move_blocks(code, number);
+}
+
+void tac_find_predecessors(tac_function_t *code) {
+    size_t n_edges = 0;
+    for (size_t b = 0; b < code->n_blocks; b++)
+        code->blocks[b].n_predecessors = 0;
+    for (size_t b = 0; b < code->n_blocks; b++)
+        for (size_t s = 0; s < code->blocks[b].n_successors; s++)
+            code->blocks[code->blocks[b].successors[s]].n_predecessors += 1;
+    for (size_t b = 0; b < code->n_blocks; b++) {
+        code->blocks[b].first_predecessor = n_edges;
+        n_edges += code->blocks[b].n_predecessors;
+        code->blocks[b].n_predecessors = 0;
+    }
+    for (size_t b = 0; b < code->n_blocks; b++)
+        for (size_t s = 0; s < code->blocks[b].n_successors; s++) {
+            tac_block_t *successor = &code->blocks[code->blocks[b].successors[s]];
+            code->predecessors[successor->first_predecessor +
+                               successor->n_predecessors++] = b;
+        }
+}
+
+/* Variables are shown by name, and values of a name after its first by
+ * number as well, temporaries by number alone
+ */
+static void print_operand(vslc_context_t *ctx, tac_function_t *code,
+                          tac_operand_t *op) {
+    symbol_t *variable;
+    switch (op->kind) {
+    case TAC_VALUE:
+        variable = code->variables[op->number];
+        if (variable == NULL) {
+            emit(ctx->code, "%%%u", (size_t)op->number);
+            return;
+        }
+        emit(ctx->code, "%%%s", variable->name);
+        for (size_t v = 0; v < (size_t)op->number; v++)
+            if (code->variables[v] != NULL &&
+                !strcmp(code->variables[v]->name, variable->name)) {
+                emit(ctx->code, ".%u", (size_t)op->number);
+                return;
+            }
+        break;
+    case TAC_CONSTANT:
+        emit(ctx->code, "%d", op->number);
+        break;
+    case TAC_GLOBAL:
+        emit(ctx->code, "@%s", op->global->name);
+        break;
+    case TAC_STRING:
+        emit_string(ctx->code,
+                    ctx->string_list[op->number - ctx->string_base]);
+        break;
+    case TAC_NONE:
+        break;
+    }
+}
@@ -1,42 +1,103 @@
 #include <vslc.h>
 
-static void node_print ( node_t *root, int nesting );
-static void simplify_tree ( node_t **simplified, node_t *root );
-static void node_finalize ( node_t *discard );
+static void node_print ( FILE *out, node_t *root, int nesting );
+static void simplify_tree (
+    vslc_context_t *ctx, node_t **simplified, node_t *root
+);
+static void node_finalize ( vslc_context_t *ctx, node_t *discard );
 
 typedef struct stem_t *stem;
 struct stem_t { const char *str; stem next; };
 static void
-tree_print(node_t* root, stem head);
+tree_print(FILE *out, node_t* root, stem head);
 
 
-static void destroy_subtree ( node_t *discard );
+static node_t *hash_cons ( vslc_context_t *ctx, node_t *node );
+
+typedef struct {
+    node_index_t type;
+    char operator;
+    int64_t value;
+    symbol_t *entry;
+    node_t *children[2];
+} cons_key_t;
 
 
 /* External interface */
 void
-destroy_syntax_tree ( void )
+destroy_syntax_tree ( vslc_context_t *ctx )
 {
-    destroy_subtree ( root );
+    destroy_subtree ( ctx, ctx->root );
+    ctx->root = NULL;
+    if ( ctx->shared_nodes != NULL )
+    {
+        size_t n_shared = tlhash_size ( ctx->shared_nodes );
+        node_t *shared_list[n_shared];
+        tlhash_values ( ctx->shared_nodes, (void **)&shared_list );
+        for ( size_t i=0; i<n_shared; i++ )
+            node_finalize ( ctx, shared_list[i] );
+        tlhash_finalize ( ctx->shared_nodes );
+        tlhash_finalize ( ctx->cons_table );
+        free ( ctx->shared_nodes );
+        free ( ctx->cons_table );
+        ctx->shared_nodes = ctx->cons_table = NULL;
+    }
 }
 
 
+/* Replace structurally identical pure expressions (numbers, variables and
+ * operators over them) with one shared node. Runs after name binding, as
+ * identifiers with the same name may refer to different symbols.
+ */
 void
-simplify_syntax_tree ( void )
+hash_cons_syntax_tree ( vslc_context_t *ctx )
 {
-    simplify_tree ( &root, root );
+    ctx->cons_table = malloc ( sizeof(tlhash_t) );
+    ctx->shared_nodes = malloc ( sizeof(tlhash_t) );
+    tlhash_init ( ctx->cons_table, 1024 );
+    tlhash_init ( ctx->shared_nodes, 1024 );
+    ctx->root = hash_cons ( ctx, ctx->root );
 }
 
 
-extern bool new_print_style;
 void
-print_syntax_tree ( void )
+simplify_syntax_tree ( vslc_context_t *ctx )
 {
-    if (new_print_style)
-        tree_print ( root, 0 );
+    simplify_tree ( ctx, &ctx->root, ctx->root );
+}
+
+
+void
+print_syntax_tree ( vslc_context_t *ctx )
+{
+    if (ctx->options.new_print_style)
+        tree_print ( ctx->out, ctx->root, 0 );
     // Old tree printing
     else
-        node_print ( root, 0 );
+        node_print ( ctx->out, ctx->root, 0 );
+}
+
+
+node_t *
+node_alloc ( vslc_context_t *ctx )
+{
+    node_t *node = ctx->free_nodes;
+    if ( node == NULL )
+        return malloc ( sizeof(node_t) );
+    ctx->free_nodes = node->data;
+    return node;
+}
+
+
+void
+destroy_node_pool ( vslc_context_t *ctx )
+{
+    while ( ctx->free_nodes != NULL )
+    {
+        node_t *node = ctx->free_nodes;
+        ctx->free_nodes = node->data;
+        free ( node );
+    }
 }
 
 
@@ -59,7 +120,7 @@ node_init (node_t *nd, node_index_t type, void *data, uint64_t n_children, ...)
 
 
 static void
-tree_print(node_t* root, stem head) 
+tree_print(FILE *out, node_t* root, stem head)
 {
     static const char *sdown = " │", *slast = " └", *snone = "  ";
     struct stem_t col = {0, 0}, *tail;
@@ -68,27 +129,27 @@ tree_print(node_t* root, stem head)
     for (tail = head; tail; tail = tail->next) {
         if (!tail->next) {
             if (!strcmp(sdown, tail->str))
-                printf(" ├");
+                fprintf(out, " ├");
             else 
-                printf("%s", tail->str);
+                fprintf(out, "%s", tail->str);
             break;
         }
-        printf("%s", tail->str);
+        fprintf(out, "%s", tail->str);
     }
     
     if (root == NULL) {
         // Secure against null pointers sent as root
-        printf("─(nil)\n");
+        fprintf(out, "─(nil)\n");
         return;
     }
-    printf("─%s", node_string[root->type]);
+    fprintf(out, "─%s", node_string[root->type]);
     if ( root->type == IDENTIFIER_DATA ||
          root->type == STRING_DATA ||
          root->type == EXPRESSION ) 
-        printf("(%s)", (char *) root->data);
+        fprintf(out, "(%s)", (char *) root->data);
     else if (root->type == NUMBER_DATA)
-        printf("(%ld)", *((int64_t *)root->data));
-    putchar('\n');
+        fprintf(out, "(%ld)", *((int64_t *)root->data));
+    putc('\n', out);
  
     if (!root->n_children) return;
  
@@ -100,66 +161,131 @@ tree_print(node_t* root, stem head)
 
     for ( int64_t i=0; i < root->n_children; i++ ) {
         col.str = root->n_children - i - 1 ? sdown : slast;
-        tree_print(root->children[i], head);
+        tree_print(out, root->children[i], head);
     }
     tail->next = 0;
 }
 
 /* Internal choices */
 static void
-node_print ( node_t *root, int nesting )
+node_print ( FILE *out, node_t *root, int nesting )
 {
     if ( root != NULL )
     {
-        printf ( "%*c%s", nesting, ' ', node_string[root->type] );
+        fprintf ( out, "%*c%s", nesting, ' ', node_string[root->type] );
         if ( root->type == IDENTIFIER_DATA ||
              root->type == STRING_DATA ||
              root->type == EXPRESSION ) 
-            printf ( "(%s)", (char *) root->data );
+            fprintf ( out, "(%s)", (char *) root->data );
         else if ( root->type == NUMBER_DATA )
-            printf ( "(%ld)", *((int64_t *)root->data) );
-        putchar ( '\n' );
+            fprintf ( out, "(%ld)", *((int64_t *)root->data) );
+        putc ( '\n', out );
         for ( int64_t i=0; i<root->n_children; i++ )
-            node_print ( root->children[i], nesting+1 );
+            node_print ( out, root->children[i], nesting+1 );
     }
     else
-        printf ( "%*c%p\n", nesting, ' ', root );
+        fprintf ( out, "%*c%p\n", nesting, ' ', root );
 }
 
 
+/* Finalized nodes are kept for reuse by later compilations in the context,
+ * chained through their data pointer
+ */
 static void
-node_finalize ( node_t *discard )
+node_finalize ( vslc_context_t *ctx, node_t *discard )
 {
     if ( discard != NULL )
     {
         free ( discard->data );
         free ( discard->children );
-        free ( discard );
+        discard->data = ctx->free_nodes;
+        ctx->free_nodes = discard;
     }
 }
 
 
-static void
-destroy_subtree ( node_t *discard )
+static bool
+is_shared ( vslc_context_t *ctx, node_t *node )
 {
-    if ( discard != NULL )
+    void *found;
+    return ctx->shared_nodes != NULL && tlhash_lookup (
+        ctx->shared_nodes, &node, sizeof(node_t *), &found
+    ) == TLHASH_SUCCESS;
+}
+
+
+static node_t *
+hash_cons ( vslc_context_t *ctx, node_t *node )
+{
+    if ( node == NULL )
+        return NULL;
+    for ( uint64_t i=0; i<node->n_children; i++ )
+        node->children[i] = hash_cons ( ctx, node->children[i] );
+
+    cons_key_t key;
+    memset ( &key, 0, sizeof(cons_key_t) );
+    key.type = node->type;
+    switch ( node->type )
+    {
+        case NUMBER_DATA:
+            key.value = *((int64_t *)node->data);
+            break;
+        case IDENTIFIER_DATA:
+            if ( node->entry == NULL || node->entry->type == SYM_FUNCTION )
+                return node;
+            key.entry = node->entry;
+            break;
+        case EXPRESSION:
+            /* Function calls are not pure */
+            if ( node->data == NULL || node->n_children > 2 )
+                return node;
+            key.operator = *((char *)node->data);
+            for ( uint64_t i=0; i<node->n_children; i++ )
+            {
+                if ( !is_shared ( ctx, node->children[i] ) )
+                    return node;
+                key.children[i] = node->children[i];
+            }
+            break;
+        default:
+            return node;
+    }
+
+    node_t *canonical;
+    if ( tlhash_lookup ( ctx->cons_table, &key, sizeof(cons_key_t),
+            (void **)&canonical ) == TLHASH_SUCCESS )
+    {
+        /* The children are shared, only this node is a duplicate */
+        node_finalize ( ctx, node );
+        return canonical;
+    }
+    tlhash_insert ( ctx->cons_table, &key, sizeof(cons_key_t), node );
+    tlhash_insert ( ctx->shared_nodes, &node, sizeof(node_t *), node );
+    return node;
+}
+
+
+void
+destroy_subtree ( vslc_context_t *ctx, node_t *discard )
+{
+    if ( discard != NULL && !is_shared ( ctx, discard ) )
     {
         for ( uint64_t i=0; i<discard->n_children; i++ )
-            destroy_subtree ( discard->children[i] );
-        node_finalize ( discard );
+            destroy_subtree ( ctx, discard->children[i] );
+        node_finalize ( ctx, discard );
     }
 }
 
 
 static void
-simplify_tree ( node_t **simplified, node_t *root )
+simplify_tree ( vslc_context_t *ctx, node_t **simplified, node_t *root )
 {
     if ( root == NULL )
         return;
 
     /* Simplify subtrees before examining this node */
     for ( uint64_t i=0; i<root->n_children; i++ )
-        simplify_tree ( &root->children[i], root->children[i] );
+        simplify_tree ( ctx, &root->children[i], root->children[i] );
 
     node_t *discard, *result = root;
     switch ( root->type )
@@ -168,12 +294,13 @@ simplify_tree ( node_t **simplified, node_t *root )
         case PARAMETER_LIST: case ARGUMENT_LIST:
         case STATEMENT: case PRINT_ITEM: case GLOBAL:
             result = root->children[0];
-            node_finalize ( root );
+            node_finalize ( ctx, root );
             break;
         case PRINT_STATEMENT:
             result = root->children[0];
             result->type = PRINT_STATEMENT;
-            node_finalize(root);
+            node_finalize ( ctx, root );
+            break;
         /* Flatten lists:
          * Take left child, append right child, substitute left for root.
          */
@@ -187,7 +314,7 @@ simplify_tree ( node_t **simplified, node_t *root )
                     result->children, result->n_children * sizeof(node_t *)
                 );
                 result->children[result->n_children-1] = root->children[1];
-                node_finalize ( root );
+                node_finalize ( ctx, root );
             }
             break;
         case EXPRESSION:
@@ -199,12 +326,12 @@ simplify_tree ( node_t **simplified, node_t *root )
                         result = root->children[0];
                         if ( root->data != NULL )
                             *((int64_t *)result->data) *= -1;
-                        node_finalize (root);
+                        node_finalize ( ctx, root );
                     }
                     else if ( root->data == NULL )
                     {
                         result = root->children[0];
-                        node_finalize (root);
+                        node_finalize ( ctx, root );
                     }
                     break;
                 case 2:
@@ -215,6 +342,16 @@ simplify_tree ( node_t **simplified, node_t *root )
                         int64_t
                             *x = result->data,
                             *y = root->children[1]->data;
+                        /* Folding these would trap in the compiler */
+                        if ( *((char *)root->data) == '/' &&
+                             ( *y == 0 || ( *x == INT64_MIN && *y == -1 ) )
+                        ) {
+                            ctx->error_line = root->line;
+                            compile_error ( ctx, *y == 0
+                                ? "Division by zero in a constant expression"
+                                : "Overflow in a constant division"
+                            );
+                        }
                         switch ( *((char *)root->data) )
                         {
                             case '+': *x += *y; break;
@@ -222,8 +359,8 @@ simplify_tree ( node_t **simplified, node_t *root )
                             case '*': *x *= *y; break;
                             case '/': *x /= *y; break;
                         }
-                        node_finalize ( root->children[1] );
-                        node_finalize ( root );
+                        node_finalize ( ctx, root->children[1] );
+                        node_finalize ( ctx, root );
                     }
                     break;
             }
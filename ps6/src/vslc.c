@@ -1,46 +1,252 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <vslc.h>
+#include <string.h>
+#include <unistd.h>
 
-// Fix error about implicit declaration
-extern int yyparse(void);
-
-/* Global state */
-
-node_t *root;             // Syntax tree
-tlhash_t *global_names;   // Symbol table
-char **string_list;       // List of strings in the source
-size_t n_string_list = 8; // Initial string list capacity (grow on demand)
-size_t stringc = 0;       // Initial string count
+#include <batch.h>
+#include <driver.h>
+#include <libvslc.h>
+#include <lsp.h>
+#include <server.h>
 
 /* Command line option parsing for the main function */
 static void options(int argc, char **argv);
-bool print_full_tree = false, print_simplified_tree = false,
-     print_symbol_table_contents = false, print_generated_program = true,
-     new_print_style = true;
+static vslc_options_t compile_options;
+static char *export_path = NULL;
+static char **import_paths;
+static size_t n_imports = 0;
+static char *server_path = NULL, *client_path = NULL;
+static bool language_server = false;
+static bool streaming = false;
+static int n_workers = 0;
+static char **batch_paths, *output_path = NULL;
+static size_t n_batch_paths = 0;
+static bool assembly_only = false, report_stages = false;
+static bool linking = false; // The output is an executable
+
+static void write_output(const char *output, size_t length);
+static size_t parse_size(const char *text);
+static int compile_streaming(const char *interfaces, size_t interfaces_length,
+                             FILE *output);
 
 /* Entry point */
 int main(int argc, char **argv) {
     options(argc, argv);
+    if (server_path != NULL)
+        return serve(server_path, n_workers, &compile_options); // server.c
+    if (language_server)
+        return serve_language(stdin, stdout); // In lsp.c
 
-    yyparse(); // Generated from grammar/bison, constructs syntax tree
+    // Interface summaries can be concatenated
+    size_t interfaces_length = 0;
+    char *interfaces = NULL;
+    for (size_t i = 0; i < n_imports; i++) {
+        FILE *summary = fopen(import_paths[i], "r");
+        if (summary == NULL) {
+            perror(import_paths[i]);
+            exit(EXIT_FAILURE);
+        }
+        size_t length;
+        char *text = read_file(summary, &length);
+        fclose(summary);
+        interfaces = realloc(interfaces, interfaces_length + length + 1);
+        memcpy(interfaces + interfaces_length, text, length);
+        interfaces_length += length;
+        interfaces[interfaces_length++] = '\n';
+        free(text);
+    }
+
+    if (n_batch_paths > 0) {
+        int status = compile_batch(batch_paths, n_batch_paths, // In batch.c
+                                   output_path ? output_path : ".",
+                                   n_workers,
+                                   &compile_options, interfaces,
+                                   interfaces_length, report_stages);
+        free(interfaces);
+        free(import_paths);
+        return status;
+    }
+    driver_t driver; // In driver.c
+    if (linking && start_driver(&driver) != 0)
+        exit(EXIT_FAILURE);
+    driver.freestanding = compile_options.freestanding;
+    if (streaming && client_path == NULL) {
+        FILE *output = linking ? driver.assembly : stdout;
+        if (!linking && output_path != NULL &&
+            (output = fopen(output_path, "w")) == NULL) {
+            perror(output_path);
+            exit(EXIT_FAILURE);
+        }
+        int status = compile_streaming(interfaces, interfaces_length, output);
+        if (linking && status == EXIT_SUCCESS)
+            status = finish_driver(&driver, output_path, report_stages);
+        else if (linking)
+            cancel_driver(&driver);
+        else if (output != stdout)
+            fclose(output);
+        free(interfaces);
+        free(import_paths);
+        return status;
+    }
+
+    size_t length;
+    char *source = read_file(stdin, &length);
+
+    vslc_result_t result;
+    int status;
+    vslc_context_t *context = NULL;
+    if (client_path != NULL) {
+        status = compile_remote(client_path, &compile_options, interfaces,
+                                interfaces_length, source, length, &result);
+    } else {
+        context = vslc_context_create(&compile_options);
+        if (vslc_import_interface(context, interfaces, interfaces_length)) {
+            fprintf(stderr, "malformed interface summary\n");
+            exit(EXIT_FAILURE);
+        }
+        // The assembler takes the code while the rest is generated
+        status = vslc_compile_to(context, source, length, // In libvslc.c
+                                 linking ? driver.assembly : NULL, &result);
+    }
+    fwrite(result.diagnostics, 1, result.diagnostics_length, stderr);
+    if (!linking) {
+        write_output(result.output, result.output_length);
+    } else if (status != EXIT_SUCCESS) {
+        cancel_driver(&driver);
+    } else {
+        // Code from a server arrives whole, and is passed on as it is
+        if (client_path != NULL)
+            fwrite(result.output, 1, result.output_length, driver.assembly);
+        else
+            fwrite(result.output, 1, result.output_length, stdout);
+        status = finish_driver(&driver, output_path, report_stages);
+    }
 
-    if (print_full_tree)
-        print_syntax_tree();
-    simplify_syntax_tree(); // In tree.c
-    if (print_simplified_tree)
-        print_syntax_tree();
+    if (status == EXIT_SUCCESS && export_path != NULL) {
+        FILE *summary = fopen(export_path, "w");
+        if (summary == NULL) {
+            perror(export_path);
+            exit(EXIT_FAILURE);
+        }
+        fwrite(result.interface, 1, result.interface_length, summary);
+        fclose(summary);
+    }
+
+    vslc_result_free(&result);
+    vslc_context_destroy(context);
+    free(interfaces);
+    free(import_paths);
+    free(source);
+    return status;
+}
+
+/* The source is read twice, so a pipe is first copied to a temporary file */
+static int compile_streaming(const char *interfaces, size_t interfaces_length,
+                             FILE *output) {
+    FILE *source = stdin;
+    if (fseek(stdin, 0, SEEK_SET) != 0) {
+        source = tmpfile();
+        if (source == NULL) {
+            perror("tmpfile");
+            exit(EXIT_FAILURE);
+        }
+        char buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+            fwrite(buffer, 1, n, source);
+        rewind(source);
+    }
+
+    vslc_context_t *context = vslc_context_create(&compile_options);
+    if (vslc_import_interface(context, interfaces, interfaces_length)) {
+        fprintf(stderr, "malformed interface summary\n");
+        exit(EXIT_FAILURE);
+    }
+    char *interface = NULL;
+    size_t interface_length = 0;
+    FILE *summary = NULL;
+    if (export_path != NULL)
+        summary = open_memstream(&interface, &interface_length);
+    int status =
+        vslc_compile_stream(context, source, output, stderr, summary);
+    if (summary != NULL)
+        fclose(summary);
+
+    if (status == EXIT_SUCCESS && export_path != NULL) {
+        FILE *out = fopen(export_path, "w");
+        if (out == NULL) {
+            perror(export_path);
+            exit(EXIT_FAILURE);
+        }
+        fwrite(interface, 1, interface_length, out);
+        fclose(out);
+    }
+    free(interface);
+    vslc_context_destroy(context);
+    if (source != stdin)
+        fclose(source);
+    return status;
+}
 
-    create_symbol_table(); // In ir.c
-    if (print_symbol_table_contents)
-        print_symbol_table();
+char *read_file(FILE *in, size_t *length) {
+    size_t capacity = 4096;
+    char *buffer = malloc(capacity);
+    *length = 0;
+    size_t n;
+    while ((n = fread(buffer + *length, 1, capacity - *length, in)) > 0) {
+        *length += n;
+        if (*length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    return buffer;
+}
 
-    if (print_generated_program)
-        generate_program(); // In generator.c
+/* The whole program is written with as few calls as the system allows */
+static void write_output(const char *output, size_t length) {
+    const char *name = (output_path != NULL) ? output_path : "stdout";
+    int fd = STDOUT_FILENO;
+    if (output_path != NULL)
+        fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    while (fd >= 0 && length > 0) {
+        ssize_t n = write(fd, output, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        output += n;
+        length -= n;
+    }
+    if (fd < 0 || length > 0) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    if (fd != STDOUT_FILENO)
+        close(fd);
+}
 
-    destroy_syntax_tree();  // In tree.c
-    destroy_symbol_table(); // In ir.c
+static size_t parse_size(const char *text) {
+    char *suffix;
+    size_t size = strtoull(text, &suffix, 10);
+    switch (*suffix) {
+    case 'G':
+        size <<= 10; // Fall through
+    case 'M':
+        size <<= 10; // Fall through
+    case 'k':
+        size <<= 10;
+        suffix += 1;
+        break;
+    }
+    if (suffix == text || *suffix != '\0') {
+        fprintf(stderr, "%s: not a size\n", text);
+        exit(EXIT_FAILURE);
+    }
+    return size;
 }
 
 static const char *usage =
@@ -50,31 +256,156 @@ static const char *usage =
     "\t-T\tOutput the simplified syntax tree\n"
     "\t-s\tOutput the symbol table contents\n"
     "\t-q\tQuiet: suppress output from the code generator\n"
-    "\t-u\tDo not use print style more like the tree command\n";
+    "\t-u\tDo not use print style more like the tree command\n"
+    "\t-i FILE\tImport the interface summary of a separately compiled unit\n"
+    "\t-e FILE\tExport the interface summary of this unit to FILE\n"
+    "\t-l\tLibrary unit: do not generate a program entry point\n"
+    "\t-d\tShare identical pure subexpressions as one DAG node\n"
+    "\t-S\tOutput assembly, also when written to a file with -o\n"
+    "\t-c\tOutput an ELF object file instead of assembly, without\n"
+    "\t\trunning an assembler\n"
+    "\t-j N\tThreads compiling the files given as arguments (default:\n"
+    "\t\tcores), or generating the functions of one (default: 1)\n"
+    "\t-o PATH\tBuild the executable PATH, with the system assembler and\n"
+    "\t\tlinker, or write the output of -S or -c there instead of\n"
+    "\t\tstdout. For a.vsl given as argument, write PATH/a.S or\n"
+    "\t\tPATH/a.o (default: .)\n"
+    "\t-O\tPropagate constants and remove the code they make dead\n"
+    "\t-v\tReport the time of each stage of building an executable,\n"
+    "\t\tthe throughput of compiling files given as arguments, what\n"
+    "\t\tthe peephole optimizer rewrote, and with -O, what the\n"
+    "\t\toptimizations removed\n"
+    "\t--server=SOCKET\tServe compile requests on a Unix domain socket\n"
+    "\t--workers=N\tNumber of threads serving requests (default: cores)\n"
+    "\t--client=SOCKET\tCompile through the server listening on SOCKET\n"
+    "\t--lsp\tServe editors as a language server on stdin and stdout\n"
+    "\t--freestanding\tEnter programs at _start, without the C library,\n"
+    "\t\tto link with -static -nostdlib, as -o does\n"
+    "\t--emit-ir\tOutput the three-address code of each function\n"
+    "\t\tinstead of assembly\n"
+    "\t--stream\tCompile each function as soon as it is parsed, keeping\n"
+    "\t\tonly one in memory at a time\n"
+    "\t--cache=DIR\tReuse the code of unchanged functions cached in DIR\n"
+    "\t--cache-size=N\tEvict cached functions beyond N bytes, with an\n"
+    "\t\toptional k, M or G suffix (default: 64M)\n";
+
+static const struct option long_options[] = {
+    {"server", required_argument, NULL, 'R'},
+    {"client", required_argument, NULL, 'C'},
+    {"workers", required_argument, NULL, 'W'},
+    {"lsp", no_argument, NULL, 'L'},
+    {"stream", no_argument, NULL, 'M'},
+    {"freestanding", no_argument, NULL, 'F'},
+    {"emit-ir", no_argument, NULL, 'I'},
+    {"cache", required_argument, NULL, 'K'},
+    {"cache-size", required_argument, NULL, 'Z'},
+    {0, 0, 0, 0}};
 
 static void options(int argc, char **argv) {
     int o;
-    while ((o = getopt(argc, argv, "htTsqu")) != -1) {
+    compile_options = vslc_default_options;
+    import_paths = malloc(argc * sizeof(char *));
+    while ((o = getopt_long(argc, argv, "htTsqui:e:ldScj:o:Ov", long_options,
+                            NULL)) != -1) {
         switch (o) {
         case 'h':
             printf("%s:\n%s", argv[0], usage);
             exit(EXIT_FAILURE);
             break;
         case 't':
-            print_full_tree = true;
+            compile_options.print_full_tree = true;
             break;
         case 'T':
-            print_simplified_tree = true;
+            compile_options.print_simplified_tree = true;
             break;
         case 's':
-            print_symbol_table_contents = true;
+            compile_options.print_symbol_table = true;
             break;
         case 'q':
-            print_generated_program = false;
+            compile_options.generate_program = false;
             break;
         case 'u':
-            new_print_style = false;
+            compile_options.new_print_style = false;
+            break;
+        case 'i':
+            import_paths[n_imports++] = optarg;
+            break;
+        case 'e':
+            export_path = optarg;
+            compile_options.export_interface = true;
+            break;
+        case 'l':
+            compile_options.library_unit = true;
+            break;
+        case 'd':
+            compile_options.share_expressions = true;
+            break;
+        case 'S':
+            assembly_only = true;
+            break;
+        case 'c':
+            compile_options.object_code = true;
+            break;
+        case 'j':
+            n_workers = compile_options.threads = atoi(optarg);
             break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'O':
+            compile_options.optimize = true;
+            break;
+        case 'v':
+            report_stages = compile_options.report_passes = true;
+            break;
+        case 'R':
+            server_path = optarg;
+            break;
+        case 'C':
+            client_path = optarg;
+            break;
+        case 'W':
+            n_workers = atoi(optarg);
+            break;
+        case 'L':
+            language_server = true;
+            break;
+        case 'M':
+            streaming = true;
+            break;
+        case 'F':
+            compile_options.freestanding = true;
+            break;
+        case 'I':
+            compile_options.print_ir = true;
+            break;
+        case 'K':
+            compile_options.cache_directory = optarg;
+            break;
+        case 'Z':
+            compile_options.cache_limit = parse_size(optarg);
+            break;
+        default:
+            exit(EXIT_FAILURE);
         }
     }
+    if (n_workers <= 0)
+        n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    // Any other arguments are source files to compile as a batch
+    batch_paths = argv + optind;
+    n_batch_paths = argc - optind;
+    linking = output_path != NULL && n_batch_paths == 0 && !assembly_only &&
+              !compile_options.object_code && !compile_options.print_ir;
+    if (compile_options.print_ir && compile_options.object_code) {
+        fprintf(stderr, "-c is not supported with --emit-ir\n");
+        exit(EXIT_FAILURE);
+    }
+    if (streaming && compile_options.object_code) {
+        fprintf(stderr, "-c is not supported with --stream\n");
+        exit(EXIT_FAILURE);
+    }
+    if (n_batch_paths > 0 && export_path != NULL) {
+        fprintf(stderr, "-e takes a single source on stdin\n");
+        exit(EXIT_FAILURE);
+    }
 }